@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# Benchmarks ezfs on a loop device. Every run of every workload gets a
+# freshly formatted image: ezfs_bench prepares it, the volume is remounted
+# so that the measurement starts with cold caches, and ezfs_bench times the
+# workload. One JSON object per run goes to stdout (or -o FILE).
+#
+# Usage: sudo ./bench.sh [-s IMAGE_MB] [-r RUNS] [-t THREADS] [-o FILE]
+#                        [-i IMAGE] [WORKLOAD...]
+#
+# Extra ezfs_bench options for a workload can be given in the environment,
+# e.g. BENCH_randread="-n 50000 -b 16K".
+
+set -e
+
+IMAGE_MB=1024
+RUNS=3
+THREADS=4
+OUT=/dev/stdout
+IMAGE=./ez_bench.img
+WORKLOADS="seqwrite seqread randwrite randread append create unlink rename readdir churn"
+
+while getopts "s:r:t:o:i:" opt; do
+	case $opt in
+	s) IMAGE_MB=$OPTARG ;;
+	r) RUNS=$OPTARG ;;
+	t) THREADS=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	i) IMAGE=$OPTARG ;;
+	*) sed -n '8,9p' "$0"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] && WORKLOADS="$*"
+
+cd "$(dirname "$0")"
+make -s format_disk_as_ezfs ezfs_bench
+
+LOADED=
+if ! grep -qw ezfs /proc/filesystems; then
+	insmod ez.ko
+	LOADED=1
+fi
+
+MNT=$(mktemp -d)
+truncate -s "${IMAGE_MB}M" "$IMAGE"
+DEV=$(losetup --find --show "$IMAGE")
+COUNTERS=/sys/fs/ezfs/$(basename "$DEV")
+
+cleanup() {
+	umount "$MNT" 2>/dev/null || true
+	losetup --detach "$DEV"
+	rmdir "$MNT"
+	rm -f "$IMAGE"
+	[ -n "$LOADED" ] && rmmod ez
+}
+trap cleanup EXIT
+
+KERNEL=$(uname -r)
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+for workload in $WORKLOADS; do
+	extra=BENCH_$workload
+	for run in $(seq 1 "$RUNS"); do
+		./format_disk_as_ezfs -E "$DEV" >/dev/null
+		mount -t ezfs "$DEV" "$MNT"
+		# shellcheck disable=SC2086
+		./ezfs_bench -P -t "$THREADS" ${!extra} "$workload" "$MNT"
+		umount "$MNT"
+
+		mount -t ezfs "$DEV" "$MNT"
+		# shellcheck disable=SC2086
+		result=$(./ezfs_bench -R -t "$THREADS" -c "$COUNTERS" ${!extra} \
+			"$workload" "$MNT")
+		umount "$MNT"
+
+		printf '{"run":%d,"image_mb":%d,"kernel":"%s","commit":"%s","result":%s}\n' \
+			"$run" "$IMAGE_MB" "$KERNEL" "$COMMIT" "$result" >> "$OUT"
+	done
+done
@@ -2,26 +2,68 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/iomap.h>
 #include <linux/module.h>
 #include <linux/writeback.h>
 #include <linux/fs_context.h>
 #include <linux/pagemap.h>
+#include <linux/bsearch.h>
+#include <linux/crc32.h>
+#include <linux/kobject.h>
+#include <linux/mount.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/sched/mm.h>
+#include <linux/sort.h>
+#include <linux/statfs.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
 
 #include "ezfs.h"
 #include "ezfs_ops.h"
 
-#define DEBUG
+#define CREATE_TRACE_POINTS
+#include "ezfs_trace.h"
 
+/* Build with -DDEBUG for mount and namespace chatter. Hot paths have
+ * tracepoints instead, see ezfs_trace.h.
+ */
 #ifdef DEBUG
 #define debug(x...)	pr_info(x)
 #else
 #define debug(x...)
 #endif
 
+static bool delalloc = true;
+module_param(delalloc, bool, 0644);
+MODULE_PARM_DESC(delalloc, "Place the blocks of buffered writes at writeback time");
+
+static unsigned int prealloc_max_kb = 16384;
+module_param(prealloc_max_kb, uint, 0644);
+MODULE_PARM_DESC(prealloc_max_kb, "Largest speculative preallocation past EOF in KiB (0: off)");
+
+static unsigned int readahead_kb;
+module_param(readahead_kb, uint, 0644);
+MODULE_PARM_DESC(readahead_kb, "Readahead window of opened files in KiB (0: use the device's)");
+
+static unsigned int commit_interval = 5;
+module_param(commit_interval, uint, 0644);
+MODULE_PARM_DESC(commit_interval, "Seconds a metadata change may wait for its journal commit");
+
+static bool inline_data = true;
+module_param(inline_data, bool, 0644);
+MODULE_PARM_DESC(inline_data, "Keep new files in their inode until they outgrow it");
+
 /* ezfs helper */
+static inline struct ezfs_sb_info *get_ezfs_sb_info(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
 static inline struct buffer_head *get_ezfs_sb_bh(struct super_block *sb)
 {
-	return ((struct ezfs_sb_buffer_heads *)sb->s_fs_info)->sb_bh;
+	return get_ezfs_sb_info(sb)->sb_bh;
 }
 
 static inline struct ezfs_super_block *get_ezfs_sb(struct super_block *sb)
@@ -29,306 +71,3643 @@ static inline struct ezfs_super_block *get_ezfs_sb(struct super_block *sb)
 	return (struct ezfs_super_block *) get_ezfs_sb_bh(sb)->b_data;
 }
 
-static inline struct buffer_head *get_ezfs_i_bh(struct super_block *sb)
+/* Whether sb is in the flat format of version 1, which mounts read-only */
+static inline bool ezfs_flat(struct super_block *sb)
 {
-	return ((struct ezfs_sb_buffer_heads *)sb->s_fs_info)->i_store_bh;
+	return get_ezfs_sb(sb)->version == EZFS_VERSION_FLAT;
+}
+
+#define ezfs_stat_add(sb, field, n) \
+	this_cpu_add(get_ezfs_sb_info(sb)->stats->field, (n))
+
+/* Takes a lock, timing the wait only when it is contended. */
+#define ezfs_lock_timed(sb, trylock, lock) do {				\
+	u64 __start;							\
+									\
+	if (!(trylock)) {						\
+		__start = ktime_get_ns();				\
+		lock;							\
+		ezfs_stat_add(sb, lock_wait_ns, ktime_get_ns() - __start); \
+	}								\
+} while (0)
+
+static inline struct ezfs_inode_info *get_ezfs_inode_info(struct inode *inode)
+{
+	return container_of(inode, struct ezfs_inode_info, vfs_inode);
 }
 
 static inline struct ezfs_inode *get_ezfs_inode(struct inode *inode)
 {
-	return inode->i_private;
+	return &get_ezfs_inode_info(inode)->raw;
+}
+
+static inline bool ezfs_has_inline_data(struct inode *inode)
+{
+	return get_ezfs_inode(inode)->flags & EZFS_INLINE_DATA_FL;
+}
+
+/* Reads the inode table block holding inode ino and points *raw at its
+ * slot. Only that one block is read, however large the table is.
+ */
+static struct buffer_head *ezfs_inode_bread(struct super_block *sb,
+		unsigned long ino, struct ezfs_inode **raw)
+{
+	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(sb);
+	unsigned long idx = ino - EZFS_ROOT_INODE_NUMBER;
+	struct buffer_head *bh;
+
+	if (ino < EZFS_ROOT_INODE_NUMBER || idx >= ezfs_sb->nr_inodes)
+		return ERR_PTR(-EFSCORRUPTED);
+
+	bh = sb_bread(sb, ezfs_sb->inode_table_start + idx / EZFS_INODES_PER_BLOCK);
+	if (!bh)
+		return ERR_PTR(-EIO);
+
+	*raw = (struct ezfs_inode *) (bh->b_data +
+			(idx % EZFS_INODES_PER_BLOCK) * EZFS_INODE_SIZE);
+	return bh;
+}
+
+/* Reads inode ino of a flat volume into ezfs_inode. Its one run of blocks
+ * becomes a block map of one extent, which the file paths read through
+ * like any other.
+ */
+static int ezfs_flat_read_inode(struct super_block *sb, unsigned long ino,
+		struct ezfs_inode *ezfs_inode)
+{
+	struct ezfs_flat_inode *raw;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	if (ino < EZFS_ROOT_INODE_NUMBER || ino > EZFS_FLAT_MAX_INODES)
+		return -EFSCORRUPTED;
+	bh = sb_bread(sb, EZFS_FLAT_INODE_STORE);
+	if (!bh)
+		return -EIO;
+	raw = (struct ezfs_flat_inode *) bh->b_data + ino - EZFS_ROOT_INODE_NUMBER;
+
+	if (raw->nblocks && (raw->data_block_number < EZFS_FLAT_DATA_START ||
+			raw->nblocks > EZFS_FLAT_MAX_DATA_BLKS ||
+			raw->data_block_number + raw->nblocks >
+			EZFS_FLAT_DATA_START + EZFS_FLAT_MAX_DATA_BLKS)) {
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	ezfs_inode->mode = raw->mode;
+	ezfs_inode->uid = raw->uid;
+	ezfs_inode->gid = raw->gid;
+	ezfs_inode->i_atime = raw->i_atime;
+	ezfs_inode->i_mtime = raw->i_mtime;
+	ezfs_inode->i_ctime = raw->i_ctime;
+	ezfs_inode->nlink = raw->nlink;
+	ezfs_inode->file_size = raw->file_size;
+	ezfs_inode->nblocks = raw->nblocks;
+	if (raw->nblocks) {
+		ezfs_inode->nr_extents = 1;
+		ezfs_inode->extents[0].ee_block = 0;
+		ezfs_inode->extents[0].ee_len = raw->nblocks;
+		ezfs_inode->extents[0].ee_start = raw->data_block_number;
+	}
+out:
+	brelse(bh);
+	return ret;
 }
 
-static struct inode *ezfs_iget(struct super_block *sb, int ino)
+static struct inode *ezfs_iget(struct super_block *sb, unsigned long ino)
 {
 	struct inode *inode = iget_locked(sb, ino);
+	struct ezfs_inode *ezfs_inode, *raw;
+	struct buffer_head *bh;
+	int ret;
 
-	if (inode && inode->i_state & I_NEW) {
-		struct ezfs_inode *ezfs_inode = (struct ezfs_inode *)
-		get_ezfs_i_bh(sb)->b_data + ino - EZFS_ROOT_INODE_NUMBER;
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	/* Keep a private copy so the table block does not stay pinned. */
+	ezfs_inode = get_ezfs_inode(inode);
+	if (ezfs_flat(sb)) {
+		ret = ezfs_flat_read_inode(sb, ino, ezfs_inode);
+		if (ret) {
+			iget_failed(inode);
+			return ERR_PTR(ret);
+		}
+	} else {
+		bh = ezfs_inode_bread(sb, ino, &raw);
+		if (IS_ERR(bh)) {
+			iget_failed(inode);
+			return ERR_CAST(bh);
+		}
+		memcpy(ezfs_inode, raw, sizeof(*ezfs_inode));
+		brelse(bh);
+	}
 
-		inode->i_private = ezfs_inode;
-		inode->i_mode = ezfs_inode->mode;
-		inode->i_op = &ezfs_inode_ops;
-		inode->i_sb = sb;
-		if (inode->i_mode & S_IFDIR)
-			inode->i_fop = &ezfs_dir_ops;
-		else
-			inode->i_fop = &ezfs_file_ops;
-		inode->i_mapping->a_ops = &ezfs_aops;
-		inode->i_size = ezfs_inode->file_size;
-		inode->i_blocks = ezfs_inode->nblocks * 8;
-		set_nlink(inode, ezfs_inode->nlink);
-		inode->i_atime = ezfs_inode->i_atime;
-		inode->i_mtime = ezfs_inode->i_mtime;
-		inode->i_ctime = ezfs_inode->i_ctime;
-		i_uid_write(inode, ezfs_inode->uid);
-		i_gid_write(inode, ezfs_inode->gid);
-		unlock_new_inode(inode);
+	inode->i_mode = ezfs_inode->mode;
+	inode->i_op = &ezfs_inode_ops;
+	inode->i_sb = sb;
+	if ((inode->i_mode & S_IFDIR) && ezfs_flat(sb)) {
+		inode->i_op = &ezfs_flat_dir_inode_ops;
+		inode->i_fop = &ezfs_flat_dir_ops;
+	} else if (inode->i_mode & S_IFDIR) {
+		inode->i_fop = &ezfs_dir_ops;
+	} else {
+		inode->i_fop = &ezfs_file_ops;
 	}
+	inode->i_mapping->a_ops = &ezfs_aops;
+	inode->i_size = ezfs_inode->file_size;
+	inode->i_blocks = ezfs_inode->nblocks * 8;
+	set_nlink(inode, ezfs_inode->nlink);
+	inode->i_atime = ezfs_inode->i_atime;
+	inode->i_mtime = ezfs_inode->i_mtime;
+	inode->i_ctime = ezfs_inode->i_ctime;
+	i_uid_write(inode, ezfs_inode->uid);
+	i_gid_write(inode, ezfs_inode->gid);
+	unlock_new_inode(inode);
 
 	return inode;
 }
-static int ezfs_move_block(unsigned long base, unsigned long from, unsigned long to,
-					struct super_block *sb, struct address_space *mapping)
+
+/* ezfs journal */
+
+/* BH_EzfsJournaled is set on a buffer while it is in the running
+ * transaction, BH_EzfsCheckpoint while it is on the checkpoint list.
+ */
+enum { BH_EzfsJournaled = BH_PrivateStart, BH_EzfsCheckpoint };
+BUFFER_FNS(EzfsJournaled, ezfs_journaled)
+TAS_BUFFER_FNS(EzfsJournaled, ezfs_journaled)
+BUFFER_FNS(EzfsCheckpoint, ezfs_checkpoint)
+TAS_BUFFER_FNS(EzfsCheckpoint, ezfs_checkpoint)
+
+static inline struct ezfs_journal *ezfs_journal(struct super_block *sb)
+{
+	return get_ezfs_sb_info(sb)->journal;
+}
+
+static inline uint64_t ezfs_journal_next(struct ezfs_journal *j, uint64_t pos)
 {
-	struct buffer_head *old, *new;
-	struct page *page = find_get_page(mapping, from - base);
+	return pos + 1 < j->j_blocks ? pos + 1 : 1;
+}
 
-	to += EZFS_ROOT_DATABLOCK_NUMBER;
-	new = sb_getblk(sb, to);
-	if (page) {
-		memcpy(new->b_data, page_address(page), new->b_size);
-	} else {
-		from += EZFS_ROOT_DATABLOCK_NUMBER;
-		old = sb_bread(sb, from);
-		if (!old)
-			return -EIO;
-		memcpy(new->b_data, old->b_data, old->b_size);
-		bforget(old);
+/* Log blocks between the tail and the head */
+static inline uint64_t ezfs_journal_used(struct ezfs_journal *j)
+{
+	return (j->j_head + j->j_blocks - 1 - j->j_tail) % (j->j_blocks - 1);
+}
+
+/* Log blocks a transaction with nr copies and nrevoke revokes takes */
+static inline uint64_t ezfs_journal_txn_blocks(unsigned int nr,
+		unsigned int nrevoke)
+{
+	return nr + DIV_ROUND_UP(nr + nrevoke, EZFS_JOURNAL_TAGS) + 1;
+}
+
+static int ezfs_journal_commit(struct super_block *sb, bool flush);
+
+/* Stops the journal after an error. Nothing more reaches the log or goes
+ * home, so the volume stays as of the last commit, which the next mount
+ * replays; it turns read-only so that no later change is lost unseen.
+ */
+static void ezfs_journal_abort(struct ezfs_journal *j, int err)
+{
+	if (cmpxchg(&j->j_errno, 0, err))
+		return;
+	pr_err("ezfs: journal aborted (%d), remounting read-only\n", err);
+	j->j_sb->s_flags |= SB_RDONLY;
+}
+
+/* Opens a handle. Every change to metadata blocks is made inside one, so
+ * that a commit sees an operation either whole or not at all. Handles nest;
+ * only the outermost one takes j_trans_sem, and reserves credits log blocks
+ * of the running transaction, committing it first if they do not fit. A
+ * handle must not be opened with a page of a regular file locked by anyone
+ * else's handle, and the filesystem does not recurse into reclaim while one
+ * is open.
+ */
+static void ezfs_journal_start(struct super_block *sb,
+		struct ezfs_handle *handle, unsigned int credits)
+{
+	struct ezfs_journal *j = ezfs_journal(sb);
+	bool fits;
+
+	handle->h_journal = j;
+	handle->h_nested = current->journal_info != NULL;
+	if (!j || handle->h_nested)
+		return;
+
+	/* EZFS_JOURNAL_MIN_BLOCKS lets an empty transaction take any handle */
+	for (;;) {
+		ezfs_lock_timed(sb, down_read_trylock(&j->j_trans_sem),
+				down_read(&j->j_trans_sem));
+		mutex_lock(&j->j_list_lock);
+		fits = ezfs_journal_txn_blocks(j->j_nr_bhs, j->j_nr_revoke) +
+			j->j_reserved + credits <= j->j_max_txn;
+		if (fits)
+			j->j_reserved += credits;
+		mutex_unlock(&j->j_list_lock);
+		if (fits)
+			break;
+		up_read(&j->j_trans_sem);
+		ezfs_journal_commit(sb, false);
 	}
+	handle->h_credits = credits;
+	handle->h_nofs = memalloc_nofs_save();
+	current->journal_info = handle;
+}
+
+static void ezfs_journal_stop(struct ezfs_handle *handle)
+{
+	struct ezfs_journal *j = handle->h_journal;
+
+	if (!j || handle->h_nested)
+		return;
+	mutex_lock(&j->j_list_lock);
+	j->j_reserved -= handle->h_credits;
+	mutex_unlock(&j->j_list_lock);
+	current->journal_info = NULL;
+	memalloc_nofs_restore(handle->h_nofs);
+	up_read(&j->j_trans_sem);
+}
 
-	debug("[%s] mark_buffer_dirty(%lu)\n", __func__, to);
-	mark_buffer_dirty(new);
-	brelse(new);
+/* Makes room for one more entry in *array, which holds *max entries. */
+static int ezfs_journal_grow(void **array, unsigned int *max, size_t size)
+{
+	unsigned int new_max = *max ? *max * 2 : 64;
+	void *new_array = krealloc(*array, new_max * size, GFP_NOFS);
+
+	if (!new_array)
+		return -ENOMEM;
+	*array = new_array;
+	*max = new_max;
 	return 0;
 }
 
-/* iof returns whether i is out of range[s, s+e-1] */
-static inline int iof(uint64_t s, uint64_t e, int i)
+/* Called where an unjournaled filesystem would mark bh dirty, inside a
+ * handle. The buffer joins the running transaction and stays pinned, and
+ * clean, until the checkpoint after its commit. The credits of the open
+ * handles keep the transaction within what the log takes; one that overran
+ * them aborts the journal, since the change must not go home unjournaled.
+ */
+static void ezfs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
 {
-	return s > i || s + e - 1 < i;
+	struct ezfs_journal *j = ezfs_journal(sb);
+	unsigned int i;
+
+	if (!j) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+	if (buffer_ezfs_journaled(bh) || READ_ONCE(j->j_errno))
+		return;
+
+	mutex_lock(&j->j_list_lock);
+	if (test_set_buffer_ezfs_journaled(bh))
+		goto out;
+
+	/* A block freed earlier in this transaction is metadata again */
+	for (i = 0; i < j->j_nr_revoke; i++) {
+		if (j->j_revoke[i] == bh->b_blocknr) {
+			j->j_revoke[i] = j->j_revoke[--j->j_nr_revoke];
+			break;
+		}
+	}
+
+	/* j_bhs has room for j_max_txn buffers */
+	if (WARN_ON_ONCE(ezfs_journal_txn_blocks(j->j_nr_bhs + 1,
+			j->j_nr_revoke) > j->j_max_txn)) {
+		clear_buffer_ezfs_journaled(bh);
+		ezfs_journal_abort(j, -ENOSPC);
+		goto out;
+	}
+	get_bh(bh);
+	j->j_bhs[j->j_nr_bhs++] = bh;
+	schedule_delayed_work(&j->j_commit_work, commit_interval * HZ);
+out:
+	mutex_unlock(&j->j_list_lock);
 }
 
-static int ezfs_get_block(struct inode *inode, sector_t block,
-			struct buffer_head *bh_result, int create)
+/* Called inside a handle when metadata block blk has been freed. A change
+ * to it that is still pending is dropped, and a revoke record keeps replay
+ * from writing an older copy over whatever the block holds next.
+ */
+static void ezfs_journal_forget(struct super_block *sb, uint64_t blk)
 {
-	int ret, phys, i, ez_blk_n, ez_n_blk, ez_blk_sidx;
-	int new_n_blk, blk_num_i, sfb, new_blk_sidx;
-	struct super_block *sb = inode->i_sb;
-	struct buffer_head *ezfs_sb_bh = get_ezfs_sb_bh(sb);
-	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(sb);
-	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
+	struct ezfs_journal *j = ezfs_journal(sb);
+	struct buffer_head *bh = sb_find_get_block(sb, blk);
 
-	ret = phys = 0;
-	ez_blk_n = ezfs_inode->data_block_number;
-	ez_n_blk = inode->i_blocks / 8;
-	if (ez_n_blk)
-		phys = ez_blk_n + block;
+	/* The commit and the checkpoint release their pins once they see
+	 * the bits cleared; the old contents must not go home any more.
+	 */
+	if (bh) {
+		clear_buffer_ezfs_journaled(bh);
+		clear_buffer_ezfs_checkpoint(bh);
+		bforget(bh);
+	}
+	if (!j || READ_ONCE(j->j_errno))
+		return;
 
-	debug("[%s] ino=%ld, block=%llu, phys=%d, create=%d page=%p\n", __func__,
-			inode->i_ino, block, phys, create, bh_result->b_page);
+	mutex_lock(&j->j_list_lock);
+	if (WARN_ON_ONCE(ezfs_journal_txn_blocks(j->j_nr_bhs,
+			j->j_nr_revoke + 1) > j->j_max_txn)) {
+		ezfs_journal_abort(j, -ENOSPC);
+		goto out;
+	}
+	/* Replay must not miss the revoke; nothing commits after an abort */
+	if (j->j_nr_revoke == j->j_max_revoke && ezfs_journal_grow(
+			(void **) &j->j_revoke, &j->j_max_revoke,
+			sizeof(*j->j_revoke))) {
+		ezfs_journal_abort(j, -ENOMEM);
+		goto out;
+	}
+	j->j_revoke[j->j_nr_revoke++] = blk;
+	schedule_delayed_work(&j->j_commit_work, commit_interval * HZ);
+out:
+	mutex_unlock(&j->j_list_lock);
+}
 
-	if (ez_n_blk && block < ez_n_blk) {
-		map_bh(bh_result, sb, phys);
-		return 0;
+/* Called inside a handle once len bits of bm from start on are cleared.
+ * The run is only handed out again after the transaction commits: data
+ * written to it before then would be lost to the old owner that replay
+ * gives the blocks back to. If no room can be made to remember the run, it
+ * stays out of the tree until the next mount reads it from the bitmap.
+ */
+static void ezfs_journal_defer_free(struct ezfs_journal *j,
+		struct ezfs_bitmap *bm, uint64_t start, uint64_t len)
+{
+	struct ezfs_journal_free *f;
+
+	mutex_lock(&j->j_list_lock);
+	f = j->j_nr_frees ? &j->j_frees[j->j_nr_frees - 1] : NULL;
+	if (f && f->bm == bm && f->start + f->len == start) {
+		f->len += len;
+	} else if (j->j_nr_frees < j->j_max_frees || !ezfs_journal_grow(
+			(void **) &j->j_frees, &j->j_max_frees,
+			sizeof(*j->j_frees))) {
+		f = &j->j_frees[j->j_nr_frees++];
+		f->bm = bm;
+		f->start = start;
+		f->len = len;
 	}
+	mutex_unlock(&j->j_list_lock);
+}
 
-	if (!create)
-		return 0;
+static void ezfs_free_put(struct ezfs_bitmap *bm, uint64_t start, uint64_t len);
 
-	/* The file will be extended, so let's see if there is enough space. */
-	if (phys >= EZFS_ROOT_DATABLOCK_NUMBER + EZFS_MAX_DATA_BLKS)
-		return -ENOSPC;
+/* Returns the buffer of log block pos, locked, zeroed and up to date. */
+static struct buffer_head *ezfs_journal_getblk(struct ezfs_journal *j,
+		uint64_t pos)
+{
+	struct buffer_head *bh = sb_getblk(j->j_sb, j->j_first + pos);
 
-	/* The rest has to be protected against itself. */
-	mutex_lock(ezfs_sb->ezfs_lock);
+	if (!bh)
+		return NULL;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, EZFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	return bh;
+}
 
-	/* The file is empty, try to find a block for it */
-	if (!ez_n_blk) {
-		for (i = 0; i < EZFS_MAX_DATA_BLKS && IS_SET(ezfs_sb->free_data_blocks, i); ++i);
-		if (i == EZFS_MAX_DATA_BLKS)
-			return -ENOSPC;
+/* Submits bh, which the caller has locked, and takes over the lock. */
+static void ezfs_journal_submit(struct buffer_head *bh, int op_flags)
+{
+	clear_buffer_dirty(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	submit_bh(REQ_OP_WRITE, op_flags, bh);
+}
+
+/* Unpins the buffers of the running transaction. Once it has committed
+ * they move to the checkpoint list instead, still pinned and still clean:
+ * the next transaction changes them in place, so normal writeback must
+ * never see them dirty. Only the checkpoint writes them home. The runs it
+ * freed go back to their free trees then too.
+ */
+static void ezfs_journal_release(struct ezfs_journal *j, bool committed)
+{
+	struct ezfs_journal_free *f;
+	struct buffer_head *bh;
+	unsigned int i;
 
-		phys = i + EZFS_ROOT_DATABLOCK_NUMBER;
-		ezfs_inode->data_block_number = phys;
-		goto success;
+	for (i = 0; i < j->j_nr_bhs; i++) {
+		bh = j->j_bhs[i];
+		clear_buffer_ezfs_journaled(bh);
+		if (committed && !test_set_buffer_ezfs_checkpoint(bh))
+			j->j_cp_bhs[j->j_nr_cp++] = bh;
+		else
+			brelse(bh);
+	}
+	for (i = 0; committed && i < j->j_nr_frees; i++) {
+		f = &j->j_frees[i];
+		ezfs_free_put(f->bm, f->start, f->len);
+		atomic64_add(f->len, &f->bm->nfree);
 	}
+	j->j_nr_bhs = 0;
+	j->j_nr_revoke = 0;
+	j->j_nr_frees = 0;
+}
 
-	/*
-	 * If the file is not empty and the requested block right next
-	 * to the last existing data block is empty, we can grant it.
-	 */
-	if (!IS_SET(ezfs_sb->free_data_blocks, phys - EZFS_ROOT_DATABLOCK_NUMBER))
-		goto success;
+/* Writes the running transaction to the log. The descriptors and copies
+ * go out as one sequential run; the commit block follows once they are
+ * done, with a cache flush ahead of it and FUA on it. Returns the number of
+ * log blocks written. Called with j_trans_sem held for writing.
+ */
+static long ezfs_journal_write_txn(struct ezfs_journal *j)
+{
+	struct ezfs_journal_desc *desc = NULL;
+	struct ezfs_journal_commit *commit;
+	struct buffer_head *bh, **log = j->j_log_bhs;
+	unsigned int i, nr = 0, ntags, n = 0;
+	uint64_t pos = j->j_head;
+	uint32_t crc = ~0U;
+	struct blk_plug plug;
+	int ret = 0;
 
-	/* Reallocate! */
-	new_n_blk = ez_n_blk + 1;
-	for (i = 0, sfb = 0; sfb < new_n_blk && i < EZFS_MAX_DATA_BLKS; i++, sfb++) {
-		blk_num_i = i + EZFS_ROOT_DATABLOCK_NUMBER;
-		if (IS_SET(ezfs_sb->free_data_blocks, i) &&
-			iof(ez_blk_n, ez_n_blk, blk_num_i))
-			sfb = -1;
+	/* Skip buffers that were forgotten, or listed twice */
+	for (i = 0; i < j->j_nr_bhs; i++) {
+		bh = j->j_bhs[i];
+		if (test_clear_buffer_ezfs_journaled(bh))
+			j->j_bhs[nr++] = bh;
+		else
+			brelse(bh);
 	}
+	j->j_nr_bhs = nr;
+	ntags = nr + j->j_nr_revoke;
+	if (!ntags)
+		return 0;
 
-	if (sfb < new_n_blk) {
-		ret = -ENOSPC;
-		goto out;
+	for (i = 0; i < ntags; i++) {
+		if (i % EZFS_JOURNAL_TAGS == 0) {
+			bh = ezfs_journal_getblk(j, pos);
+			if (!bh) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			log[n++] = bh;
+			pos = ezfs_journal_next(j, pos);
+
+			desc = (struct ezfs_journal_desc *) bh->b_data;
+			desc->h.magic = EZFS_JOURNAL_MAGIC;
+			desc->h.type = EZFS_JOURNAL_DESC;
+			desc->h.sequence = j->j_sequence;
+			desc->nr_tags = min_t(unsigned int, ntags - i,
+					EZFS_JOURNAL_TAGS);
+		}
+		if (i >= nr) {
+			desc->tags[i % EZFS_JOURNAL_TAGS].blocknr =
+				j->j_revoke[i - nr];
+			desc->tags[i % EZFS_JOURNAL_TAGS].flags =
+				EZFS_JTAG_REVOKE;
+			continue;
+		}
+
+		desc->tags[i % EZFS_JOURNAL_TAGS].blocknr = j->j_bhs[i]->b_blocknr;
+		bh = ezfs_journal_getblk(j, pos);
+		if (!bh) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		log[n++] = bh;
+		pos = ezfs_journal_next(j, pos);
+		memcpy(bh->b_data, j->j_bhs[i]->b_data, EZFS_BLOCK_SIZE);
+	}
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		crc = crc32_le(crc, log[i]->b_data, EZFS_BLOCK_SIZE);
+		ezfs_journal_submit(log[i], REQ_SYNC);
 	}
+	blk_finish_plug(&plug);
 
-	/* Move existing contents to new place data_idx[i - new_n_blk, i - 1] */
-	new_blk_sidx = i - new_n_blk;
-	phys = i - 1 + EZFS_ROOT_DATABLOCK_NUMBER;
-	ez_blk_sidx = ez_blk_n - EZFS_ROOT_DATABLOCK_NUMBER;
-	for (i = 0; i < ez_n_blk; i++) {
-		ezfs_move_block(ez_blk_sidx, ez_blk_sidx + i, new_blk_sidx + i, sb, inode->i_mapping);
-		CLEARBIT(ezfs_sb->free_data_blocks, ez_blk_sidx + i);
+	bh = ezfs_journal_getblk(j, pos);
+	if (!bh) {
+		ret = -ENOMEM;
+		goto out_wait;
+	}
+	commit = (struct ezfs_journal_commit *) bh->b_data;
+	commit->h.magic = EZFS_JOURNAL_MAGIC;
+	commit->h.type = EZFS_JOURNAL_COMMIT;
+	commit->h.sequence = j->j_sequence;
+	commit->checksum = crc;
+
+out_wait:
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(log[i]);
+		if (!buffer_uptodate(log[i]))
+			ret = -EIO;
+		brelse(log[i]);
+	}
+	n = 0;
+	if (ret) {
+		if (bh)
+			unlock_buffer(bh);
+		brelse(bh);
+		return ret;
 	}
-	for (i = 0; i < ez_n_blk; i++)
-		SETBIT(ezfs_sb->free_data_blocks, new_blk_sidx + i);
-	ezfs_inode->data_block_number = new_blk_sidx + EZFS_ROOT_DATABLOCK_NUMBER;
 
-success:
-	debug("[%s] Reallocate from [%d-%d] to [%llu-%d]\n", __func__,
-		ez_blk_n, ez_blk_n + ez_n_blk - 1, ezfs_inode->data_block_number, phys);
-	map_bh(bh_result, sb, phys);
+	ezfs_journal_submit(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+	wait_on_buffer(bh);
+	if (!buffer_uptodate(bh))
+		ret = -EIO;
+	brelse(bh);
+	if (ret)
+		return ret;
 
-	SETBIT(ezfs_sb->free_data_blocks, phys - EZFS_ROOT_DATABLOCK_NUMBER);
-	mark_buffer_dirty(ezfs_sb_bh);
+	trace_ezfs_journal_commit(j->j_sb, j->j_sequence, nr, ntags - nr, pos);
+	ezfs_stat_add(j->j_sb, journal_commits, 1);
+	ezfs_stat_add(j->j_sb, journal_blocks,
+			ezfs_journal_txn_blocks(nr, ntags - nr));
+	j->j_head = ezfs_journal_next(j, pos);
+	j->j_sequence++;
+	ezfs_journal_release(j, true);
+	return ezfs_journal_txn_blocks(nr, ntags - nr);
 
 out:
-	mutex_unlock(ezfs_sb->ezfs_lock);
+	for (i = 0; i < n; i++) {
+		unlock_buffer(log[i]);
+		brelse(log[i]);
+	}
 	return ret;
 }
 
-/* ezfs_dir_ops */
-int ezfs_iterate(struct file *filp, struct dir_context *ctx)
+/* Records in the journal super that the log starts at start with
+ * transaction seq. The cache flush ahead of it makes everything written
+ * home so far durable first.
+ */
+static int ezfs_journal_write_super(struct ezfs_journal *j, uint64_t start,
+		uint64_t seq)
 {
-	int i, pos;
-	struct inode *inode = file_inode(filp);
-	uint64_t filp_blk_num = get_ezfs_inode(file_inode(filp))->data_block_number;
-	struct buffer_head *bh = sb_bread(inode->i_sb, filp_blk_num);
-	struct ezfs_dir_entry *ezfs_dentry;
+	struct ezfs_journal_super *jsb =
+		(struct ezfs_journal_super *) j->j_sb_bh->b_data;
+	int ret;
 
-	debug("[%s] dir_ino=%ld, pos=%lld\n", __func__, inode->i_ino, ctx->pos);
+	lock_buffer(j->j_sb_bh);
+	jsb->h.sequence = seq;
+	jsb->start = start;
+	unlock_buffer(j->j_sb_bh);
+	mark_buffer_dirty(j->j_sb_bh);
+	ret = __sync_dirty_buffer(j->j_sb_bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+	if (!ret)
+		j->j_tail = start;
+	return ret;
+}
 
-	if (!dir_emit_dots(filp, ctx))
-		return 0;
-	pos = ctx->pos - 2;
+/* Writes every committed buffer home and frees the whole log. Called with
+ * j_trans_sem held for writing, right after a commit, so no buffer holds
+ * an uncommitted change, and none changes until the writes are done.
+ */
+static int ezfs_journal_checkpoint(struct ezfs_journal *j)
+{
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	unsigned int i;
+	int ret = 0;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < j->j_nr_cp; i++) {
+		bh = j->j_cp_bhs[i];
+		/* forgotten since, or listed again after a reuse */
+		if (!test_clear_buffer_ezfs_checkpoint(bh)) {
+			j->j_cp_bhs[i] = NULL;
+			brelse(bh);
+			continue;
+		}
+		mark_buffer_dirty(bh);
+		write_dirty_buffer(bh, REQ_SYNC);
+	}
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < j->j_nr_cp; i++) {
+		bh = j->j_cp_bhs[i];
+		if (!bh)
+			continue;
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			ret = -EIO;
+		brelse(bh);
+	}
+	j->j_nr_cp = 0;
+	if (ret)
+		return ret;
+	return ezfs_journal_write_super(j, j->j_head, j->j_sequence);
+}
+
+/* Drops the checkpoint list without writing it; the log still has it. */
+static void ezfs_journal_drop_checkpoint(struct ezfs_journal *j)
+{
+	unsigned int i;
+
+	for (i = 0; i < j->j_nr_cp; i++) {
+		clear_buffer_ezfs_checkpoint(j->j_cp_bhs[i]);
+		brelse(j->j_cp_bhs[i]);
+	}
+	j->j_nr_cp = 0;
+}
+
+/* Commits the running transaction, and checkpoints once half the log is in
+ * use, so that the next transaction always fits. With flush set, the
+ * device cache is flushed even when there is nothing to commit.
+ */
+static int ezfs_journal_commit(struct super_block *sb, bool flush)
+{
+	struct ezfs_journal *j = ezfs_journal(sb);
+	unsigned int nofs;
+	long ret;
+
+	if (!j)
+		return flush ? blkdev_issue_flush(sb->s_bdev, GFP_KERNEL) : 0;
+
+	down_write(&j->j_trans_sem);
+	nofs = memalloc_nofs_save();
+	ret = READ_ONCE(j->j_errno);
+	if (!ret)
+		ret = ezfs_journal_write_txn(j);
+	if (ret > 0 && ezfs_journal_used(j) > (j->j_blocks - 1) / 2)
+		ret = ezfs_journal_checkpoint(j);
+	else if (ret == 0 && flush)
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_NOFS);
+
+	if (ret < 0) {
+		ezfs_journal_abort(j, ret);
+		ezfs_journal_release(j, false);
+		ezfs_journal_drop_checkpoint(j);
+	}
+	memalloc_nofs_restore(nofs);
+	up_write(&j->j_trans_sem);
+	return ret < 0 ? ret : 0;
+}
+
+static void ezfs_journal_commit_work(struct work_struct *work)
+{
+	struct ezfs_journal *j = container_of(to_delayed_work(work),
+			struct ezfs_journal, j_commit_work);
+
+	ezfs_journal_commit(j->j_sb, false);
+}
+
+/* Whether an allocation that ran out of space should be tried again: the
+ * running transaction freed blocks that are free once it commits, which is
+ * done here. Must be called outside any handle.
+ */
+static bool ezfs_should_retry_alloc(struct super_block *sb)
+{
+	struct ezfs_journal *j = ezfs_journal(sb);
+	bool pending;
+
+	if (!j || WARN_ON_ONCE(current->journal_info))
+		return false;
+	mutex_lock(&j->j_list_lock);
+	pending = j->j_nr_frees;
+	mutex_unlock(&j->j_list_lock);
+	return pending && !ezfs_journal_commit(sb, false);
+}
+
+/* What a scan of the log found */
+struct ezfs_recovery {
+	uint64_t end; /* Log block after the last complete transaction */
+	uint64_t last; /* Sequence after the last complete transaction */
+	struct ezfs_revoke {
+		uint64_t blocknr;
+		uint64_t sequence;
+	} *revoke;
+	unsigned int nr_revoke, max_revoke;
+};
+
+static int ezfs_revoke_cmp(const void *a, const void *b)
+{
+	const struct ezfs_revoke *ra = a, *rb = b;
+
+	if (ra->blocknr != rb->blocknr)
+		return ra->blocknr < rb->blocknr ? -1 : 1;
+	if (ra->sequence != rb->sequence)
+		return ra->sequence < rb->sequence ? -1 : 1;
+	return 0;
+}
+
+static int ezfs_revoke_find(const void *key, const void *elt)
+{
+	uint64_t blocknr = *(const uint64_t *) key;
+	const struct ezfs_revoke *r = elt;
+
+	if (blocknr != r->blocknr)
+		return blocknr < r->blocknr ? -1 : 1;
+	return 0;
+}
+
+/* Whether a copy of blocknr from transaction seq is voided by a revoke */
+static bool ezfs_revoked(struct ezfs_recovery *rc, uint64_t blocknr,
+		uint64_t seq)
+{
+	struct ezfs_revoke *r = bsearch(&blocknr, rc->revoke, rc->nr_revoke,
+			sizeof(*r), ezfs_revoke_find);
 
+	return r && r->sequence >= seq;
+}
+
+/* Copies log block src home to blocknr. */
+static int ezfs_journal_replay_block(struct ezfs_journal *j,
+		struct buffer_head *src, uint64_t blocknr)
+{
+	struct super_block *sb = j->j_sb;
+	struct buffer_head *bh;
+
+	if (blocknr >= get_ezfs_sb(sb)->nr_blocks || (blocknr >= j->j_first &&
+			blocknr < j->j_first + j->j_blocks))
+		return -EFSCORRUPTED;
+	bh = sb_getblk(sb, blocknr);
 	if (!bh)
-		return -EIO;
+		return -ENOMEM;
+	lock_buffer(bh);
+	memcpy(bh->b_data, src->b_data, EZFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return 0;
+}
+
+/* Walks the log from block start and transaction seq on. The first pass
+ * finds the last transaction whose commit block is intact and collects the
+ * revokes of the complete ones; the replay pass copies the blocks of those
+ * transactions home, except where a revoke voids them.
+ */
+static int ezfs_journal_scan(struct ezfs_journal *j, struct ezfs_recovery *rc,
+		uint64_t start, uint64_t seq, bool replay)
+{
+	struct ezfs_journal_header *h;
+	struct ezfs_journal_desc *desc;
+	struct buffer_head *bh, *dbh;
+	uint64_t pos = start, walked;
+	unsigned int i, nr_revoke;
+	uint32_t crc;
+	int ret = 0;
 
-	ezfs_dentry = (struct ezfs_dir_entry *) bh->b_data + pos;
-	for (i = pos; i < EZFS_MAX_CHILDREN; ++i, ++ezfs_dentry, ++ctx->pos) {
-		if (ezfs_dentry->active) {
-			if (!dir_emit(ctx, ezfs_dentry->filename,
-					strlen(ezfs_dentry->filename),
-					ezfs_dentry->inode_no, DT_UNKNOWN))
+	for (; !replay || seq < rc->last; seq++) {
+		crc = ~0U;
+		nr_revoke = rc->nr_revoke;
+		for (walked = 0; walked < j->j_blocks - 1; walked++) {
+			bh = sb_bread(j->j_sb, j->j_first + pos);
+			if (!bh)
+				return -EIO;
+			h = (struct ezfs_journal_header *) bh->b_data;
+			if (h->magic != EZFS_JOURNAL_MAGIC || h->sequence != seq ||
+					(h->type != EZFS_JOURNAL_DESC &&
+					 h->type != EZFS_JOURNAL_COMMIT))
+				goto incomplete;
+			pos = ezfs_journal_next(j, pos);
+			if (h->type == EZFS_JOURNAL_COMMIT) {
+				if (((struct ezfs_journal_commit *) h)->checksum != crc)
+					goto incomplete;
+				brelse(bh);
 				break;
+			}
+
+			desc = (struct ezfs_journal_desc *) h;
+			if (desc->nr_tags > EZFS_JOURNAL_TAGS)
+				goto incomplete;
+			crc = crc32_le(crc, bh->b_data, EZFS_BLOCK_SIZE);
+			for (i = 0; i < desc->nr_tags; i++) {
+				if (desc->tags[i].flags & EZFS_JTAG_REVOKE) {
+					if (replay)
+						continue;
+					if (rc->nr_revoke == rc->max_revoke &&
+							ezfs_journal_grow((void **) &rc->revoke,
+							&rc->max_revoke, sizeof(*rc->revoke))) {
+						ret = -ENOMEM;
+						goto out;
+					}
+					rc->revoke[rc->nr_revoke].blocknr =
+						desc->tags[i].blocknr;
+					rc->revoke[rc->nr_revoke++].sequence = seq;
+					continue;
+				}
+
+				dbh = sb_bread(j->j_sb, j->j_first + pos);
+				if (!dbh) {
+					ret = -EIO;
+					goto out;
+				}
+				pos = ezfs_journal_next(j, pos);
+				crc = crc32_le(crc, dbh->b_data, EZFS_BLOCK_SIZE);
+				if (replay && !ezfs_revoked(rc, desc->tags[i].blocknr, seq))
+					ret = ezfs_journal_replay_block(j, dbh,
+						desc->tags[i].blocknr);
+				brelse(dbh);
+				if (ret)
+					goto out;
+			}
+			brelse(bh);
+		}
+		if (walked == j->j_blocks - 1) {
+			bh = NULL;
+			goto incomplete;
+		}
+		rc->end = pos;
+	}
+	return 0;
+
+incomplete:
+	/* The transaction never committed; forget what it revoked */
+	rc->nr_revoke = nr_revoke;
+	if (!replay)
+		rc->last = seq;
+out:
+	brelse(bh);
+	return ret;
+}
+
+/* Replays whatever the log holds and leaves it empty. */
+static int ezfs_journal_recover(struct ezfs_journal *j)
+{
+	struct ezfs_journal_super *jsb =
+		(struct ezfs_journal_super *) j->j_sb_bh->b_data;
+	struct ezfs_recovery rc = { .end = jsb->start };
+	struct ezfs_revoke *r;
+	unsigned int i, n;
+	int ret;
+
+	ret = ezfs_journal_scan(j, &rc, jsb->start, jsb->h.sequence, false);
+	if (ret || rc.last == jsb->h.sequence)
+		goto out;
+
+	/* Keep only the latest revoke of each block */
+	sort(rc.revoke, rc.nr_revoke, sizeof(*r), ezfs_revoke_cmp, NULL);
+	for (i = n = 0; i < rc.nr_revoke; i++) {
+		if (n && rc.revoke[n - 1].blocknr == rc.revoke[i].blocknr)
+			n--;
+		rc.revoke[n++] = rc.revoke[i];
+	}
+	rc.nr_revoke = n;
+
+	ret = ezfs_journal_scan(j, &rc, jsb->start, jsb->h.sequence, true);
+	if (!ret)
+		ret = sync_blockdev(j->j_sb->s_bdev);
+	if (!ret)
+		pr_info("ezfs: replayed journal transactions %llu to %llu\n",
+			jsb->h.sequence, rc.last - 1);
+out:
+	if (!ret) {
+		j->j_head = j->j_tail = rc.end;
+		j->j_sequence = rc.last;
+		if (rc.last != jsb->h.sequence)
+			ret = ezfs_journal_write_super(j, rc.end, rc.last);
+	}
+	kfree(rc.revoke);
+	return ret;
+}
+
+/* Sets up the journal of sb and replays it. Runs at mount, before any other
+ * metadata is read.
+ */
+static int ezfs_journal_load(struct super_block *sb)
+{
+	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(sb);
+	struct ezfs_journal_super *jsb;
+	struct ezfs_journal *j;
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+	j->j_sb = sb;
+	j->j_first = ezfs_sb->journal_start;
+	j->j_blocks = ezfs_sb->journal_blocks;
+	/* The log is checkpointed once more than half of it is in use, so
+	 * a transaction smaller than half always fits.
+	 */
+	j->j_max_txn = (j->j_blocks - 1) / 2 - 1;
+	init_rwsem(&j->j_trans_sem);
+	mutex_init(&j->j_list_lock);
+	INIT_DELAYED_WORK(&j->j_commit_work, ezfs_journal_commit_work);
+	get_ezfs_sb_info(sb)->journal = j;
+
+	j->j_log_bhs = kmalloc_array(j->j_max_txn, sizeof(*j->j_log_bhs),
+			GFP_KERNEL);
+	j->j_bhs = kmalloc_array(j->j_max_txn, sizeof(*j->j_bhs), GFP_KERNEL);
+	if (!j->j_log_bhs || !j->j_bhs)
+		return -ENOMEM;
+	/* Every buffer on the checkpoint list has a copy in the live log */
+	j->j_cp_bhs = kvmalloc_array(j->j_blocks, sizeof(*j->j_cp_bhs),
+			GFP_KERNEL);
+	if (!j->j_cp_bhs)
+		return -ENOMEM;
+	j->j_sb_bh = sb_bread(sb, j->j_first);
+	if (!j->j_sb_bh)
+		return -EIO;
+
+	jsb = (struct ezfs_journal_super *) j->j_sb_bh->b_data;
+	if (jsb->h.magic != EZFS_JOURNAL_MAGIC ||
+			jsb->h.type != EZFS_JOURNAL_SUPER ||
+			jsb->nr_blocks != j->j_blocks ||
+			jsb->start == 0 || jsb->start >= j->j_blocks)
+		return -EFSCORRUPTED;
+
+	return ezfs_journal_recover(j);
+}
+
+/* Frees the journal, however far ezfs_journal_load got with it. */
+static void ezfs_journal_destroy(struct ezfs_journal *j)
+{
+	if (!j)
+		return;
+	cancel_delayed_work_sync(&j->j_commit_work);
+	ezfs_journal_release(j, false);
+	ezfs_journal_drop_checkpoint(j);
+	brelse(j->j_sb_bh);
+	kfree(j->j_log_bhs);
+	kvfree(j->j_cp_bhs);
+	kfree(j->j_bhs);
+	kfree(j->j_revoke);
+	kfree(j->j_frees);
+	mutex_destroy(&j->j_list_lock);
+	kfree(j);
+}
+
+/* ezfs free extents */
+
+static struct kmem_cache *ezfs_free_extent_cachep;
+
+static inline uint64_t ezfs_fe_len(struct ezfs_free_extent *fe)
+{
+	return fe->len;
+}
+
+RB_DECLARE_CALLBACKS_MAX(static, ezfs_free_cb, struct ezfs_free_extent,
+		node, uint64_t, subtree_max, ezfs_fe_len)
+
+#define ezfs_fe(rb) rb_entry(rb, struct ezfs_free_extent, node)
+
+static inline uint64_t ezfs_fe_max(struct rb_node *rb)
+{
+	return rb ? ezfs_fe(rb)->subtree_max : 0;
+}
+
+/* Returns the extent with the highest start that is not after bit. */
+static struct ezfs_free_extent *ezfs_free_lookup(struct ezfs_bitmap *bm,
+		uint64_t bit)
+{
+	struct rb_node *rb = bm->free_tree.rb_node;
+	struct ezfs_free_extent *fe = NULL;
+
+	while (rb) {
+		if (ezfs_fe(rb)->start <= bit) {
+			fe = ezfs_fe(rb);
+			rb = rb->rb_right;
+		} else {
+			rb = rb->rb_left;
+		}
+	}
+	return fe;
+}
+
+/* Returns the lowest extent under rb that is at least nr long. The subtree
+ * maxima say which way to go, so this is one walk down the tree.
+ */
+static struct ezfs_free_extent *ezfs_free_leftmost_fit(struct rb_node *rb,
+		uint64_t nr)
+{
+	if (ezfs_fe_max(rb) < nr)
+		return NULL;
+	for (;;) {
+		if (ezfs_fe_max(rb->rb_left) >= nr)
+			rb = rb->rb_left;
+		else if (ezfs_fe(rb)->len >= nr)
+			return ezfs_fe(rb);
+		else
+			rb = rb->rb_right;
+	}
+}
+
+/* Returns the lowest extent that starts after bit and is at least nr long.
+ * From the first extent after bit, the walk goes forward in order but skips
+ * every right subtree whose maximum is too short, so it never climbs or
+ * descends more than the height of the tree.
+ */
+static struct ezfs_free_extent *ezfs_free_next_fit(struct ezfs_bitmap *bm,
+		uint64_t bit, uint64_t nr)
+{
+	struct rb_node *rb = bm->free_tree.rb_node, *next = NULL, *parent;
+	struct ezfs_free_extent *fe;
+
+	while (rb) {
+		if (ezfs_fe(rb)->start > bit) {
+			next = rb;
+			rb = rb->rb_left;
+		} else {
+			rb = rb->rb_right;
+		}
+	}
+
+	for (rb = next; rb; rb = parent) {
+		if (ezfs_fe(rb)->len >= nr)
+			return ezfs_fe(rb);
+		fe = ezfs_free_leftmost_fit(rb->rb_right, nr);
+		if (fe)
+			return fe;
+		/* Up to the first ancestor we are on the left of */
+		while ((parent = rb_parent(rb)) && rb == parent->rb_right)
+			rb = parent;
+	}
+	return NULL;
+}
+
+/* Adds fe, which must not touch any extent in the tree. */
+static void ezfs_free_link(struct ezfs_bitmap *bm, struct ezfs_free_extent *fe)
+{
+	struct rb_node **link = &bm->free_tree.rb_node, *parent = NULL;
+
+	fe->subtree_max = fe->len;
+	while (*link) {
+		parent = *link;
+		if (ezfs_fe(parent)->subtree_max < fe->len)
+			ezfs_fe(parent)->subtree_max = fe->len;
+		if (fe->start < ezfs_fe(parent)->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&fe->node, parent, link);
+	rb_insert_augmented(&fe->node, &bm->free_tree, &ezfs_free_cb);
+}
+
+static void ezfs_free_erase(struct ezfs_bitmap *bm, struct ezfs_free_extent *fe)
+{
+	rb_erase_augmented(&fe->node, &bm->free_tree, &ezfs_free_cb);
+	kmem_cache_free(ezfs_free_extent_cachep, fe);
+}
+
+/* Records len bits from start as free, merging with the extents on either
+ * side. The caller holds tree_lock. Overlapping an extent that is already
+ * free means the tree and the bitmap disagree; the run is then dropped
+ * rather than counted twice.
+ */
+static int ezfs_free_insert(struct ezfs_bitmap *bm, uint64_t start,
+		uint64_t len, gfp_t gfp)
+{
+	struct ezfs_free_extent *prev, *next, *fe;
+	struct rb_node *rb;
+
+	prev = ezfs_free_lookup(bm, start);
+	rb = prev ? rb_next(&prev->node) : rb_first(&bm->free_tree);
+	next = rb ? ezfs_fe(rb) : NULL;
+
+	if (WARN_ON_ONCE((prev && prev->start + prev->len > start) ||
+			(next && start + len > next->start)))
+		return -EFSCORRUPTED;
+
+	if (prev && prev->start + prev->len == start) {
+		if (next && start + len == next->start) {
+			len += next->len;
+			ezfs_free_erase(bm, next);
+		}
+		prev->len += len;
+		ezfs_free_cb_propagate(&prev->node, NULL);
+	} else if (next && start + len == next->start) {
+		next->start = start;
+		next->len += len;
+		ezfs_free_cb_propagate(&next->node, NULL);
+	} else {
+		fe = kmem_cache_alloc(ezfs_free_extent_cachep, gfp);
+		if (!fe)
+			return -ENOMEM;
+		fe->start = start;
+		fe->len = len;
+		ezfs_free_link(bm, fe);
+	}
+	return 0;
+}
+
+/* Takes nr bits from bit on out of fe, which holds them. Cutting a hole in
+ * the middle of fe needs a second extent, which is *spare; it is set to
+ * NULL if used.
+ */
+static void ezfs_free_take(struct ezfs_bitmap *bm, struct ezfs_free_extent *fe,
+		uint64_t bit, uint64_t nr, struct ezfs_free_extent **spare)
+{
+	uint64_t end = fe->start + fe->len;
+
+	if (bit == fe->start && nr == fe->len) {
+		ezfs_free_erase(bm, fe);
+		return;
+	}
+	if (bit == fe->start) {
+		fe->start += nr;
+		fe->len -= nr;
+		ezfs_free_cb_propagate(&fe->node, NULL);
+		return;
+	}
+
+	fe->len = bit - fe->start;
+	ezfs_free_cb_propagate(&fe->node, NULL);
+	if (bit + nr < end) {
+		(*spare)->start = bit + nr;
+		(*spare)->len = end - bit - nr;
+		ezfs_free_link(bm, *spare);
+		*spare = NULL;
+	}
+}
+
+static void ezfs_free_tree_destroy(struct ezfs_bitmap *bm)
+{
+	struct ezfs_free_extent *fe, *tmp;
+
+	rbtree_postorder_for_each_entry_safe(fe, tmp, &bm->free_tree, node)
+		kmem_cache_free(ezfs_free_extent_cachep, fe);
+	bm->free_tree = RB_ROOT;
+}
+
+/* Returns len bits from start on to the tree of bm. */
+static void ezfs_free_put(struct ezfs_bitmap *bm, uint64_t start, uint64_t len)
+{
+	mutex_lock(&bm->tree_lock);
+	ezfs_free_insert(bm, start, len, GFP_NOFS | __GFP_NOFAIL);
+	mutex_unlock(&bm->tree_lock);
+}
+
+/* ezfs bitmaps */
+
+/* Looks for nr clear bits in a row among the first size bits of one bitmap
+ * block, starting at bit from. The scan goes a word at a time: find the next
+ * clear bit, then the next set bit after it, and see if the gap is long
+ * enough. On-disk bitmaps are little-endian words, hence the _le helpers.
+ */
+static long ezfs_find_zero_area(void *map, unsigned long size,
+		unsigned long from, unsigned int nr)
+{
+	unsigned long start, end;
+
+	for (;;) {
+		start = find_next_zero_bit_le(map, size, from);
+		if (start + nr > size)
+			return -1;
+		end = find_next_bit_le(map, start + nr, start);
+		if (end >= start + nr)
+			return start;
+		from = end + 1;
+	}
+}
+
+/* Clears nr bits of bm starting at bit, one group at a time. Bits that are
+ * already clear are not counted as freed twice, nor put in the free tree.
+ * With a journal, the runs of a bitmap with a free tree only become free
+ * once the transaction freeing them commits.
+ */
+static int ezfs_bitmap_free(struct super_block *sb, struct ezfs_bitmap *bm,
+		uint64_t bit, uint64_t nr)
+{
+	struct ezfs_journal *jnl = bm->has_tree ? ezfs_journal(sb) : NULL;
+	struct ezfs_group *grp;
+	struct buffer_head *bh;
+	unsigned long off, n, i, j, changed;
+
+	if (bit + nr > bm->nbits || bit + nr < bit)
+		return -EFSCORRUPTED;
+
+	while (nr) {
+		grp = &bm->groups[bit / EZFS_BITS_PER_BLOCK];
+		off = bit % EZFS_BITS_PER_BLOCK;
+		n = min_t(uint64_t, nr, EZFS_BITS_PER_BLOCK - off);
+
+		ezfs_lock_timed(sb, mutex_trylock(&grp->lock),
+				mutex_lock(&grp->lock));
+		bh = sb_bread(sb, bm->start + bit / EZFS_BITS_PER_BLOCK);
+		if (!bh) {
+			mutex_unlock(&grp->lock);
+			return -EIO;
+		}
+		for (i = changed = 0; i < n; i = j + 1) {
+			/* Bits i up to j were set, bit j was not */
+			for (j = i; j < n && __test_and_clear_bit_le(off + j,
+						bh->b_data); j++)
+				;
+			if (j > i && jnl)
+				ezfs_journal_defer_free(jnl, bm, bit + i, j - i);
+			else if (j > i && bm->has_tree)
+				ezfs_free_put(bm, bit + i, j - i);
+			changed += j - i;
+		}
+		ezfs_journal_dirty(sb, bh);
+		brelse(bh);
+		grp->nfree += changed;
+		mutex_unlock(&grp->lock);
+
+		if (!jnl)
+			atomic64_add(changed, &bm->nfree);
+		bit += n;
+		nr -= n;
+	}
+	return 0;
+}
+
+/* Allocates nr bits in a row from the free tree of bm: at goal itself if the
+ * extent holding goal is long enough, else from the first long enough extent
+ * after goal, else from the first one at all. The run is taken out of the
+ * tree before its bits are set group by group, so it may span two groups.
+ */
+static long ezfs_bitmap_alloc_tree(struct super_block *sb,
+		struct ezfs_bitmap *bm, uint64_t goal, unsigned int nr)
+{
+	struct ezfs_free_extent *fe, *spare;
+	struct ezfs_group *grp;
+	struct buffer_head *bh;
+	uint64_t bit, pos, off, n, i;
+
+	spare = kmem_cache_alloc(ezfs_free_extent_cachep, GFP_NOFS);
+	if (!spare)
+		return -ENOMEM;
+
+	ezfs_lock_timed(sb, mutex_trylock(&bm->tree_lock),
+			mutex_lock(&bm->tree_lock));
+	fe = ezfs_free_lookup(bm, goal);
+	if (fe && goal + nr <= fe->start + fe->len) {
+		bit = goal;
+	} else {
+		fe = ezfs_free_next_fit(bm, goal, nr);
+		if (!fe)
+			fe = ezfs_free_leftmost_fit(bm->free_tree.rb_node, nr);
+		if (!fe) {
+			mutex_unlock(&bm->tree_lock);
+			kmem_cache_free(ezfs_free_extent_cachep, spare);
+			return -ENOSPC;
+		}
+		bit = fe->start;
+	}
+	ezfs_free_take(bm, fe, bit, nr, &spare);
+	atomic64_sub(nr, &bm->nfree);
+	mutex_unlock(&bm->tree_lock);
+	if (spare)
+		kmem_cache_free(ezfs_free_extent_cachep, spare);
+
+	for (pos = bit; pos < bit + nr; pos += n) {
+		grp = &bm->groups[pos / EZFS_BITS_PER_BLOCK];
+		off = pos % EZFS_BITS_PER_BLOCK;
+		n = min_t(uint64_t, bit + nr - pos, EZFS_BITS_PER_BLOCK - off);
+
+		ezfs_lock_timed(sb, mutex_trylock(&grp->lock),
+				mutex_lock(&grp->lock));
+		bh = sb_bread(sb, bm->start + pos / EZFS_BITS_PER_BLOCK);
+		if (!bh) {
+			mutex_unlock(&grp->lock);
+			goto undo;
+		}
+		for (i = 0; i < n; i++)
+			WARN_ON_ONCE(__test_and_set_bit_le(off + i, bh->b_data));
+		ezfs_journal_dirty(sb, bh);
+		brelse(bh);
+		grp->nfree -= n;
+		mutex_unlock(&grp->lock);
+	}
+
+	WRITE_ONCE(bm->cursor, bit + nr);
+	return bit;
+
+undo:
+	/* Give back the bits never set, then clear the ones that were */
+	ezfs_free_put(bm, pos, bit + nr - pos);
+	atomic64_add(bit + nr - pos, &bm->nfree);
+	if (pos > bit)
+		ezfs_bitmap_free(sb, bm, bit, pos - bit);
+	return -EIO;
+}
+
+/* Finds nr clear bits in a row in bm, starting at bit goal and wrapping
+ * around, and sets them. nr is at most EZFS_BITS_PER_BLOCK, which bounds
+ * the bitmap blocks one allocation dirties. Bitmaps with a free tree search
+ * that; the others are scanned here one group at a time. A scanned run never
+ * spans two groups. Only the lock of the group being searched is held, and
+ * groups without enough free bits are skipped without reading their bitmap
+ * block.
+ */
+static long ezfs_bitmap_alloc(struct super_block *sb, struct ezfs_bitmap *bm,
+		uint64_t goal, unsigned int nr)
+{
+	uint64_t i, group;
+	unsigned long from, size;
+	struct ezfs_group *grp;
+	struct buffer_head *bh;
+	long bit;
+
+	if (!nr || nr > EZFS_BITS_PER_BLOCK || atomic64_read(&bm->nfree) < nr)
+		return -ENOSPC;
+	if (goal >= bm->nbits)
+		goal = 0;
+	if (bm->has_tree)
+		return ezfs_bitmap_alloc_tree(sb, bm, goal, nr);
+
+	group = goal / EZFS_BITS_PER_BLOCK;
+	from = goal % EZFS_BITS_PER_BLOCK;
+	/* The goal group is visited twice, the second time from its start. */
+	for (i = 0; i <= bm->ngroups; i++) {
+		grp = &bm->groups[group];
+		if (READ_ONCE(grp->nfree) >= nr) {
+			size = min_t(uint64_t, EZFS_BITS_PER_BLOCK,
+					bm->nbits - group * EZFS_BITS_PER_BLOCK);
+
+			ezfs_lock_timed(sb, mutex_trylock(&grp->lock),
+					mutex_lock(&grp->lock));
+			bh = sb_bread(sb, bm->start + group);
+			if (!bh) {
+				mutex_unlock(&grp->lock);
+				return -EIO;
+			}
+			bit = ezfs_find_zero_area(bh->b_data, size, from, nr);
+			if (bit >= 0) {
+				for (size = 0; size < nr; size++)
+					__set_bit_le(bit + size, bh->b_data);
+				ezfs_journal_dirty(sb, bh);
+				grp->nfree -= nr;
+				atomic64_sub(nr, &bm->nfree);
+			}
+			brelse(bh);
+			mutex_unlock(&grp->lock);
+
+			if (bit >= 0) {
+				bit += group * EZFS_BITS_PER_BLOCK;
+				WRITE_ONCE(bm->cursor, bit + nr);
+				return bit;
+			}
+		}
+		from = 0;
+		group = (group + 1) % bm->ngroups;
+	}
+	return -ENOSPC;
+}
+
+/* Sets up the allocation groups of bm and counts their clear bits, and with
+ * tree set, builds the free tree from the runs of them. Called once at mount.
+ */
+static int ezfs_bitmap_init(struct super_block *sb, struct ezfs_bitmap *bm,
+		uint64_t start, uint64_t nbits, bool tree)
+{
+	uint64_t group;
+	unsigned long size, bit, end, used;
+	struct buffer_head *bh;
+	int ret;
+
+	bm->has_tree = tree;
+	mutex_init(&bm->tree_lock);
+	bm->free_tree = RB_ROOT;
+	bm->start = start;
+	bm->nbits = nbits;
+	bm->cursor = 0;
+	bm->ngroups = DIV_ROUND_UP(nbits, EZFS_BITS_PER_BLOCK);
+	bm->groups = kcalloc(bm->ngroups, sizeof(*bm->groups), GFP_KERNEL);
+	if (!bm->groups)
+		return -ENOMEM;
+	atomic64_set(&bm->nfree, 0);
+
+	for (group = 0; group < bm->ngroups; group++) {
+		size = min_t(uint64_t, EZFS_BITS_PER_BLOCK,
+				nbits - group * EZFS_BITS_PER_BLOCK);
+		bh = sb_bread(sb, start + group);
+		if (!bh)
+			return -EIO;
+		if (size == EZFS_BITS_PER_BLOCK) {
+			used = bitmap_weight((unsigned long *) bh->b_data, size);
+		} else {
+			used = 0;
+			for (bit = find_next_bit_le(bh->b_data, size, 0);
+					bit < size;
+					bit = find_next_bit_le(bh->b_data, size, bit + 1))
+				used++;
+		}
+
+		/* Runs that reach the end of a group merge with the next one */
+		for (bit = find_next_zero_bit_le(bh->b_data, size, 0);
+				tree && bit < size;
+				bit = find_next_zero_bit_le(bh->b_data, size, end)) {
+			end = find_next_bit_le(bh->b_data, size, bit);
+			ret = ezfs_free_insert(bm, group * EZFS_BITS_PER_BLOCK +
+					bit, end - bit, GFP_KERNEL);
+			if (ret) {
+				brelse(bh);
+				return ret;
+			}
+		}
+		brelse(bh);
+
+		mutex_init(&bm->groups[group].lock);
+		bm->groups[group].nfree = size - used;
+		atomic64_add(size - used, &bm->nfree);
+	}
+	return 0;
+}
+
+static void ezfs_bitmap_destroy(struct ezfs_bitmap *bm)
+{
+	unsigned long group;
+
+	ezfs_free_tree_destroy(bm);
+	mutex_destroy(&bm->tree_lock);
+	if (!bm->groups)
+		return;
+	for (group = 0; group < bm->ngroups; group++)
+		mutex_destroy(&bm->groups[group].lock);
+	kfree(bm->groups);
+	bm->groups = NULL;
+}
+
+/* Picks where to look for a new inode of dir, Orlov-style. A directory
+ * made in the root starts at a random inode, moved on to the next group
+ * with at least its share of free inodes, so that top-level trees spread
+ * over the volume. Anything else goes right after its parent, which keeps
+ * a directory's files near it, and through ezfs_ino_goal their blocks too.
+ */
+static uint64_t ezfs_ino_alloc_goal(struct inode *dir, umode_t mode)
+{
+	struct ezfs_bitmap *bm = &get_ezfs_sb_info(dir->i_sb)->inode_map;
+	uint64_t goal, avg, group, i;
+
+	if (!S_ISDIR(mode) || dir->i_ino != EZFS_ROOT_INODE_NUMBER)
+		return dir->i_ino - EZFS_ROOT_INODE_NUMBER;
+
+	goal = prandom_u32_max(min_t(uint64_t, bm->nbits, U32_MAX));
+	avg = atomic64_read(&bm->nfree) / bm->ngroups;
+	group = goal / EZFS_BITS_PER_BLOCK;
+	for (i = 0; i < bm->ngroups; i++) {
+		if (READ_ONCE(bm->groups[group].nfree) >= avg)
+			return i ? group * EZFS_BITS_PER_BLOCK : goal;
+		group = (group + 1) % bm->ngroups;
+	}
+	return goal;
+}
+
+/* Allocates an inode number, the first free one from bit goal on. */
+static long ezfs_alloc_ino(struct super_block *sb, uint64_t goal)
+{
+	struct ezfs_bitmap *bm = &get_ezfs_sb_info(sb)->inode_map;
+	long bit;
+
+	bit = ezfs_bitmap_alloc(sb, bm, goal, 1);
+	if (bit < 0)
+		return bit;
+	return bit + EZFS_ROOT_INODE_NUMBER;
+}
+
+static inline int ezfs_free_ino(struct super_block *sb, unsigned long ino)
+{
+	return ezfs_bitmap_free(sb, &get_ezfs_sb_info(sb)->inode_map,
+			ino - EZFS_ROOT_INODE_NUMBER, 1);
+}
+
+/* Where the blocks of inode ino go when nothing else says: as far into the
+ * data area as ino is into the inode table. Inodes close together get
+ * blocks close together, and consecutive ones are spaced by the volume's
+ * blocks per inode, which leaves each file room to grow before it runs
+ * into the next one.
+ */
+static uint64_t ezfs_ino_goal(struct super_block *sb, unsigned long ino)
+{
+	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(sb);
+
+	return ezfs_sb->data_start +
+		mul_u64_u64_div_u64(ino - EZFS_ROOT_INODE_NUMBER,
+				ezfs_sb->nr_data_blocks, ezfs_sb->nr_inodes);
+}
+
+/* Allocates nr physically contiguous data blocks and returns the device
+ * block of the first one. The search starts at device block goal, or where
+ * the last allocation ended when there is no goal.
+ */
+static long ezfs_alloc_blocks(struct super_block *sb, uint64_t goal,
+		unsigned int nr)
+{
+	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(sb);
+	struct ezfs_bitmap *bm = &get_ezfs_sb_info(sb)->data_map;
+	uint64_t from = READ_ONCE(bm->cursor);
+	long bit;
+
+	if (goal >= ezfs_sb->data_start)
+		from = goal - ezfs_sb->data_start;
+
+	bit = ezfs_bitmap_alloc(sb, bm, from, nr);
+	if (bit < 0)
+		return bit;
+	return bit + ezfs_sb->data_start;
+}
+
+/* Returns the length of the longest run of free data blocks right now. */
+static uint64_t ezfs_free_longest(struct super_block *sb)
+{
+	struct ezfs_bitmap *bm = &get_ezfs_sb_info(sb)->data_map;
+	uint64_t len;
+
+	mutex_lock(&bm->tree_lock);
+	len = ezfs_fe_max(bm->free_tree.rb_node);
+	mutex_unlock(&bm->tree_lock);
+	return len;
+}
+
+static inline int ezfs_free_blocks(struct super_block *sb, uint64_t blk,
+		uint64_t nr)
+{
+	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(sb);
+
+	if (blk < ezfs_sb->data_start)
+		return -EFSCORRUPTED;
+	trace_ezfs_free_blocks(sb, blk, nr);
+	ezfs_stat_add(sb, blocks_freed, nr);
+	return ezfs_bitmap_free(sb, &get_ezfs_sb_info(sb)->data_map,
+			blk - ezfs_sb->data_start, nr);
+}
+
+/* Delayed allocation only reserves space up front. Blocks are taken from the
+ * bitmap later, so every other allocation has to leave the reserved ones
+ * alone for writeback to succeed.
+ */
+static bool ezfs_blocks_available(struct super_block *sb, uint64_t nr)
+{
+	struct ezfs_sb_info *sbi = get_ezfs_sb_info(sb);
+
+	return atomic64_read(&sbi->data_map.nfree) -
+		atomic64_read(&sbi->reserved_blocks) >= (int64_t) nr;
+}
+
+static int ezfs_reserve_blocks(struct super_block *sb, uint64_t nr)
+{
+	struct ezfs_sb_info *sbi = get_ezfs_sb_info(sb);
+
+	if (atomic64_add_return(nr, &sbi->reserved_blocks) >
+			atomic64_read(&sbi->data_map.nfree)) {
+		atomic64_sub(nr, &sbi->reserved_blocks);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+static inline void ezfs_release_blocks(struct super_block *sb, uint64_t nr)
+{
+	atomic64_sub(nr, &get_ezfs_sb_info(sb)->reserved_blocks);
+}
+
+/* ezfs extent map */
+
+/* Returns the index-th extent of the block map. Extents past the inline array
+ * live in the overflow block, which the caller must have read in ext_bh.
+ */
+static inline struct ezfs_extent *ezfs_extent_at(struct ezfs_inode *ezfs_inode,
+		struct buffer_head *ext_bh, int idx)
+{
+	if (idx < EZFS_INLINE_EXTENTS)
+		return &ezfs_inode->extents[idx];
+	return (struct ezfs_extent *) ext_bh->b_data + idx - EZFS_INLINE_EXTENTS;
+}
+
+/* Reads the overflow extent block if the inode has one. NULL means there is
+ * no overflow block, which is not an error.
+ */
+static struct buffer_head *ezfs_read_extent_block(struct super_block *sb,
+		struct ezfs_inode *ezfs_inode)
+{
+	struct buffer_head *bh;
+
+	if (!ezfs_inode->extent_block)
+		return NULL;
+
+	bh = sb_bread(sb, ezfs_inode->extent_block);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	return bh;
+}
+
+/* Binary search for the last extent that starts at or before block. Returns
+ * -1 if block comes before every extent (or the map is empty).
+ */
+static int ezfs_extent_search(struct ezfs_inode *ezfs_inode,
+		struct buffer_head *ext_bh, uint32_t block)
+{
+	int lo = 0, hi = (int) ezfs_inode->nr_extents - 1, mid, ret = -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ezfs_extent_at(ezfs_inode, ext_bh, mid)->ee_block <= block) {
+			ret = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return ret;
+}
+
+/* Insert ext at position idx of the block map, shifting later extents up by
+ * one. The overflow block is allocated the first time the inline array runs
+ * out. Caller holds i_map_sem for writing.
+ */
+static int ezfs_extent_insert(struct inode *inode, struct buffer_head **ext_bh,
+		int idx, struct ezfs_extent *ext)
+{
+	int i;
+	long blk;
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
+	struct buffer_head *bh;
+
+	if (ezfs_inode->nr_extents == EZFS_MAX_EXTENTS)
+		return -ENOSPC;
+
+	if (ezfs_inode->nr_extents == EZFS_INLINE_EXTENTS &&
+			!ezfs_inode->extent_block) {
+		blk = ezfs_alloc_blocks(sb, ext->ee_start + 1, 1);
+		if (blk < 0)
+			return blk;
+
+		bh = sb_getblk(sb, blk);
+		if (!bh) {
+			ezfs_free_blocks(sb, blk, 1);
+			return -EIO;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, EZFS_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+
+		ezfs_inode->extent_block = blk;
+		inode->i_blocks += 8;
+		*ext_bh = bh;
+	}
+
+	for (i = ezfs_inode->nr_extents; i > idx; i--)
+		*ezfs_extent_at(ezfs_inode, *ext_bh, i) =
+			*ezfs_extent_at(ezfs_inode, *ext_bh, i - 1);
+	*ezfs_extent_at(ezfs_inode, *ext_bh, idx) = *ext;
+	ezfs_inode->nr_extents++;
+
+	if (*ext_bh)
+		ezfs_journal_dirty(sb, *ext_bh);
+	return 0;
+}
+
+/* Release every block mapped at or beyond logical block from, and the
+ * overflow block once the inline array is enough again. Caller holds
+ * i_map_sem for writing and marks the inode dirty.
+ */
+static int ezfs_truncate_blocks(struct inode *inode, uint32_t from)
+{
+	int keep, nr;
+	uint32_t i;
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
+	struct buffer_head *ext_bh;
+	struct ezfs_extent *ext;
+
+	ext_bh = ezfs_read_extent_block(sb, ezfs_inode);
+	if (IS_ERR(ext_bh))
+		return PTR_ERR(ext_bh);
+
+	for (nr = ezfs_inode->nr_extents; nr > 0; nr--) {
+		ext = ezfs_extent_at(ezfs_inode, ext_bh, nr - 1);
+		if (ext->ee_block + ext->ee_len <= from)
+			break;
+
+		keep = from > ext->ee_block ? from - ext->ee_block : 0;
+		ezfs_free_blocks(sb, ext->ee_start + keep, ext->ee_len - keep);
+		/* directory blocks are metadata, and may be in the journal */
+		if (S_ISDIR(inode->i_mode))
+			for (i = keep; i < ext->ee_len; i++)
+				ezfs_journal_forget(sb, ext->ee_start + i);
+		inode->i_blocks -= (ext->ee_len - keep) * 8;
+
+		if (keep) {
+			ext->ee_len = keep;
+			break;
+		}
+	}
+	ezfs_inode->nr_extents = nr;
+
+	if (ext_bh && nr <= EZFS_INLINE_EXTENTS) {
+		ezfs_free_blocks(sb, ezfs_inode->extent_block, 1);
+		brelse(ext_bh);
+		ezfs_journal_forget(sb, ezfs_inode->extent_block);
+		ezfs_inode->extent_block = 0;
+		inode->i_blocks -= 8;
+	} else if (ext_bh) {
+		ezfs_journal_dirty(sb, ext_bh);
+		brelse(ext_bh);
+	}
+	return 0;
+}
+
+/* ezfs_map_blocks() modes */
+#define EZFS_LOOKUP 0 /* only report what is there */
+#define EZFS_CREATE 1 /* place holes and delayed blocks */
+#define EZFS_DELAY 2 /* reserve holes as delayed blocks where possible */
+
+/* ezfs_map.m_flags */
+#define EZFS_MAP_MAPPED 0x1 /* m_pblk holds the first device block */
+#define EZFS_MAP_NEW 0x2 /* blocks were placed by this call */
+#define EZFS_MAP_DELAYED 0x4 /* reserved, but not placed yet */
+
+/* A run of logical blocks that share one state. */
+struct ezfs_map {
+	uint32_t m_lblk;
+	uint32_t m_len;
+	uint64_t m_pblk;
+	unsigned int m_flags;
+};
+
+/* Places up to len blocks from logical block lblk on, which must be a hole,
+ * and returns how many it placed. The caller holds i_map_sem for writing,
+ * inside a handle, and marks the inode dirty once it has dropped it.
+ */
+static long ezfs_alloc_run(struct inode *inode, struct buffer_head **ext_bh,
+		uint32_t lblk, uint32_t len)
+{
+	int idx, ret;
+	long blk;
+	uint64_t goal;
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
+	struct ezfs_extent *ext = NULL, *next, new_ext;
+
+	idx = ezfs_extent_search(ezfs_inode, *ext_bh, lblk);
+	if (idx >= 0)
+		ext = ezfs_extent_at(ezfs_inode, *ext_bh, idx);
+	if (idx + 1 < ezfs_inode->nr_extents) {
+		next = ezfs_extent_at(ezfs_inode, *ext_bh, idx + 1);
+		len = min_t(uint32_t, len, next->ee_block - lblk);
+	}
+	len = min_t(uint32_t, len, EZFS_BITS_PER_BLOCK);
+
+	/* Try to place the new blocks right after their logical predecessor,
+	 * so that appends extend the last extent instead of starting a new
+	 * one. Existing blocks are never moved. If there is no free run that
+	 * long, settle for a shorter one.
+	 */
+	if (ext)
+		goal = ext->ee_start + lblk - ext->ee_block;
+	else
+		goal = ezfs_ino_goal(sb, inode->i_ino);
+	for (;;) {
+		blk = ezfs_alloc_blocks(sb, goal, len);
+		if (blk != -ENOSPC || len == 1)
+			break;
+		len = clamp_t(uint64_t, ezfs_free_longest(sb), 1, len - 1);
+	}
+	if (blk < 0)
+		return blk;
+
+	if (ext && ext->ee_block + ext->ee_len == lblk &&
+			ext->ee_start + ext->ee_len == blk) {
+		ext->ee_len += len;
+		if (*ext_bh && idx >= EZFS_INLINE_EXTENTS)
+			ezfs_journal_dirty(sb, *ext_bh);
+	} else {
+		new_ext.ee_block = lblk;
+		new_ext.ee_len = len;
+		new_ext.ee_start = blk;
+		ret = ezfs_extent_insert(inode, ext_bh, idx + 1, &new_ext);
+		if (ret) {
+			ezfs_free_blocks(sb, blk, len);
+			return ret;
+		}
+	}
+
+	trace_ezfs_alloc_run(inode, lblk, blk, len, ezfs_inode->nr_extents);
+	ezfs_stat_add(sb, allocs, 1);
+	ezfs_stat_add(sb, blocks_allocated, len);
+	inode->i_blocks += 8 * len;
+	return len;
+}
+
+/* Forgets the delayed blocks at or after logical block from and gives their
+ * reservations back. The caller holds i_map_sem for writing.
+ */
+static void ezfs_da_trim(struct inode *inode, uint32_t from)
+{
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	uint32_t end = ei->i_da_start + ei->i_da_len;
+
+	if (!ei->i_da_len || from >= end)
+		return;
+	from = max(from, ei->i_da_start);
+	ezfs_release_blocks(inode->i_sb, end - from);
+	ei->i_da_len = from - ei->i_da_start;
+}
+
+/* Speculative preallocation. When the delayed run being placed ends at EOF,
+ * the file is being appended to, so as many blocks as the file already has
+ * (up to prealloc_max_kb) are placed past EOF as well. A steadily growing
+ * file keeps landing in one run that doubles each time, and unused blocks
+ * are given back by ezfs_trim_eof_blocks.
+ */
+static uint32_t ezfs_prealloc_len(struct inode *inode, uint32_t end)
+{
+	uint32_t len;
+
+	if (end < DIV_ROUND_UP(i_size_read(inode), EZFS_BLOCK_SIZE))
+		return 0;
+	len = min_t(uint32_t, end, prealloc_max_kb >> (inode->i_blkbits - 10));
+	while (len && !ezfs_blocks_available(inode->i_sb, len))
+		len /= 2;
+	return len;
+}
+
+/* Maps up to map->m_len blocks from map->m_lblk on, and cuts m_len down to
+ * the run that is in the same state as the first block: mapped from m_pblk
+ * on, delayed, or a hole. See EZFS_LOOKUP and friends for what mode does to
+ * holes.
+ */
+static int ezfs_map_blocks(struct inode *inode, struct ezfs_map *map, int mode)
+{
+	int ret = 0, idx;
+	long placed;
+	bool writer = false;
+	uint32_t block = map->m_lblk, len = map->m_len, da_end;
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_handle handle;
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	struct ezfs_inode *ezfs_inode = &ei->raw;
+	struct ezfs_extent *ext;
+	struct buffer_head *ext_bh;
+
+	map->m_pblk = 0;
+	map->m_flags = 0;
+
+	/* Inserting into the block map shifts extents, so even lookups
+	 * have to be protected. They share i_map_sem; a miss that has to
+	 * allocate retries with it held for writing.
+	 */
+	down_read(&ei->i_map_sem);
+retry:
+	ext_bh = ezfs_read_extent_block(sb, ezfs_inode);
+	if (IS_ERR(ext_bh)) {
+		ret = PTR_ERR(ext_bh);
+		goto out_unlock;
+	}
+
+	idx = ezfs_extent_search(ezfs_inode, ext_bh, block);
+	if (idx >= 0) {
+		ext = ezfs_extent_at(ezfs_inode, ext_bh, idx);
+		if (block < ext->ee_block + ext->ee_len) {
+			map->m_len = min_t(uint32_t, len,
+				ext->ee_block + ext->ee_len - block);
+			map->m_pblk = ext->ee_start + block - ext->ee_block;
+			map->m_flags |= EZFS_MAP_MAPPED;
+			goto out;
+		}
+	}
+
+	/* A hole runs up to the next extent, or to the delayed range */
+	if (idx + 1 < ezfs_inode->nr_extents) {
+		ext = ezfs_extent_at(ezfs_inode, ext_bh, idx + 1);
+		len = min_t(uint32_t, len, ext->ee_block - block);
+	}
+	da_end = ei->i_da_start + ei->i_da_len;
+	if (ei->i_da_len && block >= ei->i_da_start && block < da_end &&
+			mode != EZFS_CREATE) {
+		map->m_len = min(len, da_end - block);
+		map->m_flags = EZFS_MAP_DELAYED;
+		goto out;
+	}
+	if (ei->i_da_len && block < ei->i_da_start)
+		len = min(len, ei->i_da_start - block);
+	map->m_len = len;
+	if (mode == EZFS_LOOKUP)
+		goto out;
+
+	if (!writer) {
+		if (ext_bh)
+			brelse(ext_bh);
+		up_read(&ei->i_map_sem);
+		ezfs_journal_start(sb, &handle, EZFS_HANDLE_CREDITS);
+		ezfs_lock_timed(sb, down_write_trylock(&ei->i_map_sem),
+				down_write(&ei->i_map_sem));
+		writer = true;
+		goto retry;
+	}
+
+	/* Delayed allocation only reserves space. The range grows at its end
+	 * (or starts over once placed), so a file written in small appends
+	 * is later placed as one run; a hole anywhere else is placed now.
+	 */
+	if (mode == EZFS_DELAY && (!ei->i_da_len || block == da_end)) {
+		while ((ret = ezfs_reserve_blocks(sb, len)) && len > 1)
+			len /= 2;
+		if (ret)
+			goto out;
+		if (!ei->i_da_len)
+			ei->i_da_start = block;
+		ei->i_da_len += len;
+		map->m_len = len;
+		map->m_flags = EZFS_MAP_DELAYED;
+		goto out;
+	}
+
+	/* A delayed block is placed together with the whole range, from its
+	 * start, so that what stays delayed is still one range. The blocks
+	 * placed no longer need their reservation.
+	 */
+	if (ei->i_da_len && block >= ei->i_da_start && block < da_end) {
+		placed = ezfs_alloc_run(inode, &ext_bh, ei->i_da_start,
+				ei->i_da_len + ezfs_prealloc_len(inode, da_end));
+		if (placed < 0) {
+			ret = placed;
+			goto out;
+		}
+		placed = min_t(uint32_t, placed, ei->i_da_len);
+		ezfs_release_blocks(sb, placed);
+		ei->i_da_start += placed;
+		ei->i_da_len -= placed;
+	} else {
+		/* Anything else must not eat into reserved space */
+		while (!ezfs_blocks_available(sb, len)) {
+			if (len == 1) {
+				ret = -ENOSPC;
+				goto out;
+			}
+			len /= 2;
+		}
+		placed = ezfs_alloc_run(inode, &ext_bh, block, len);
+		if (placed < 0) {
+			ret = placed;
+			goto out;
+		}
+	}
+	map->m_flags |= EZFS_MAP_NEW;
+	if (ext_bh)
+		brelse(ext_bh);
+	len = map->m_len;
+	goto retry;
+
+out:
+	if (ext_bh)
+		brelse(ext_bh);
+out_unlock:
+	trace_ezfs_map_blocks(inode, map->m_lblk, map->m_len, map->m_pblk,
+			map->m_flags, mode, ret);
+	if (writer) {
+		up_write(&ei->i_map_sem);
+		if (map->m_flags & EZFS_MAP_NEW)
+			mark_inode_dirty(inode);
+		ezfs_journal_stop(&handle);
+	} else {
+		up_read(&ei->i_map_sem);
+	}
+	return ret;
+}
+
+/* ezfs directory entries */
+static inline bool ezfs_dir_indexed(struct inode *dir)
+{
+	return get_ezfs_inode(dir)->flags & EZFS_INDEXED_DIR_FL;
+}
+
+static inline uint32_t ezfs_dir_nblocks(struct inode *dir)
+{
+	return dir->i_size >> dir->i_sb->s_blocksize_bits;
+}
+
+/* Logical block of the first block holding entries */
+static inline uint32_t ezfs_dir_first_leaf(struct inode *dir)
+{
+	return ezfs_dir_indexed(dir) ? 1 : 0;
+}
+
+/* Whether the record at @off of a leaf stays inside the leaf and is long
+ * enough for its entry. Walks of a leaf check every record they step on.
+ */
+static inline bool ezfs_entry_valid(struct ezfs_dir_entry *de, unsigned int off)
+{
+	unsigned int need = sizeof(*de);
+
+	if (de->inode_no) {
+		if (!de->name_len)
+			return false;
+		need = EZFS_DIR_REC_LEN(de->name_len);
+	}
+	return de->rec_len >= need && !(de->rec_len % EZFS_DIR_ALIGN) &&
+		de->rec_len <= EZFS_BLOCK_SIZE - off;
+}
+
+static bool ezfs_leaf_valid(void *leaf)
+{
+	struct ezfs_dir_entry *de;
+	unsigned int off;
+
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = leaf + off;
+		if (!ezfs_entry_valid(de, off))
+			return false;
+	}
+	return true;
+}
+
+/* Makes @leaf a block without entries: one empty record spanning it. */
+static void ezfs_leaf_init(void *leaf)
+{
+	struct ezfs_dir_entry *de = leaf;
+
+	memset(leaf, 0, EZFS_BLOCK_SIZE);
+	de->rec_len = EZFS_BLOCK_SIZE;
+}
+
+/* Looks @name up in @bh, a leaf of @dir. Returns its entry, with the record
+ * before it in @prev (NULL if it is the first of the block), or an ERR_PTR.
+ * Only entries of the same hash and length have their names compared. The
+ * number of records looked at goes to @probes.
+ */
+static struct ezfs_dir_entry *ezfs_find_entry(struct inode *dir,
+		struct buffer_head *bh, const struct qstr *name,
+		struct ezfs_dir_entry **prev, unsigned int *probes)
+{
+	uint32_t hash = ezfs_name_hash(name->name, name->len);
+	struct ezfs_dir_entry *de, *last = NULL;
+	unsigned int off;
+
+	*probes = 0;
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = (struct ezfs_dir_entry *) (bh->b_data + off);
+		if (!ezfs_entry_valid(de, off)) {
+			de = ERR_PTR(-EFSCORRUPTED);
+			goto out;
+		}
+		++*probes;
+		if (de->inode_no && de->name_hash == hash &&
+				de->name_len == name->len &&
+				!memcmp(de->name, name->name, name->len)) {
+			if (prev)
+				*prev = last;
+			goto out;
+		}
+		last = de;
+	}
+	de = ERR_PTR(-ENOENT);
+out:
+	ezfs_stat_add(dir->i_sb, lookup_probes, *probes);
+	return de;
+}
+
+/* Stores an entry in the first record of @leaf with room for it past its
+ * own entry, splitting that record in two. Returns -ENOSPC if none has.
+ */
+static int ezfs_leaf_add(void *leaf, const char *name, unsigned int len,
+		uint32_t hash, uint64_t ino, uint8_t type)
+{
+	unsigned int need = EZFS_DIR_REC_LEN(len), used, off;
+	struct ezfs_dir_entry *de, *next;
+
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = leaf + off;
+		if (!ezfs_entry_valid(de, off))
+			return -EFSCORRUPTED;
+		used = de->inode_no ? EZFS_DIR_REC_LEN(de->name_len) : 0;
+		if (de->rec_len - used < need)
+			continue;
+
+		if (used) {
+			next = leaf + off + used;
+			next->rec_len = de->rec_len - used;
+			de->rec_len = used;
+			de = next;
+		}
+		de->inode_no = ino;
+		de->name_hash = hash;
+		de->name_len = len;
+		de->file_type = type;
+		memcpy(de->name, name, len);
+		return 0;
+	}
+	return -ENOSPC;
+}
+
+/* Removes @de, found after @prev, from its leaf. Its record goes to the
+ * one before it, or is left empty if it is the first of the block.
+ */
+static void ezfs_remove_entry(struct inode *dir, struct buffer_head *bh,
+		struct ezfs_dir_entry *de, struct ezfs_dir_entry *prev)
+{
+	if (prev)
+		prev->rec_len += de->rec_len;
+	else
+		de->inode_no = 0;
+	ezfs_journal_dirty(dir->i_sb, bh);
+}
+
+/* Reads logical block lblk of dir through its block map. With create set, a
+ * block past the end of the directory is allocated, made an empty leaf and
+ * added to i_size, the same way a regular file grows.
+ */
+static struct buffer_head *ezfs_dir_bread(struct inode *dir, uint32_t lblk,
+		bool create)
+{
+	struct ezfs_map map = { .m_lblk = lblk, .m_len = 1 };
+	struct buffer_head *bh;
+	int ret;
+
+	ret = ezfs_map_blocks(dir, &map, create ? EZFS_CREATE : EZFS_LOOKUP);
+	if (ret)
+		return ERR_PTR(ret);
+	if (!(map.m_flags & EZFS_MAP_MAPPED))
+		return ERR_PTR(-EFSCORRUPTED);
+
+	if (!(map.m_flags & EZFS_MAP_NEW)) {
+		bh = sb_bread(dir->i_sb, map.m_pblk);
+		return bh ? bh : ERR_PTR(-EIO);
+	}
+
+	bh = sb_getblk(dir->i_sb, map.m_pblk);
+	if (!bh)
+		return ERR_PTR(-ENOMEM);
+	lock_buffer(bh);
+	ezfs_leaf_init(bh->b_data);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ezfs_journal_dirty(dir->i_sb, bh);
+
+	if ((loff_t) (lblk + 1) << dir->i_sb->s_blocksize_bits > dir->i_size) {
+		i_size_write(dir, (loff_t) (lblk + 1) << dir->i_sb->s_blocksize_bits);
+		mark_inode_dirty(dir);
+	}
+	return bh;
+}
+
+static inline unsigned int ezfs_dir_index_slot(struct ezfs_dir_index *index,
+		uint32_t hash)
+{
+	return index->depth ? hash >> (32 - index->depth) : 0;
+}
+
+/* Reads the block of dir that holds, or would hold, the entry for name. */
+static struct buffer_head *ezfs_dir_leaf(struct inode *dir,
+		const struct qstr *name)
+{
+	struct ezfs_dir_index *index;
+	struct buffer_head *bh;
+	uint32_t lblk;
+
+	bh = ezfs_dir_bread(dir, 0, false);
+	if (IS_ERR(bh) || !ezfs_dir_indexed(dir))
+		return bh;
+
+	index = (struct ezfs_dir_index *) bh->b_data;
+	if (index->depth > EZFS_DIR_MAX_DEPTH) {
+		brelse(bh);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	lblk = index->leaf[ezfs_dir_index_slot(index,
+			ezfs_name_hash(name->name, name->len))];
+	brelse(bh);
+
+	if (lblk == 0 || lblk >= ezfs_dir_nblocks(dir))
+		return ERR_PTR(-EFSCORRUPTED);
+	return ezfs_dir_bread(dir, lblk, false);
+}
+
+/* Turns the only block of dir into the index of a one-leaf hash table. Its
+ * entries move to a new leaf block.
+ */
+static int ezfs_dir_make_indexed(struct inode *dir)
+{
+	struct ezfs_inode *ezfs_inode = get_ezfs_inode(dir);
+	struct ezfs_dir_entry *de;
+	struct ezfs_dir_index *index;
+	struct buffer_head *bh, *leaf_bh;
+	uint32_t lblk = ezfs_dir_nblocks(dir);
+	unsigned int off;
+
+	bh = ezfs_dir_bread(dir, 0, false);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	if (!ezfs_leaf_valid(bh->b_data)) {
+		brelse(bh);
+		return -EFSCORRUPTED;
+	}
+	leaf_bh = ezfs_dir_bread(dir, lblk, true);
+	if (IS_ERR(leaf_bh)) {
+		brelse(bh);
+		return PTR_ERR(leaf_bh);
+	}
+
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = (struct ezfs_dir_entry *) (bh->b_data + off);
+		if (de->inode_no)
+			ezfs_leaf_add(leaf_bh->b_data, de->name, de->name_len,
+				de->name_hash, de->inode_no, de->file_type);
+	}
+	ezfs_journal_dirty(dir->i_sb, leaf_bh);
+	brelse(leaf_bh);
+
+	memset(bh->b_data, 0, EZFS_BLOCK_SIZE);
+	index = (struct ezfs_dir_index *) bh->b_data;
+	index->leaf[0] = lblk;
+	ezfs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+
+	ezfs_inode->flags |= EZFS_INDEXED_DIR_FL;
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/* Splits the leaf hash maps to on its next hash bit, doubling the index
+ * first if the leaf already uses every bit the index does.
+ */
+static int ezfs_dir_split(struct inode *dir, uint32_t hash)
+{
+	struct ezfs_dir_index *index;
+	struct ezfs_dir_entry *de;
+	struct buffer_head *ibh, *obh = NULL, *nbh = NULL;
+	uint32_t lblk = ezfs_dir_nblocks(dir);
+	unsigned int i, slot, depth, span, start, off;
+	void *old, *leaf;
+	int ret = 0;
+
+	old = kmalloc(EZFS_BLOCK_SIZE, GFP_KERNEL);
+	if (!old)
+		return -ENOMEM;
+
+	ibh = ezfs_dir_bread(dir, 0, false);
+	if (IS_ERR(ibh)) {
+		kfree(old);
+		return PTR_ERR(ibh);
+	}
+	index = (struct ezfs_dir_index *) ibh->b_data;
+	if (index->depth > EZFS_DIR_MAX_DEPTH) {
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	slot = ezfs_dir_index_slot(index, hash);
+	depth = index->leaf_depth[slot];
+	if (depth > index->depth) {
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	if (depth == EZFS_DIR_MAX_DEPTH) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	obh = ezfs_dir_bread(dir, index->leaf[slot], false);
+	if (IS_ERR(obh)) {
+		ret = PTR_ERR(obh);
+		obh = NULL;
+		goto out;
+	}
+	if (!ezfs_leaf_valid(obh->b_data)) {
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	nbh = ezfs_dir_bread(dir, lblk, true);
+	if (IS_ERR(nbh)) {
+		ret = PTR_ERR(nbh);
+		nbh = NULL;
+		goto out;
+	}
+
+	if (depth == index->depth) {
+		for (i = 1 << index->depth; i-- > 0;) {
+			index->leaf[2 * i] = index->leaf[i];
+			index->leaf[2 * i + 1] = index->leaf[i];
+			index->leaf_depth[2 * i] = index->leaf_depth[i];
+			index->leaf_depth[2 * i + 1] = index->leaf_depth[i];
+		}
+		index->depth++;
+		slot = ezfs_dir_index_slot(index, hash);
+	}
+
+	/* The slots pointing at the leaf form one aligned run. Its upper half
+	 * now points at the new leaf, which takes the entries whose next hash
+	 * bit is set.
+	 */
+	span = 1 << (index->depth - depth);
+	start = slot & ~(span - 1);
+	for (i = start; i < start + span; ++i) {
+		if (i >= start + span / 2)
+			index->leaf[i] = lblk;
+		index->leaf_depth[i] = depth + 1;
+	}
+	ezfs_journal_dirty(dir->i_sb, ibh);
+
+	memcpy(old, obh->b_data, EZFS_BLOCK_SIZE);
+	ezfs_leaf_init(obh->b_data);
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = old + off;
+		if (!de->inode_no)
+			continue;
+		if (de->name_hash & (1U << (31 - depth)))
+			leaf = nbh->b_data;
+		else
+			leaf = obh->b_data;
+		ezfs_leaf_add(leaf, de->name, de->name_len, de->name_hash,
+			de->inode_no, de->file_type);
+	}
+	ezfs_journal_dirty(dir->i_sb, obh);
+	ezfs_journal_dirty(dir->i_sb, nbh);
+
+out:
+	brelse(nbh);
+	brelse(obh);
+	brelse(ibh);
+	kfree(old);
+	return ret;
+}
+
+/* Adds an entry for name to dir, growing the directory until it fits. mode
+ * is that of the inode, for the file type readdir reports.
+ */
+static int ezfs_dir_add(struct inode *dir, const struct qstr *name,
+		uint64_t ino, umode_t mode)
+{
+	uint32_t hash = ezfs_name_hash(name->name, name->len);
+	struct buffer_head *bh;
+	int ret;
+
+	for (;;) {
+		bh = ezfs_dir_leaf(dir, name);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		ret = ezfs_leaf_add(bh->b_data, name->name, name->len, hash,
+			ino, EZFS_FT(mode));
+		if (!ret)
+			ezfs_journal_dirty(dir->i_sb, bh);
+		brelse(bh);
+		if (ret != -ENOSPC)
+			return ret;
+
+		if (ezfs_dir_indexed(dir))
+			ret = ezfs_dir_split(dir, hash);
+		else
+			ret = ezfs_dir_make_indexed(dir);
+		if (ret)
+			return ret;
+	}
+}
+
+static int ezfs_dir_remove(struct inode *dir, const struct qstr *name)
+{
+	struct buffer_head *bh = ezfs_dir_leaf(dir, name);
+	struct ezfs_dir_entry *de, *prev;
+	unsigned int probes;
+
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	de = ezfs_find_entry(dir, bh, name, &prev, &probes);
+	if (!IS_ERR(de))
+		ezfs_remove_entry(dir, bh, de, prev);
+	brelse(bh);
+	return PTR_ERR_OR_ZERO(de);
+}
+
+/* Points the entry for name in dir at another inode, for a rename over it */
+static int ezfs_dir_set(struct inode *dir, const struct qstr *name,
+		uint64_t ino, umode_t mode)
+{
+	struct buffer_head *bh = ezfs_dir_leaf(dir, name);
+	struct ezfs_dir_entry *de;
+	unsigned int probes;
+
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	de = ezfs_find_entry(dir, bh, name, NULL, &probes);
+	if (!IS_ERR(de)) {
+		de->inode_no = ino;
+		de->file_type = EZFS_FT(mode);
+		ezfs_journal_dirty(dir->i_sb, bh);
+	}
+	brelse(bh);
+	return PTR_ERR_OR_ZERO(de);
+}
+
+/* Past the dots, readdir lists entries in hash order, leaf by leaf, and
+ * pos is 2 plus the hash of the next entry to list. Every leaf holds one
+ * aligned range of hashes, and neither making a directory indexed nor
+ * splitting a leaf changes where an entry falls in that order, so entries
+ * added or removed during a listing never make another one show up twice
+ * or not at all. Only entries of the very same hash can come back twice,
+ * if a listing stops between them.
+ */
+#define EZFS_DIR_EOF (2 + (1ULL << 32))
+#define EZFS_LEAF_MAX_ENTRIES (EZFS_BLOCK_SIZE / EZFS_DIR_REC_LEN(1))
+
+struct ezfs_readdir_ent {
+	uint32_t hash;
+	uint16_t off;
+};
+
+static int ezfs_readdir_cmp(const void *a, const void *b)
+{
+	const struct ezfs_readdir_ent *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return (int) x->off - y->off;
+}
+
+/* Lists the entries of leaf bh from hash pos - 2 on, sorted into ents.
+ * Returns 1 once the caller's buffer is full, 0 at the end of the leaf.
+ */
+static int ezfs_readdir_leaf(struct dir_context *ctx, struct buffer_head *bh,
+		struct ezfs_readdir_ent *ents)
+{
+	uint32_t from = ctx->pos - 2;
+	struct ezfs_dir_entry *de;
+	unsigned int off, i, nr = 0;
+
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = (struct ezfs_dir_entry *) (bh->b_data + off);
+		if (!ezfs_entry_valid(de, off))
+			return -EFSCORRUPTED;
+		if (de->inode_no && de->name_hash >= from) {
+			ents[nr].hash = de->name_hash;
+			ents[nr++].off = off;
+		}
+	}
+	sort(ents, nr, sizeof(*ents), ezfs_readdir_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		de = (struct ezfs_dir_entry *) (bh->b_data + ents[i].off);
+		ctx->pos = 2 + (loff_t) de->name_hash;
+		if (!dir_emit(ctx, de->name, de->name_len, de->inode_no,
+				de->file_type))
+			return 1;
+	}
+	return 0;
+}
+
+/* ezfs_dir_ops */
+int ezfs_iterate(struct file *filp, struct dir_context *ctx)
+{
+	struct inode *inode = file_inode(filp);
+	struct ezfs_dir_index *index = NULL;
+	struct buffer_head *ibh = NULL, *bh;
+	struct ezfs_readdir_ent *ents;
+	unsigned int slot, span;
+	uint64_t end;
+	uint32_t lblk;
+	int ret = 0;
+
+	if (!dir_emit_dots(filp, ctx) || ctx->pos >= EZFS_DIR_EOF)
+		return 0;
+
+	ents = kmalloc_array(EZFS_LEAF_MAX_ENTRIES, sizeof(*ents), GFP_KERNEL);
+	if (!ents)
+		return -ENOMEM;
+	if (ezfs_dir_indexed(inode)) {
+		ibh = ezfs_dir_bread(inode, 0, false);
+		if (IS_ERR(ibh)) {
+			ret = PTR_ERR(ibh);
+			ibh = NULL;
+			goto out;
+		}
+		index = (struct ezfs_dir_index *) ibh->b_data;
+		if (index->depth > EZFS_DIR_MAX_DEPTH) {
+			ret = -EFSCORRUPTED;
+			goto out;
+		}
+	}
+
+	while (ctx->pos < EZFS_DIR_EOF) {
+		/* an unindexed directory is one leaf of every hash */
+		lblk = 0;
+		end = 1ULL << 32;
+		if (index) {
+			slot = ezfs_dir_index_slot(index, ctx->pos - 2);
+			if (index->leaf_depth[slot] > index->depth) {
+				ret = -EFSCORRUPTED;
+				break;
+			}
+			span = 1 << (index->depth - index->leaf_depth[slot]);
+			slot &= ~(span - 1);
+			end = (uint64_t) (slot + span) << (32 - index->depth);
+			lblk = index->leaf[slot];
+			if (lblk == 0 || lblk >= ezfs_dir_nblocks(inode)) {
+				ret = -EFSCORRUPTED;
+				break;
+			}
+		}
+
+		bh = ezfs_dir_bread(inode, lblk, false);
+		if (IS_ERR(bh)) {
+			ret = PTR_ERR(bh);
+			break;
+		}
+		ret = ezfs_readdir_leaf(ctx, bh, ents);
+		brelse(bh);
+		if (ret)
+			break;
+		ctx->pos = 2 + end;
+	}
+	if (ret > 0)
+		ret = 0;
+out:
+	brelse(ibh);
+	kfree(ents);
+	return ret;
+}
+
+/* ezfs flat directories: the single block of fixed-size entries that a
+ * version 1 directory is. Slot i is at position 2 + i.
+ */
+static struct buffer_head *ezfs_flat_dir_bread(struct inode *dir)
+{
+	struct ezfs_inode *ezfs_inode = get_ezfs_inode(dir);
+	struct buffer_head *bh;
+
+	if (!ezfs_inode->nr_extents)
+		return ERR_PTR(-EFSCORRUPTED);
+	bh = sb_bread(dir->i_sb, ezfs_inode->extents[0].ee_start);
+	return bh ? bh : ERR_PTR(-EIO);
+}
+
+static inline unsigned int ezfs_flat_name_len(struct ezfs_flat_dir_entry *de)
+{
+	return strnlen(de->filename, EZFS_FLAT_FILENAME_BUF_SIZE);
+}
+
+struct dentry *ezfs_flat_lookup(struct inode *dir, struct dentry *child_dentry,
+		unsigned int flags)
+{
+	const struct qstr *name = &child_dentry->d_name;
+	struct ezfs_flat_dir_entry *de;
+	struct inode *inode = NULL;
+	struct buffer_head *bh;
+	unsigned long ino = 0;
+	unsigned int i;
+
+	bh = ezfs_flat_dir_bread(dir);
+	if (IS_ERR(bh))
+		return ERR_CAST(bh);
+	de = (struct ezfs_flat_dir_entry *) bh->b_data;
+	for (i = 0; i < EZFS_FLAT_DIR_ENTRIES; i++, de++) {
+		if (de->active && ezfs_flat_name_len(de) == name->len &&
+				!memcmp(de->filename, name->name, name->len)) {
+			ino = de->inode_no;
+			break;
+		}
+	}
+	brelse(bh);
+	if (ino)
+		inode = ezfs_iget(dir->i_sb, ino);
+	return d_splice_alias(inode, child_dentry);
+}
+
+int ezfs_flat_iterate(struct file *filp, struct dir_context *ctx)
+{
+	struct ezfs_flat_dir_entry *de;
+	struct buffer_head *bh;
+	loff_t i;
+
+	if (!dir_emit_dots(filp, ctx))
+		return 0;
+	bh = ezfs_flat_dir_bread(file_inode(filp));
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	for (i = ctx->pos - 2; i < EZFS_FLAT_DIR_ENTRIES; i++) {
+		de = (struct ezfs_flat_dir_entry *) bh->b_data + i;
+		ctx->pos = 2 + i;
+		if (de->active && !dir_emit(ctx, de->filename,
+				ezfs_flat_name_len(de), de->inode_no, DT_UNKNOWN))
+			break;
+	}
+	if (i == EZFS_FLAT_DIR_ENTRIES)
+		ctx->pos = 2 + i;
+	brelse(bh);
+	return 0;
+}
+
+/* Frees the blocks speculative preallocation left past EOF. Blocks that
+ * were fallocated past EOF are kept. The caller keeps i_size from changing.
+ * Returns whether any block was freed.
+ */
+static bool ezfs_trim_eof_blocks(struct inode *inode)
+{
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	uint32_t from = DIV_ROUND_UP(i_size_read(inode), EZFS_BLOCK_SIZE);
+	struct ezfs_map map = { .m_lblk = from, .m_len = U32_MAX - from };
+	struct ezfs_handle handle;
+
+	if (!S_ISREG(inode->i_mode) || (ei->raw.flags & EZFS_PREALLOC_FL))
+		return false;
+	/* nothing mapped from EOF on */
+	if (ezfs_map_blocks(inode, &map, EZFS_LOOKUP) ||
+			(!(map.m_flags & EZFS_MAP_MAPPED) &&
+			 map.m_len == U32_MAX - from))
+		return false;
+
+	ezfs_journal_start(inode->i_sb, &handle, EZFS_TRUNCATE_CREDITS);
+	down_write(&ei->i_map_sem);
+	ezfs_truncate_blocks(inode, from);
+	up_write(&ei->i_map_sem);
+	mark_inode_dirty(inode);
+	ezfs_journal_stop(&handle);
+	return true;
+}
+
+/* Inline data. A file with EZFS_INLINE_DATA_FL is read and written through
+ * ei->raw.i_data, which the next inode update copies into the inode table.
+ * Only page 0 can cache it, and the flag only changes with that page
+ * locked, so readpage and writeback of the page see it steady.
+ */
+
+/* Moves an inline file into a block of its own: page 0 takes the data and
+ * is written back at once, which places the block and commits the new
+ * block map with the inode. The caller holds the inode lock.
+ */
+static int ezfs_inline_convert(struct inode *inode)
+{
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	loff_t size = i_size_read(inode);
+	struct page *page;
+	void *kaddr;
+
+	if (!ezfs_has_inline_data(inode))
+		return 0;
+	if (size && !ezfs_blocks_available(inode->i_sb, 1))
+		return -ENOSPC;
+
+	page = grab_cache_page(inode->i_mapping, 0);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page)) {
+		kaddr = kmap_atomic(page);
+		memcpy(kaddr, ei->raw.i_data, size);
+		memset(kaddr + size, 0, PAGE_SIZE - size);
+		kunmap_atomic(kaddr);
+		SetPageUptodate(page);
+	}
+	if (size)
+		set_page_dirty(page);
+
+	down_write(&ei->i_map_sem);
+	ei->raw.flags &= ~EZFS_INLINE_DATA_FL;
+	memset(ei->raw.i_data, 0, sizeof(ei->raw.i_data));
+	up_write(&ei->i_map_sem);
+	unlock_page(page);
+	put_page(page);
+
+	if (!size) {
+		mark_inode_dirty(inode);
+		return 0;
+	}
+	return filemap_write_and_wait_range(inode->i_mapping, 0, PAGE_SIZE - 1);
+}
+
+/* Reads and lookups see the file as [0, i_size); writes and zeroing may
+ * use all of i_data. Past that is a hole, which a write never reaches
+ * because ezfs_iomap_begin converts the file first.
+ */
+static void ezfs_inline_iomap(struct inode *inode, loff_t pos, loff_t length,
+		unsigned int flags, struct iomap *iomap)
+{
+	loff_t end = flags & (IOMAP_WRITE | IOMAP_ZERO) ?
+		EZFS_INLINE_DATA_SIZE : i_size_read(inode);
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->flags = 0;
+	iomap->addr = IOMAP_NULL_ADDR;
+	if (pos < end) {
+		iomap->type = IOMAP_INLINE;
+		iomap->offset = 0;
+		iomap->length = end;
+		iomap->inline_data = get_ezfs_inode(inode)->i_data;
+	} else {
+		iomap->type = IOMAP_HOLE;
+		iomap->offset = pos;
+		iomap->length = length;
+	}
+}
+
+/* Page 0 of an inline file was dirtied through mmap. The file stays
+ * inline: the page goes back into i_data rather than to a block.
+ */
+static void ezfs_inline_writeback(struct inode *inode, struct page *page)
+{
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	loff_t size = min_t(loff_t, i_size_read(inode), EZFS_INLINE_DATA_SIZE);
+	void *kaddr;
+
+	down_write(&ei->i_map_sem);
+	kaddr = kmap_atomic(page);
+	memcpy(ei->raw.i_data, kaddr, size);
+	kunmap_atomic(kaddr);
+	up_write(&ei->i_map_sem);
+	mark_inode_dirty(inode);
+}
+
+/* ezfs_iomap_ops */
+static void ezfs_set_iomap(struct inode *inode, struct ezfs_map *map,
+		struct iomap *iomap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t) map->m_lblk << blkbits;
+	iomap->length = (loff_t) map->m_len << blkbits;
+	iomap->flags = 0;
+	if (map->m_flags & EZFS_MAP_MAPPED) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = map->m_pblk << blkbits;
+		if (map->m_flags & EZFS_MAP_NEW)
+			iomap->flags |= IOMAP_F_NEW;
+	} else {
+		iomap->type = map->m_flags & EZFS_MAP_DELAYED ?
+			IOMAP_DELALLOC : IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	}
+}
+
+/* Reports the whole run of blocks around pos that share one state, so a
+ * single call covers an entire extent. Buffered writes reserve holes as
+ * delayed blocks; direct writes place them right away.
+ */
+int ezfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+		unsigned int flags, struct iomap *iomap, struct iomap *srcmap)
+{
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	unsigned int blkbits = inode->i_blkbits;
+	struct ezfs_map map;
+	int mode = EZFS_LOOKUP, ret;
+
+	if (ezfs_has_inline_data(inode)) {
+		if (!(flags & IOMAP_WRITE) ||
+				pos + length <= EZFS_INLINE_DATA_SIZE) {
+			ezfs_inline_iomap(inode, pos, length, flags, iomap);
+			return 0;
+		}
+		ret = ezfs_inline_convert(inode);
+		if (ret)
+			return ret;
+	}
+
+	map.m_lblk = pos >> blkbits;
+	map.m_len = min_t(uint64_t, ((pos + length - 1) >> blkbits) -
+			map.m_lblk + 1, U32_MAX);
+	if (flags & IOMAP_WRITE)
+		mode = delalloc && !(flags & IOMAP_DIRECT) ?
+			EZFS_DELAY : EZFS_CREATE;
+
+	/* remembered for ezfs_iomap_end */
+	down_read(&ei->i_map_sem);
+	iomap->private = (void *) (unsigned long)
+		(ei->i_da_start + ei->i_da_len);
+	up_read(&ei->i_map_sem);
+
+	ret = ezfs_map_blocks(inode, &map, mode);
+	if (ret)
+		return ret;
+	ezfs_set_iomap(inode, &map, iomap);
+	return 0;
+}
+
+/* A buffered write that copied less than it asked for gives back the
+ * delayed blocks it reserved past the data it did write.
+ */
+int ezfs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+		ssize_t written, unsigned int flags, struct iomap *iomap)
+{
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	uint32_t from;
+
+	if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+		mark_inode_dirty(inode);
+
+	if (iomap->type == IOMAP_DELALLOC && written < length) {
+		from = (pos + written + i_blocksize(inode) - 1) >>
+			inode->i_blkbits;
+		from = max_t(uint32_t, from, (unsigned long) iomap->private);
+		down_write(&ei->i_map_sem);
+		ezfs_da_trim(inode, from);
+		up_write(&ei->i_map_sem);
+	}
+	return 0;
+}
+
+/* Writeback places delayed blocks and holes dirtied through mmap. Only the
+ * block asked for is placed out of a hole, but a delayed block takes its
+ * whole range with it.
+ */
+int ezfs_map_writeback(struct iomap_writepage_ctx *wpc, struct inode *inode,
+		loff_t offset)
+{
+	struct ezfs_map map;
+	loff_t size = i_size_read(inode);
+	struct page *page;
+	int ret;
+
+	if (ezfs_has_inline_data(inode)) {
+		/* writeback holds page 0 locked */
+		page = find_get_page(inode->i_mapping, 0);
+		if (page) {
+			ezfs_inline_writeback(inode, page);
+			put_page(page);
+		}
+		map.m_lblk = 0;
+		map.m_len = 1;
+		map.m_flags = 0;
+		ezfs_set_iomap(inode, &map, &wpc->iomap);
+		return 0;
+	}
+
+	if (wpc->iomap.type == IOMAP_MAPPED && offset >= wpc->iomap.offset &&
+			offset < wpc->iomap.offset + wpc->iomap.length)
+		return 0;
+
+	map.m_lblk = offset >> inode->i_blkbits;
+	map.m_len = 1;
+	if (size > offset)
+		map.m_len = min_t(uint64_t, (size - offset + i_blocksize(inode) - 1)
+				>> inode->i_blkbits, U32_MAX);
+	ret = ezfs_map_blocks(inode, &map, EZFS_LOOKUP);
+	if (!ret && !(map.m_flags & EZFS_MAP_MAPPED)) {
+		map.m_len = 1;
+		ret = ezfs_map_blocks(inode, &map, EZFS_CREATE);
+	}
+	if (ret)
+		return ret;
+	ezfs_set_iomap(inode, &map, &wpc->iomap);
+	return 0;
+}
+
+/* ezfs_aops */
+int ezfs_readpage(struct file *file, struct page *page)
+{
+	trace_ezfs_readpage(page->mapping->host, page->index, 1);
+	return iomap_readpage(page, &ezfs_iomap_ops);
+}
+
+void ezfs_readahead(struct readahead_control *rac)
+{
+	trace_ezfs_readahead(rac->mapping->host, readahead_index(rac),
+			readahead_count(rac));
+	iomap_readahead(rac, &ezfs_iomap_ops);
+}
+
+int ezfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	trace_ezfs_writepage(page->mapping->host, page->index, 1);
+	return iomap_writepage(page, wbc, &wpc, &ezfs_writeback_ops);
+}
+
+int ezfs_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	trace_ezfs_writepages(mapping->host, wbc);
+	return iomap_writepages(mapping, wbc, &wpc, &ezfs_writeback_ops);
+}
+
+sector_t ezfs_bmap(struct address_space *mapping, sector_t block)
+{
+	/* delayed blocks have no place on disk until they are written */
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+	return iomap_bmap(mapping, block, &ezfs_iomap_ops);
+}
+
+/* ezfs_file_ops */
+int ezfs_file_open(struct inode *inode, struct file *file)
+{
+	if (readahead_kb)
+		file->f_ra.ra_pages = readahead_kb >> (PAGE_SHIFT - 10);
+	return generic_file_open(inode, file);
+}
+
+/* Gives back the blocks, placed or delayed, that a failed write left past
+ * i_size. Placed blocks stay if the file keeps fallocated blocks past EOF,
+ * which cannot be told apart from them.
+ */
+static void ezfs_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	uint32_t from = DIV_ROUND_UP(inode->i_size, EZFS_BLOCK_SIZE);
+	struct ezfs_handle handle;
+
+	if (to > inode->i_size) {
+		truncate_pagecache(inode, inode->i_size);
+		ezfs_journal_start(inode->i_sb, &handle, EZFS_TRUNCATE_CREDITS);
+		down_write(&ei->i_map_sem);
+		ezfs_da_trim(inode, from);
+		if (!(ei->raw.flags & EZFS_PREALLOC_FL))
+			ezfs_truncate_blocks(inode, from);
+		up_write(&ei->i_map_sem);
+		mark_inode_dirty(inode);
+		ezfs_journal_stop(&handle);
+	}
+}
+
+ssize_t ezfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+	if (!iov_iter_count(to))
+		return 0;
+
+	inode_lock_shared(inode);
+	if (ezfs_has_inline_data(inode)) {
+		/* there is no block to read from */
+		inode_unlock_shared(inode);
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		return generic_file_read_iter(iocb, to);
+	}
+	ret = iomap_dio_rw(iocb, to, &ezfs_iomap_ops, NULL,
+			is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+int ezfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+		unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (error)
+		return error;
+	if (size && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+/* Direct writes place holes as they go. A write that extends the file is
+ * waited for, so that i_size only changes under the inode lock. If the
+ * page cache cannot be invalidated, iomap returns -ENOTBLK and the write
+ * is done buffered instead, as is a direct write that an inline file can
+ * still hold.
+ */
+ssize_t ezfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	size_t count;
+	loff_t pos;
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+	ret = file_remove_privs(file);
+	if (!ret)
+		ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	/* Blocks past EOF may be preallocated and hold stale data, so the
+	 * gap between EOF and a write beyond it is zeroed first.
+	 */
+	if (iocb->ki_pos > i_size_read(inode)) {
+		ret = iomap_zero_range(inode, i_size_read(inode),
+				iocb->ki_pos - i_size_read(inode), NULL,
+				&ezfs_iomap_ops);
+		if (ret)
+			goto out_unlock;
+	}
+
+	pos = iocb->ki_pos;
+	count = iov_iter_count(from);
+	ret = -ENOTBLK;
+	if ((iocb->ki_flags & IOCB_DIRECT) && ezfs_has_inline_data(inode) &&
+			pos + count > EZFS_INLINE_DATA_SIZE) {
+		ret = ezfs_inline_convert(inode);
+		if (ret)
+			goto out_unlock;
+		ret = -ENOTBLK;
+	}
+	if ((iocb->ki_flags & IOCB_DIRECT) && !ezfs_has_inline_data(inode))
+		ret = iomap_dio_rw(iocb, from, &ezfs_iomap_ops,
+				&ezfs_dio_write_ops, is_sync_kiocb(iocb) ||
+				pos + count > i_size_read(inode));
+	if (ret == -ENOTBLK) {
+		ret = iomap_file_buffered_write(iocb, from, &ezfs_iomap_ops);
+		if (ret == -ENOSPC && ezfs_should_retry_alloc(inode->i_sb))
+			ret = iomap_file_buffered_write(iocb, from,
+					&ezfs_iomap_ops);
+		if (ret > 0)
+			iocb->ki_pos += ret;
+	}
+	if (ret != -EIOCBQUEUED && ret < (ssize_t) count)
+		ezfs_write_failed(file->f_mapping, pos + count);
+
+out_unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+/* A store through a shared mapping dirties the page like a buffered write:
+ * holes under it get delayed blocks reserved, so running out of space
+ * fails the fault rather than the writeback.
+ */
+vm_fault_t ezfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct super_block *sb = file_inode(vmf->vma->vm_file)->i_sb;
+	vm_fault_t ret;
+
+	sb_start_pagefault(sb);
+	file_update_time(vmf->vma->vm_file);
+	ret = iomap_page_mkwrite(vmf, &ezfs_iomap_ops);
+	sb_end_pagefault(sb);
+	return ret;
+}
+
+int ezfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ezfs_file_vm_ops;
+	return 0;
+}
+
+/* With a journal, fsync is one commit: the inode, and the blocks its data
+ * was just given, reach the disk in a single sequential log write whose
+ * cache flush also covers the data.
+ */
+int ezfs_file_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	int ret;
+
+	if (!ezfs_journal(inode->i_sb))
+		return generic_file_fsync(file, start, end, datasync);
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+	return ezfs_journal_commit(inode->i_sb, true);
+}
+
+int ezfs_file_release(struct inode *inode, struct file *file)
+{
+	if (file->f_mode & FMODE_WRITE) {
+		inode_lock(inode);
+		ezfs_trim_eof_blocks(inode);
+		inode_unlock(inode);
+	}
+	return 0;
+}
+
+/* Places the blocks of [offset, offset + len) ahead of time. EZFS has no
+ * unwritten extents, so blocks placed here are zeroed on disk before they
+ * are part of the file. With FALLOC_FL_KEEP_SIZE, blocks past EOF survive
+ * close until the file is truncated.
+ */
+long ezfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t end = offset + len;
+	struct ezfs_map map;
+	uint32_t lblk, last;
+	int ret;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	ret = inode_newsize_ok(inode, end);
+	if (ret)
+		goto out;
+	ret = ezfs_inline_convert(inode);
+	if (ret)
+		goto out;
+
+	/* the zeroing below must not race with writeback of the range */
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+	if (ret)
+		goto out;
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		ret = iomap_zero_range(inode, i_size_read(inode),
+				end - i_size_read(inode), NULL, &ezfs_iomap_ops);
+		if (ret)
+			goto out;
+	}
+
+	lblk = offset >> blkbits;
+	last = (end - 1) >> blkbits;
+	while (lblk <= last) {
+		map.m_lblk = lblk;
+		map.m_len = last - lblk + 1;
+		ret = ezfs_map_blocks(inode, &map, EZFS_CREATE);
+		if (ret == -ENOSPC && ezfs_should_retry_alloc(inode->i_sb))
+			continue;
+		if (ret)
+			break;
+		if (map.m_flags & EZFS_MAP_NEW) {
+			ret = sb_issue_zeroout(inode->i_sb, map.m_pblk,
+					map.m_len, GFP_NOFS);
+			if (ret)
+				break;
+		}
+		lblk += map.m_len;
+	}
+
+	if (!ret && end > i_size_read(inode)) {
+		if (mode & FALLOC_FL_KEEP_SIZE) {
+			down_write(&ei->i_map_sem);
+			ei->raw.flags |= EZFS_PREALLOC_FL;
+			up_write(&ei->i_map_sem);
+		} else {
+			i_size_write(inode, end);
+		}
+	}
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	return ret;
+}
+
+/* SEEK_HOLE and SEEK_DATA walk the block map. Delayed blocks count as
+ * data.
+ */
+loff_t ezfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	switch (whence) {
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = iomap_seek_hole(inode, offset, &ezfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	case SEEK_DATA:
+		inode_lock_shared(inode);
+		offset = iomap_seek_data(inode, offset, &ezfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+int ezfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	return iomap_fiemap(inode, fieinfo, start, len, &ezfs_iomap_ops);
+}
+
+/* ezfs defragmentation */
+
+/* Most blocks one step of EZFS_IOC_DEFRAG moves, and so keeps locked in
+ * the page cache at a time.
+ */
+#define EZFS_DEFRAG_CHUNK 512
+
+struct ezfs_defrag_chunk {
+	struct ezfs_extent old[EZFS_DEFRAG_CHUNK]; /* The extents moved */
+	int nr;
+	int joins; /* Extents the move joins to the one before, in the chunk */
+	uint32_t blocks;
+	uint64_t old_ext_block; /* Extent block the move emptied, or 0 */
+	struct page *pages[EZFS_DEFRAG_CHUNK];
+	struct buffer_head *bhs[EZFS_DEFRAG_CHUNK];
+};
+
+static void ezfs_defrag_unlock_pages(struct page **pages, uint32_t nr)
+{
+	while (nr--) {
+		unlock_page(pages[nr]);
+		put_page(pages[nr]);
+	}
+}
+
+/* Reads in and locks the page of every block of the chunk. Locked, a page
+ * can be neither written back nor dirtied through mmap. Returns -EAGAIN,
+ * with nothing locked, if one is dirty or under writeback, since its data
+ * is not on disk yet.
+ */
+static int ezfs_defrag_lock_pages(struct inode *inode,
+		struct ezfs_defrag_chunk *c)
+{
+	struct page *page;
+	uint32_t n = 0, i;
+	int j, ret = 0;
+
+	for (j = 0; j < c->nr && !ret; j++) {
+		for (i = 0; i < c->old[j].ee_len; i++) {
+			page = read_mapping_page(inode->i_mapping,
+					c->old[j].ee_block + i, NULL);
+			if (IS_ERR(page)) {
+				ret = PTR_ERR(page);
+				break;
+			}
+			lock_page(page);
+			if (page->mapping != inode->i_mapping ||
+					!PageUptodate(page) || PageDirty(page) ||
+					PageWriteback(page)) {
+				unlock_page(page);
+				put_page(page);
+				ret = -EAGAIN;
+				break;
+			}
+			c->pages[n++] = page;
+		}
+	}
+	if (ret)
+		ezfs_defrag_unlock_pages(c->pages, n);
+	return ret;
+}
+
+/* Writes the locked pages of the chunk to the run at blk and waits for
+ * them. The copies go through the block device's cache, which is emptied
+ * of them again afterwards, since data blocks are never read through it.
+ */
+static int ezfs_defrag_copy(struct super_block *sb,
+		struct ezfs_defrag_chunk *c, uint64_t blk)
+{
+	struct buffer_head *bh;
+	uint32_t i, n;
+	void *kaddr;
+	int ret = 0;
+
+	for (n = 0; n < c->blocks; n++) {
+		bh = sb_getblk(sb, blk + n);
+		if (!bh) {
+			ret = -ENOMEM;
+			break;
+		}
+		lock_buffer(bh);
+		kaddr = kmap_atomic(c->pages[n]);
+		memcpy(bh->b_data, kaddr, EZFS_BLOCK_SIZE);
+		kunmap_atomic(kaddr);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		write_dirty_buffer(bh, 0);
+		c->bhs[n] = bh;
+	}
+
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(c->bhs[i]);
+		if (!buffer_uptodate(c->bhs[i]))
+			ret = -EIO;
+		brelse(c->bhs[i]);
+	}
+	invalidate_mapping_pages(sb->s_bdev->bd_inode->i_mapping, blk,
+			blk + c->blocks - 1);
+	return ret;
+}
+
+/* Points the chunk's extents, copied to the run at blk, at the run instead.
+ * Extents the move made adjacent become one, as does the first with the
+ * extent before it. The old blocks, and the extent block if the map no
+ * longer needs it, stay allocated for ezfs_defrag_free_old. Returns the
+ * index of the extent after the chunk, or -EAGAIN if the map changed since
+ * the chunk was read from it. Caller holds i_map_sem for writing, inside a
+ * handle.
+ */
+static int ezfs_defrag_remap(struct inode *inode, struct ezfs_defrag_chunk *c,
+		uint64_t blk)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
+	struct ezfs_extent *cur = NULL;
+	struct buffer_head *ext_bh;
+	int idx, i, j, removed;
+
+	ext_bh = ezfs_read_extent_block(sb, ezfs_inode);
+	if (IS_ERR(ext_bh))
+		return PTR_ERR(ext_bh);
+
+	idx = ezfs_extent_search(ezfs_inode, ext_bh, c->old[0].ee_block);
+	for (j = 0; j < c->nr; j++) {
+		if (idx < 0 || idx + j >= ezfs_inode->nr_extents ||
+				memcmp(ezfs_extent_at(ezfs_inode, ext_bh, idx + j),
+					&c->old[j], sizeof(c->old[j]))) {
+			brelse(ext_bh);
+			return -EAGAIN;
+		}
+	}
+
+	if (idx > 0) {
+		cur = ezfs_extent_at(ezfs_inode, ext_bh, idx - 1);
+		if (cur->ee_block + cur->ee_len != c->old[0].ee_block ||
+				cur->ee_start + cur->ee_len != blk)
+			cur = NULL;
+	}
+	for (i = idx, j = 0; j < c->nr; blk += c->old[j].ee_len, j++) {
+		if (cur && cur->ee_block + cur->ee_len == c->old[j].ee_block) {
+			cur->ee_len += c->old[j].ee_len;
+			continue;
+		}
+		cur = ezfs_extent_at(ezfs_inode, ext_bh, i++);
+		*cur = c->old[j];
+		cur->ee_start = blk;
+	}
+
+	removed = idx + c->nr - i;
+	for (j = idx + c->nr; j < ezfs_inode->nr_extents; j++)
+		*ezfs_extent_at(ezfs_inode, ext_bh, j - removed) =
+			*ezfs_extent_at(ezfs_inode, ext_bh, j);
+	ezfs_inode->nr_extents -= removed;
+
+	c->old_ext_block = 0;
+	if (ext_bh && ezfs_inode->nr_extents <= EZFS_INLINE_EXTENTS) {
+		brelse(ext_bh);
+		ezfs_journal_forget(sb, ezfs_inode->extent_block);
+		c->old_ext_block = ezfs_inode->extent_block;
+		ezfs_inode->extent_block = 0;
+		inode->i_blocks -= 8;
+	} else if (ext_bh) {
+		ezfs_journal_dirty(sb, ext_bh);
+		brelse(ext_bh);
+	}
+	return i;
+}
+
+/* Frees the blocks a chunk moved off, in the handle of the remap that
+ * stopped using them. Like every freed block, they are not handed out
+ * again before that remap has committed.
+ */
+static void ezfs_defrag_free_old(struct super_block *sb,
+		struct ezfs_defrag_chunk *c)
+{
+	int j;
+
+	for (j = 0; j < c->nr; j++)
+		ezfs_free_blocks(sb, c->old[j].ee_start, c->old[j].ee_len);
+	if (c->old_ext_block)
+		ezfs_free_blocks(sb, c->old_ext_block, 1);
+}
+
+/* Collects the extents from idx on into c, as many as fit in a chunk, and
+ * returns where their blocks should go: right after the extent before. A
+ * chunk is only worth moving if that joins some of its extents together,
+ * or the first to the extent before; otherwise c->nr is left 0.
+ */
+static int ezfs_defrag_next(struct inode *inode, int idx,
+		struct ezfs_defrag_chunk *c, uint64_t *goal)
+{
+	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
+	struct ezfs_extent *ext, *prev = NULL;
+	struct buffer_head *ext_bh;
+	int j;
+
+	ext_bh = ezfs_read_extent_block(inode->i_sb, ezfs_inode);
+	if (IS_ERR(ext_bh))
+		return PTR_ERR(ext_bh);
+
+	c->nr = 0;
+	c->blocks = 0;
+	while (idx + c->nr < ezfs_inode->nr_extents) {
+		ext = ezfs_extent_at(ezfs_inode, ext_bh, idx + c->nr);
+		if (c->blocks + ext->ee_len > EZFS_DEFRAG_CHUNK)
+			break;
+		c->old[c->nr++] = *ext;
+		c->blocks += ext->ee_len;
+	}
+
+	*goal = ezfs_ino_goal(inode->i_sb, inode->i_ino);
+	if (idx > 0) {
+		prev = ezfs_extent_at(ezfs_inode, ext_bh, idx - 1);
+		*goal = prev->ee_start + prev->ee_len;
+	}
+	brelse(ext_bh);
+
+	c->joins = 0;
+	for (j = 1; j < c->nr; j++)
+		if (c->old[j - 1].ee_block + c->old[j - 1].ee_len ==
+				c->old[j].ee_block)
+			c->joins++;
+	if (!c->joins && !(c->nr && prev &&
+			prev->ee_block + prev->ee_len == c->old[0].ee_block))
+		c->nr = 0;
+	return 0;
+}
+
+/* Moves the blocks of a regular file so that runs of short extents become
+ * single extents, each packed after the extent logically before it. The
+ * file goes a chunk at a time: the chunk's pages are locked, their data is
+ * written to a new run and waited for, and only then is the block map
+ * pointed at the run. The old blocks are freed once that has committed. A
+ * crash thus leaves the file on either its old or its new blocks, never on
+ * blocks that were not written or that someone else wrote. Caller holds
+ * the inode lock.
+ */
+static int ezfs_defrag(struct inode *inode, struct ezfs_defrag_info *info)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	struct ezfs_defrag_chunk *c;
+	struct ezfs_handle handle;
+	uint64_t goal;
+	loff_t start, end;
+	long blk;
+	int idx = 0, next, retried = 0, ret;
+
+	/* every block must be placed, and no direct I/O may be using them */
+	inode_dio_wait(inode);
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		return ret;
+	info->extents_before = info->extents_after = ei->raw.nr_extents;
+	if (ezfs_has_inline_data(inode))
+		return 0;
+
+	c = kvmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	while (!ret) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		down_read(&ei->i_map_sem);
+		if (idx >= ei->raw.nr_extents) {
+			up_read(&ei->i_map_sem);
+			break;
+		}
+		ret = ezfs_defrag_next(inode, idx, c, &goal);
+		up_read(&ei->i_map_sem);
+		if (ret)
+			break;
+		/* an extent bigger than a chunk is long enough already */
+		next = idx + max(c->nr, 1);
+		if (!c->nr || !ezfs_blocks_available(sb, c->blocks)) {
+			idx = next;
+			continue;
 		}
-	}
-	brelse(bh);
 
-	return 0;
-}
+		ret = ezfs_defrag_lock_pages(inode, c);
+		if (ret == -EAGAIN && !retried) {
+			/* written to through mmap since the flush */
+			retried = 1;
+			start = (loff_t) c->old[0].ee_block << inode->i_blkbits;
+			end = (loff_t) (c->old[c->nr - 1].ee_block +
+					c->old[c->nr - 1].ee_len) << inode->i_blkbits;
+			ret = filemap_write_and_wait_range(inode->i_mapping,
+					start, end - 1);
+			continue;
+		}
+		retried = 0;
+		if (ret == -EAGAIN) {
+			ret = 0;
+			idx = next;
+			continue;
+		}
+		if (ret)
+			break;
 
-/* ezfs_aops */
-int ezfs_readpage(struct file *file, struct page *page)
-{
-	debug("[%s] file=%s\n", __func__, file->f_path.dentry->d_name.name);
-	return block_read_full_page(page, ezfs_get_block);
-}
+		ezfs_journal_start(sb, &handle, EZFS_TRUNCATE_CREDITS);
+		blk = ezfs_alloc_blocks(sb, goal, c->blocks);
+		if (blk < 0) {
+			ezfs_journal_stop(&handle);
+			ezfs_defrag_unlock_pages(c->pages, c->blocks);
+			if (blk != -ENOSPC)
+				ret = blk;
+			idx = next;
+			continue;
+		}
 
-int ezfs_writepage(struct page *page, struct writeback_control *wbc)
-{
-	debug("[%s]\n", __func__);
-	return block_write_full_page(page, ezfs_get_block, wbc);
-}
+		/* a chunk that only joins the extent before must land there */
+		ret = -EAGAIN;
+		if (c->joins || blk == goal)
+			ret = ezfs_defrag_copy(sb, c, blk);
+		if (!ret) {
+			down_write(&ei->i_map_sem);
+			ret = ezfs_defrag_remap(inode, c, blk);
+			up_write(&ei->i_map_sem);
+		}
+		if (ret >= 0) {
+			ezfs_defrag_free_old(sb, c);
+			info->blocks_moved += c->blocks;
+			idx = ret;
+			ret = 0;
+		} else {
+			ezfs_free_blocks(sb, blk, c->blocks);
+			if (ret == -EAGAIN)
+				ret = 0;
+			idx = next;
+		}
+		mark_inode_dirty(inode);
+		ezfs_journal_stop(&handle);
+		ezfs_defrag_unlock_pages(c->pages, c->blocks);
+		cond_resched();
+	}
 
-static void ezfs_write_failed(struct address_space *mapping, loff_t to)
-{
-	if (to > mapping->host->i_size)
-		truncate_pagecache(mapping->host, mapping->host->i_size);
+	info->extents_after = ei->raw.nr_extents;
+	kvfree(c);
+	return ret;
 }
 
-int ezfs_write_begin(struct file *file, struct address_space *mapping,
-		loff_t pos, unsigned int len, unsigned int flags,
-		struct page **pagep, void **fsdata)
+long ezfs_file_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+	struct inode *inode = file_inode(file);
+	struct ezfs_defrag_info info = {};
 	int ret;
 
-	debug("[%s]\n", __func__);
-	ret = block_write_begin(mapping, pos, len, flags, pagep,
-				ezfs_get_block);
-	if (unlikely(ret))
-		ezfs_write_failed(mapping, pos + len);
-
-	return ret;
+	switch (cmd) {
+	case EZFS_IOC_DEFRAG:
+		/* moving blocks leaves the data alone, so root may do it to
+		 * files it only has open for reading
+		 */
+		if (!(file->f_mode & FMODE_WRITE) && !capable(CAP_SYS_ADMIN))
+			return -EBADF;
+		if (IS_SWAPFILE(inode))
+			return -ETXTBSY;
+		ret = mnt_want_write_file(file);
+		if (ret)
+			return ret;
+		inode_lock(inode);
+		ret = ezfs_defrag(inode, &info);
+		inode_unlock(inode);
+		mnt_drop_write_file(file);
+		if (!ret && copy_to_user((void __user *) arg, &info,
+				sizeof(info)))
+			ret = -EFAULT;
+		return ret;
+	default:
+		return -ENOTTY;
+	}
 }
 
-int ezfs_write_end(struct file *file, struct address_space *mapping,
-			loff_t pos, unsigned len, unsigned copied,
-			struct page *page, void *fsdata)
+/* ezfs_inode_ops */
+/* Size changes zero what becomes part of the file (a truncated EOF block's
+ * tail, or stale blocks past the old EOF), then drop the pages, delayed
+ * blocks and blocks past the new EOF. An inline file grown past i_data is
+ * converted first.
+ */
+int ezfs_setattr(struct dentry *dentry, struct iattr *iattr)
 {
+	struct inode *inode = d_inode(dentry);
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	struct ezfs_handle handle;
+	uint32_t from;
 	int ret;
-	struct inode *inode = mapping->host;
-	loff_t old_size = inode->i_size;
-
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-
-	if (old_size != inode->i_size) {
-		int old_blocks = (old_size + EZFS_BLOCK_SIZE - 1) / EZFS_BLOCK_SIZE;
-		int new_blocks = (inode->i_size + EZFS_BLOCK_SIZE - 1) / EZFS_BLOCK_SIZE;
 
-		inode->i_blocks = new_blocks * 8;
-		mark_inode_dirty(inode);
-
-		if (old_blocks > new_blocks) {
-			struct ezfs_super_block *ezfs_sb = get_ezfs_sb(inode->i_sb);
-			struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
-			int i, data_blk_n = ezfs_inode->data_block_number;
+	ret = setattr_prepare(dentry, iattr);
+	if (ret)
+		return ret;
 
-			mutex_lock(ezfs_sb->ezfs_lock);
-			for (i = new_blocks; i < old_blocks; ++i)
-				CLEARBIT(ezfs_sb->free_data_blocks, data_blk_n + i - EZFS_ROOT_DATABLOCK_NUMBER);
-			mutex_unlock(ezfs_sb->ezfs_lock);
+	if ((iattr->ia_valid & ATTR_SIZE) && iattr->ia_size != inode->i_size) {
+		inode_dio_wait(inode);
+		if (iattr->ia_size > EZFS_INLINE_DATA_SIZE) {
+			ret = ezfs_inline_convert(inode);
+			if (ret)
+				return ret;
 		}
+		if (iattr->ia_size > inode->i_size)
+			ret = iomap_zero_range(inode, inode->i_size,
+					iattr->ia_size - inode->i_size, NULL,
+					&ezfs_iomap_ops);
+		else
+			ret = iomap_truncate_page(inode, iattr->ia_size, NULL,
+					&ezfs_iomap_ops);
+		if (ret)
+			return ret;
+
+		truncate_setsize(inode, iattr->ia_size);
+		from = DIV_ROUND_UP(iattr->ia_size, EZFS_BLOCK_SIZE);
+		ezfs_journal_start(inode->i_sb, &handle, EZFS_TRUNCATE_CREDITS);
+		down_write(&ei->i_map_sem);
+		ezfs_da_trim(inode, from);
+		ret = ezfs_truncate_blocks(inode, from);
+		ei->raw.flags &= ~EZFS_PREALLOC_FL;
+		up_write(&ei->i_map_sem);
+		/* the freed blocks and the new map commit together */
+		mark_inode_dirty(inode);
+		ezfs_journal_stop(&handle);
+		if (ret)
+			return ret;
 	}
-	return ret;
-}
 
-sector_t ezfs_bmap(struct address_space *mapping, sector_t block)
-{
-	debug("[%s] block=%llu\n", __func__, block);
-	return generic_block_bmap(mapping, block, ezfs_get_block);
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
 }
 
-/* ezfs_inode_ops */
+
 struct dentry *ezfs_lookup(struct inode *dir, struct dentry *child_dentry,
 		unsigned int flags)
 {
-	int i;
+	unsigned int probes;
+	unsigned long ino = 0;
 	struct ezfs_dir_entry *ezfs_dentry;
 	struct inode *inode = NULL;
-	uint64_t dir_blk_num = get_ezfs_inode(dir)->data_block_number;
-	struct buffer_head *dir_bh = sb_bread(dir->i_sb, dir_blk_num);
-
-	debug("[%s] dir_ino=%ld, dentry=%s\n", __func__,
-			dir->i_ino, child_dentry->d_name.name);
+	struct buffer_head *dir_bh;
 
-	if (!dir_bh)
-		return ERR_PTR(-EIO);
+	ezfs_stat_add(dir->i_sb, lookups, 1);
+	dir_bh = ezfs_dir_leaf(dir, &child_dentry->d_name);
+	if (IS_ERR(dir_bh))
+		return ERR_CAST(dir_bh);
 
-	ezfs_dentry = (struct ezfs_dir_entry *) dir_bh->b_data;
-	for (i = 0; i < EZFS_MAX_CHILDREN; ++i, ++ezfs_dentry) {
-		if (ezfs_dentry->active &&
-				child_dentry->d_name.len ==
-				strlen(ezfs_dentry->filename) &&
-				!memcmp(ezfs_dentry->filename,
-					child_dentry->d_name.name,
-					child_dentry->d_name.len)) {
-			inode = ezfs_iget(dir->i_sb, ezfs_dentry->inode_no);
-			break;
-		}
-	}
+	ezfs_dentry = ezfs_find_entry(dir, dir_bh, &child_dentry->d_name,
+			NULL, &probes);
+	if (!IS_ERR(ezfs_dentry))
+		ino = ezfs_dentry->inode_no;
 	brelse(dir_bh);
+	if (IS_ERR(ezfs_dentry) && PTR_ERR(ezfs_dentry) != -ENOENT)
+		return ERR_CAST(ezfs_dentry);
+	trace_ezfs_lookup(dir, &child_dentry->d_name, ino, probes);
+	if (ino)
+		inode = ezfs_iget(dir->i_sb, ino);
 
 	return d_splice_alias(inode, child_dentry);
 }
 
 static void write_inode_helper(struct inode *inode,
-							  struct ezfs_inode *ezfs_inode)
+		struct ezfs_inode *ezfs_inode)
 {
 	ezfs_inode->mode = inode->i_mode;
 	ezfs_inode->file_size = inode->i_size;
@@ -344,13 +3723,11 @@ static void write_inode_helper(struct inode *inode,
 static struct inode *create_helper(struct inode *dir,
 		struct dentry *dentry, umode_t mode, bool isdir)
 {
-	int i, i_idx, d_idx, i_num, d_num;
-	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(dir->i_sb);
-	struct buffer_head *dir_bh, *i_bh;
-	struct ezfs_dir_entry *ezfs_dentry;
-	struct inode *new_inode, *ret = NULL;
+	int err;
+	long i_num, d_num = -1;
+	struct inode *new_inode;
 	struct ezfs_inode *new_ezfs_inode;
-	uint64_t dir_blk_num = get_ezfs_inode(dir)->data_block_number;
+	struct ezfs_handle handle;
 
 	if (strnlen(dentry->d_name.name, EZFS_MAX_FILENAME_LENGTH + 1) >
 			EZFS_MAX_FILENAME_LENGTH) {
@@ -358,25 +3735,8 @@ static struct inode *create_helper(struct inode *dir,
 		return ERR_PTR(-ENAMETOOLONG);
 	}
 
-	dir_bh = sb_bread(dir->i_sb, dir_blk_num);
-	if (!dir_bh)
-		return ERR_PTR(-EIO);
-
-	ezfs_dentry = (struct ezfs_dir_entry *) dir_bh->b_data;
-	for (i = 0; i < EZFS_MAX_CHILDREN && ezfs_dentry->active; ++i, ++ezfs_dentry);
-	if (i == EZFS_MAX_CHILDREN) {
-		brelse(dir_bh);
-		return ERR_PTR(-ENOSPC);
-	}
-
-	mutex_lock(ezfs_sb->ezfs_lock);
-	/* find an empty inode */
-	for (i_idx = 0; i_idx < EZFS_MAX_INODES && IS_SET(ezfs_sb->free_inodes, i_idx); i_idx++);
-	if (i_idx == EZFS_MAX_INODES) {
-		ret = ERR_PTR(-ENOSPC);
-		goto out;
-	}
-	i_num = i_idx + EZFS_ROOT_INODE_NUMBER;
+	/* bitmaps, dentry and both inodes commit as one */
+	ezfs_journal_start(dir->i_sb, &handle, EZFS_HANDLE_CREDITS);
 
 	/*
 	 * empty regular files don't need data block
@@ -385,35 +3745,49 @@ static struct inode *create_helper(struct inode *dir,
 	if (isdir)
 		mode |= S_IFDIR;
 
+	/* find an empty inode */
+	i_num = ezfs_alloc_ino(dir->i_sb, ezfs_ino_alloc_goal(dir, mode));
+	if (i_num < 0) {
+		err = i_num;
+		goto out_free;
+	}
+
 	if (mode & S_IFDIR) {
 		struct buffer_head *new_dir_bh;
 
-		for (d_idx = 0; d_idx < EZFS_MAX_DATA_BLKS && IS_SET(ezfs_sb->free_data_blocks, d_idx); d_idx++);
-		if (d_idx == EZFS_MAX_DATA_BLKS) {
-			ret = ERR_PTR(-ENOSPC);
-			goto out;
+		d_num = ezfs_alloc_blocks(dir->i_sb,
+				ezfs_ino_goal(dir->i_sb, i_num), 1);
+		if (d_num < 0) {
+			err = d_num;
+			goto out_release;
 		}
-		d_num = d_idx + EZFS_ROOT_DATABLOCK_NUMBER;
-		/* folder data block should be zeroed out */
-		new_dir_bh = sb_bread(dir->i_sb, d_num);
+		/* the folder starts out as one empty leaf, nothing to read */
+		new_dir_bh = sb_getblk(dir->i_sb, d_num);
 		if (!new_dir_bh) {
-			ret = ERR_PTR(-EIO);
-			goto out;
+			err = -ENOMEM;
+			goto out_release;
 		}
-		memset(new_dir_bh->b_data, 0, EZFS_BLOCK_SIZE);
-		mark_buffer_dirty(new_dir_bh);
+		lock_buffer(new_dir_bh);
+		ezfs_leaf_init(new_dir_bh->b_data);
+		set_buffer_uptodate(new_dir_bh);
+		unlock_buffer(new_dir_bh);
+		ezfs_journal_dirty(dir->i_sb, new_dir_bh);
 		brelse(new_dir_bh);
 	}
 
+	err = ezfs_dir_add(dir, &dentry->d_name, i_num, mode);
+	if (err)
+		goto out_release;
+
 	new_inode = iget_locked(dir->i_sb, i_num);
-	if (IS_ERR(new_inode)) {
-		ret = new_inode;
-		goto out;
+	if (!new_inode) {
+		ezfs_dir_remove(dir, &dentry->d_name);
+		err = -ENOMEM;
+		goto out_release;
 	}
 
 	/* initialize new inode & ezfs_inode */
-	i_bh = get_ezfs_i_bh(dir->i_sb);
-	new_ezfs_inode = ((struct ezfs_inode *) i_bh->b_data) + i_idx;
+	new_ezfs_inode = get_ezfs_inode(new_inode);
 	new_inode->i_mode = mode;
 	new_inode->i_op = &ezfs_inode_ops;
 	new_inode->i_sb = dir->i_sb;
@@ -421,13 +3795,17 @@ static struct inode *create_helper(struct inode *dir,
 		new_inode->i_fop = &ezfs_dir_ops;
 		new_inode->i_size = EZFS_BLOCK_SIZE;
 		new_inode->i_blocks = 8;
-		new_ezfs_inode->data_block_number = d_num;
+		new_ezfs_inode->nr_extents = 1;
+		new_ezfs_inode->extents[0].ee_block = 0;
+		new_ezfs_inode->extents[0].ee_len = 1;
+		new_ezfs_inode->extents[0].ee_start = d_num;
 		set_nlink(new_inode, 2);
 	} else {
 		new_inode->i_fop = &ezfs_file_ops;
 		new_inode->i_size = 0;
 		new_inode->i_blocks = 0;
-		new_ezfs_inode->data_block_number = -1;
+		if (inline_data)
+			new_ezfs_inode->flags = EZFS_INLINE_DATA_FL;
 		set_nlink(new_inode, 1);
 	}
 	new_inode->i_mapping->a_ops = &ezfs_aops;
@@ -435,33 +3813,29 @@ static struct inode *create_helper(struct inode *dir,
 	inode_init_owner(new_inode, dir, mode);
 
 	write_inode_helper(new_inode, new_ezfs_inode);
-	mark_buffer_dirty(i_bh);
-	new_inode->i_private = (void *) new_ezfs_inode;
 
 	d_instantiate_new(dentry, new_inode);
 	mark_inode_dirty(new_inode);
 
-	/* write new dentry to dir data block */
-	strncpy(ezfs_dentry->filename, dentry->d_name.name,
-					strlen(dentry->d_name.name));
-	ezfs_dentry->active = 1;
-	ezfs_dentry->inode_no = i_num;
-	mark_buffer_dirty(dir_bh);
-
 	/* update dir inode attributes */
 	dir->i_mtime = dir->i_ctime = current_time(dir);
 	if (new_inode->i_mode & S_IFDIR)
 		inc_nlink(dir);
 	mark_inode_dirty(dir);
+	ezfs_journal_stop(&handle);
 
-	SETBIT(ezfs_sb->free_inodes, i_idx);
-	if (mode & S_IFDIR)
-		SETBIT(ezfs_sb->free_data_blocks, d_idx);
-	mark_buffer_dirty(get_ezfs_sb_bh(dir->i_sb));
-out:
-	brelse(dir_bh);
-	mutex_unlock(ezfs_sb->ezfs_lock);
-	return ret;
+	return new_inode;
+
+out_release:
+	ezfs_free_ino(dir->i_sb, i_num);
+	if (d_num >= 0) {
+		/* the leaf may be in the transaction already */
+		ezfs_journal_forget(dir->i_sb, d_num);
+		ezfs_free_blocks(dir->i_sb, d_num, 1);
+	}
+out_free:
+	ezfs_journal_stop(&handle);
+	return ERR_PTR(err);
 }
 
 int ezfs_create(struct inode *dir,
@@ -478,45 +3852,26 @@ int ezfs_create(struct inode *dir,
 	return 0;
 }
 
-static int ezfs_unlink_dentry(struct buffer_head *bh, struct dentry *dentry)
-{
-	int i, ret = 0;
-	struct ezfs_dir_entry *ezfs_dentry = (struct ezfs_dir_entry *) bh->b_data;
-
-	for (i = 0; i < EZFS_MAX_CHILDREN; ++i, ++ezfs_dentry) {
-		if (ezfs_dentry->active && strlen(ezfs_dentry->filename) &&
-			!memcmp(ezfs_dentry->filename,
-			dentry->d_name.name, dentry->d_name.len)) {
-			memset(ezfs_dentry, 0, sizeof(struct ezfs_dir_entry));
-			mark_buffer_dirty(bh);
-			ret = 1;
-			goto out;
-		}
-	}
-
-out:
-	brelse(bh);
-	return ret;
-}
-
 int ezfs_unlink(struct inode *dir, struct dentry *dentry)
 {
+	int ret;
 	struct inode *inode = d_inode(dentry);
-	uint64_t dir_blk_num = get_ezfs_inode(dir)->data_block_number;
-	struct buffer_head *bh = sb_bread(dir->i_sb, dir_blk_num);
-
-	if (!bh)
-		return -EIO;
+	struct ezfs_handle handle;
 
-	if (ezfs_unlink_dentry(bh, dentry)) {
-		debug("[%s] dir_ino=%ld, dentry=%s\n", __func__,
-			dir->i_ino, dentry->d_name.name);
-		inode->i_ctime = dir->i_ctime = dir->i_mtime = current_time(inode);
-		drop_nlink(inode);
-		mark_inode_dirty(dir);
-	}
+	ezfs_journal_start(dir->i_sb, &handle, EZFS_HANDLE_CREDITS);
+	ret = ezfs_dir_remove(dir, &dentry->d_name);
+	if (ret)
+		goto out;
 
-	return 0;
+	debug("[%s] dir_ino=%ld, dentry=%s\n", __func__,
+		dir->i_ino, dentry->d_name.name);
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = current_time(inode);
+	drop_nlink(inode);
+	mark_inode_dirty(inode);
+	mark_inode_dirty(dir);
+out:
+	ezfs_journal_stop(&handle);
+	return ret;
 }
 
 int ezfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
@@ -532,50 +3887,73 @@ int ezfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	return 0;
 }
 
-static int ezfs_dir_empty(struct buffer_head *bh)
+/* Returns 1 if dir has no entries, 0 if it has some, or a negative error. */
+static int ezfs_dir_empty(struct inode *dir)
 {
-	int i, ret = 1;
-	struct ezfs_dir_entry *dentry = (struct ezfs_dir_entry *)bh->b_data;
-
-	for (i = 0; i < EZFS_MAX_CHILDREN; ++i, ++dentry) {
-		if (dentry->active) {
-			ret = 0;
-			break;
+	unsigned int off;
+	int ret = 1;
+	uint32_t lblk;
+	struct buffer_head *bh;
+	struct ezfs_dir_entry *dentry;
+
+	for (lblk = ezfs_dir_first_leaf(dir);
+			ret == 1 && lblk < ezfs_dir_nblocks(dir); ++lblk) {
+		bh = ezfs_dir_bread(dir, lblk, false);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+
+		for (off = 0; off < EZFS_BLOCK_SIZE; off += dentry->rec_len) {
+			dentry = (struct ezfs_dir_entry *) (bh->b_data + off);
+			if (!ezfs_entry_valid(dentry, off)) {
+				ret = -EFSCORRUPTED;
+				break;
+			}
+			if (dentry->inode_no) {
+				ret = 0;
+				break;
+			}
 		}
+		brelse(bh);
 	}
-	brelse(bh);
 	return ret;
 }
 
 int ezfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct buffer_head *dir_bh = sb_bread(dir->i_sb,
-			get_ezfs_inode(d_inode(dentry))->data_block_number);
+	int ret;
+	struct ezfs_handle handle;
 
 	debug("[%s] dir_ino=%ld, dentry=%s\n", __func__,
 			d_inode(dentry)->i_ino, dentry->d_name.name);
 
-	if (!dir_bh)
-		return -EIO;
-
-	if (!ezfs_dir_empty(dir_bh))
+	ret = ezfs_dir_empty(d_inode(dentry));
+	if (ret < 0)
+		return ret;
+	if (!ret)
 		return -ENOTEMPTY;
 
 	/* the directory is empty, rmdir */
-	ezfs_unlink(dir, dentry);
-	/* drop nlink for . */
-	drop_nlink(d_inode(dentry));
-	/* drop nlink for .. */
-	drop_nlink(dir);
-	return 0;
+	ezfs_journal_start(dir->i_sb, &handle, EZFS_HANDLE_CREDITS);
+	ret = ezfs_unlink(dir, dentry);
+	if (!ret) {
+		/* drop nlink for . */
+		drop_nlink(d_inode(dentry));
+		/* drop nlink for .. */
+		drop_nlink(dir);
+		mark_inode_dirty(d_inode(dentry));
+		mark_inode_dirty(dir);
+	}
+	ezfs_journal_stop(&handle);
+	return ret;
 }
 
 int ezfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
 {
-	int i, ret;
-	struct ezfs_dir_entry *ezfs_dentry;
-	struct buffer_head *new_bh, *old_bh;
+	int ret;
+	struct ezfs_handle handle;
+	struct inode *inode = d_inode(old_dentry);
+	struct inode *target = d_inode(new_dentry);
 
 	debug("[%s] old_dentry=%s new_dentry=%s\n", __func__,
 			old_dentry->d_name.name, new_dentry->d_name.name);
@@ -587,118 +3965,336 @@ int ezfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			EZFS_MAX_FILENAME_LENGTH)
 		return -ENAMETOOLONG;
 
-	/* Find an empty ezfs dentry */
-	new_bh = sb_bread(new_dir->i_sb, get_ezfs_inode(new_dir)->data_block_number);
-	if (!new_bh)
-		return -EIO;
-
-	ezfs_dentry = (struct ezfs_dir_entry *) new_bh->b_data;
-	for (i = 0; i < EZFS_MAX_CHILDREN && ezfs_dentry->active; ++i, ++ezfs_dentry);
-	if (i >= EZFS_MAX_CHILDREN) {
-		brelse(new_bh);
-		return -ENOSPC;
+	if (target && S_ISDIR(target->i_mode)) {
+		ret = ezfs_dir_empty(target);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -ENOTEMPTY;
 	}
 
-	old_bh = sb_bread(new_dir->i_sb, get_ezfs_inode(old_dir)->data_block_number);
-	if (!old_bh) {
-		brelse(new_bh);
-		return -EIO;
+	/* Every block rename touches commits in one transaction, so a crash
+	 * never leaves the file under both names or neither.
+	 */
+	ezfs_journal_start(old_dir->i_sb, &handle, EZFS_HANDLE_CREDITS);
+
+	/* An existing target's entry is taken over in place, so the target
+	 * keeps its name until nothing else can fail.
+	 */
+	if (target)
+		ret = ezfs_dir_set(new_dir, &new_dentry->d_name, inode->i_ino,
+				inode->i_mode);
+	else
+		ret = ezfs_dir_add(new_dir, &new_dentry->d_name, inode->i_ino,
+				inode->i_mode);
+	if (ret)
+		goto out;
+
+	/* Deactivate the old ezfs_dentry */
+	ret = ezfs_dir_remove(old_dir, &old_dentry->d_name);
+	if (ret) {
+		if (target)
+			ezfs_dir_set(new_dir, &new_dentry->d_name,
+					target->i_ino, target->i_mode);
+		else
+			ezfs_dir_remove(new_dir, &new_dentry->d_name);
+		goto out;
 	}
 
-	if (d_really_is_positive(new_dentry)) {
-		if (d_is_dir(old_dentry)) {
-			if ((ret = ezfs_rmdir(new_dir, new_dentry))) {
-				brelse(new_bh);
-				brelse(old_bh);
-				return ret;
-			}
+	if (target) {
+		target->i_ctime = current_time(target);
+		drop_nlink(target);
+		if (S_ISDIR(target->i_mode)) {
+			/* its . and the .. that counted in new_dir */
+			drop_nlink(target);
+			drop_nlink(new_dir);
 		}
-		else
-			ezfs_unlink(new_dir, new_dentry);
+		mark_inode_dirty(target);
 	}
 
-	if (d_is_dir(old_dentry)) {
+	if (S_ISDIR(inode->i_mode)) {
 		drop_nlink(old_dir);
 		inc_nlink(new_dir);
 	}
 
-	/* Populate the new ezfs_dentry found above */
-	ezfs_dentry->inode_no = d_inode(old_dentry)->i_ino;
-	ezfs_dentry->active = 1;
-	strncpy(ezfs_dentry->filename, new_dentry->d_name.name, EZFS_MAX_FILENAME_LENGTH);
-	mark_buffer_dirty(new_bh);
-	brelse(new_bh);
-
-	/* Deactivate the old ezfs_dentry */
-	ezfs_unlink_dentry(old_bh, old_dentry);
-
 	old_dir->i_ctime = old_dir->i_mtime = new_dir->i_ctime =
-	new_dir->i_mtime = d_inode(old_dentry)->i_ctime = current_time(old_dir);
+	new_dir->i_mtime = inode->i_ctime = current_time(old_dir);
 
 	mark_inode_dirty(old_dir);
 	mark_inode_dirty(new_dir);
-	mark_inode_dirty(d_inode(old_dentry));
-
-	return 0;
+	mark_inode_dirty(inode);
+out:
+	ezfs_journal_stop(&handle);
+	return ret;
 }
 
 /* ezfs_sb_ops */
-void ezfs_evict_inode(struct inode *inode)
+static struct kmem_cache *ezfs_inode_cachep;
+
+/* Runs once per object when its slab is set up, not on every allocation. */
+static void ezfs_inode_init_once(void *obj)
 {
-	int i;
-	struct buffer_head *sb_bh = get_ezfs_sb_bh(inode->i_sb);
-	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(inode->i_sb);
-	struct ezfs_inode *ezfs_inode = get_ezfs_inode(inode);
+	struct ezfs_inode_info *ei = obj;
 
-	debug("[%s] ino=%ld\n", __func__, inode->i_ino);
+	init_rwsem(&ei->i_map_sem);
+	inode_init_once(&ei->vfs_inode);
+}
 
-	mutex_lock(ezfs_sb->ezfs_lock);
-	if (!inode->i_nlink) {
-		int data_blk_num = ezfs_inode->data_block_number;
+struct inode *ezfs_alloc_inode(struct super_block *sb)
+{
+	struct ezfs_inode_info *ei;
+
+	ei = kmem_cache_alloc(ezfs_inode_cachep, GFP_KERNEL);
+	if (!ei)
+		return NULL;
+	memset(&ei->raw, 0, sizeof(ei->raw));
+	ei->i_da_start = ei->i_da_len = 0;
+	return &ei->vfs_inode;
+}
 
-		debug("[%s] CLEARBIT i_ino=%ld, d_num=[%d-%d]\n", __func__, inode->i_ino,
-			data_blk_num, data_blk_num + (int) inode->i_blocks / 8 - 1);
-		CLEARBIT(ezfs_sb->free_inodes, inode->i_ino - EZFS_ROOT_INODE_NUMBER);
-		for (i = 0; i < inode->i_blocks / 8; i++) {
-			CLEARBIT(ezfs_sb->free_data_blocks, data_blk_num -
-					EZFS_ROOT_DATABLOCK_NUMBER + i);
-		}
-		mark_buffer_dirty(sb_bh);
-	}
+void ezfs_free_inode(struct inode *inode)
+{
+	kmem_cache_free(ezfs_inode_cachep, get_ezfs_inode_info(inode));
+}
+
+static int ezfs_update_inode(struct inode *inode, bool sync);
+
+void ezfs_evict_inode(struct inode *inode)
+{
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	struct ezfs_handle handle;
+	/* an inode whose iget failed was never read in, and a flat volume's
+	 * are never written
+	 */
+	bool live = !is_bad_inode(inode) && !ezfs_flat(inode->i_sb);
+
+	trace_ezfs_evict_inode(inode);
 
 	/* required to be called by VFS, if not called, evict() will BUG out */
 	truncate_inode_pages_final(&inode->i_data);
+
+	if (live) {
+		ezfs_journal_start(inode->i_sb, &handle, EZFS_TRUNCATE_CREDITS);
+		down_write(&ei->i_map_sem);
+		ezfs_da_trim(inode, 0);
+		up_write(&ei->i_map_sem);
+		/* Past clear_inode() nothing writes the inode back, and
+		 * without a journal marking it dirty does not either.
+		 */
+		if (inode->i_nlink && ezfs_trim_eof_blocks(inode) &&
+				!ezfs_journal(inode->i_sb))
+			ezfs_update_inode(inode, true);
+	}
+	if (!inode->i_nlink && live) {
+		ezfs_free_ino(inode->i_sb, inode->i_ino);
+		down_write(&ei->i_map_sem);
+		ezfs_truncate_blocks(inode, 0);
+		up_write(&ei->i_map_sem);
+	}
+	if (live)
+		ezfs_journal_stop(&handle);
 	clear_inode(inode);
-	mutex_unlock(ezfs_sb->ezfs_lock);
 }
 
-int ezfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+/* Copy the inode into its slot of the inode table. Only the table block that
+ * holds this inode is read and dirtied.
+ */
+static int ezfs_update_inode(struct inode *inode, bool sync)
 {
 	int ret = 0;
-	struct buffer_head *i_bh = get_ezfs_i_bh(inode->i_sb);
-
-	debug("[%s] ino=%ld\n", __func__, inode->i_ino);
+	struct ezfs_inode_info *ei = get_ezfs_inode_info(inode);
+	struct ezfs_inode *raw;
+	struct buffer_head *bh;
 
-	write_inode_helper(inode, get_ezfs_inode(inode));
-	mark_buffer_dirty(i_bh);
-	if (wbc->sync_mode == WB_SYNC_ALL) {
-		sync_dirty_buffer(i_bh);
-		if (buffer_req(i_bh) && !buffer_uptodate(i_bh)) {
-			return -EIO;
-		}
+	bh = ezfs_inode_bread(inode->i_sb, inode->i_ino, &raw);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	/* the block map may be changing under ezfs_map_blocks */
+	down_read(&ei->i_map_sem);
+	write_inode_helper(inode, &ei->raw);
+	memcpy(raw, &ei->raw, sizeof(*raw));
+	up_read(&ei->i_map_sem);
+
+	ezfs_journal_dirty(inode->i_sb, bh);
+	if (sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh))
+			ret = -EIO;
 	}
+	brelse(bh);
 
 	return ret;
 }
 
+/* With a journal, an inode is copied to the table as soon as it is dirtied,
+ * in the handle of the operation that dirtied it, so it commits together
+ * with the rest of that operation.
+ */
+void ezfs_dirty_inode(struct inode *inode, int flags)
+{
+	struct ezfs_handle handle;
+
+	if (!ezfs_journal(inode->i_sb) || flags == I_DIRTY_TIME)
+		return;
+
+	ezfs_journal_start(inode->i_sb, &handle, EZFS_HANDLE_CREDITS);
+	ezfs_update_inode(inode, false);
+	ezfs_journal_stop(&handle);
+}
+
+/* Journaled inodes are already in the table; a data integrity write only
+ * has to commit them. sync(2) commits from ezfs_sync_fs instead.
+ */
+int ezfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	if (!ezfs_journal(inode->i_sb))
+		return ezfs_update_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+	if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+		return 0;
+	return ezfs_journal_commit(inode->i_sb, false);
+}
+
+int ezfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct ezfs_journal *j = ezfs_journal(sb);
+
+	if (!j)
+		return 0;
+	if (!wait) {
+		mod_delayed_work(system_wq, &j->j_commit_work, 0);
+		return 0;
+	}
+	return ezfs_journal_commit(sb, false);
+}
+
+/* Leaves an empty log behind, so that the next mount replays nothing. */
+void ezfs_put_super(struct super_block *sb)
+{
+	struct ezfs_journal *j = ezfs_journal(sb);
+
+	if (!j)
+		return;
+	cancel_delayed_work_sync(&j->j_commit_work);
+	ezfs_journal_commit(sb, false);
+	down_write(&j->j_trans_sem);
+	if (!j->j_errno && ezfs_journal_used(j))
+		ezfs_journal_checkpoint(j);
+	up_write(&j->j_trans_sem);
+}
+
+/* Reports the free counts the bitmaps keep up to date on every allocation
+ * and free, so nothing is read here. Blocks promised to delayed writes are
+ * not free any more, and blocks freed in a transaction only are once it
+ * commits.
+ */
+int ezfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct ezfs_super_block *ezfs_sb = get_ezfs_sb(sb);
+	struct ezfs_sb_info *sbi = get_ezfs_sb_info(sb);
+	int64_t bfree;
+
+	bfree = atomic64_read(&sbi->data_map.nfree) -
+		atomic64_read(&sbi->reserved_blocks);
+
+	buf->f_type = EZFS_MAGIC_NUMBER;
+	buf->f_bsize = EZFS_BLOCK_SIZE;
+	buf->f_blocks = ezfs_sb->nr_data_blocks;
+	buf->f_bfree = max_t(int64_t, bfree, 0);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = ezfs_sb->nr_inodes;
+	buf->f_ffree = atomic64_read(&sbi->inode_map.nfree);
+	/* a flat volume has no free counts, and no room as it is read-only */
+	if (ezfs_flat(sb)) {
+		buf->f_blocks = EZFS_FLAT_MAX_DATA_BLKS;
+		buf->f_files = EZFS_FLAT_MAX_INODES;
+	}
+	buf->f_namelen = EZFS_MAX_FILENAME_LENGTH;
+	buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+	return 0;
+}
+
+/* ezfs sysfs */
+static struct kset *ezfs_kset;
+
+/* A file of /sys/fs/ezfs/<dev>/ showing one field of struct ezfs_stats */
+struct ezfs_stat_attr {
+	struct attribute attr;
+	size_t offset;
+};
+
+#define EZFS_STAT_ATTR(name)						\
+static struct ezfs_stat_attr ezfs_stat_attr_##name = {			\
+	.attr = { .name = #name, .mode = 0444 },			\
+	.offset = offsetof(struct ezfs_stats, name),			\
+}
+
+EZFS_STAT_ATTR(allocs);
+EZFS_STAT_ATTR(blocks_allocated);
+EZFS_STAT_ATTR(blocks_freed);
+EZFS_STAT_ATTR(lookups);
+EZFS_STAT_ATTR(lookup_probes);
+EZFS_STAT_ATTR(journal_commits);
+EZFS_STAT_ATTR(journal_blocks);
+EZFS_STAT_ATTR(lock_wait_ns);
+
+static struct attribute *ezfs_stat_attrs[] = {
+	&ezfs_stat_attr_allocs.attr,
+	&ezfs_stat_attr_blocks_allocated.attr,
+	&ezfs_stat_attr_blocks_freed.attr,
+	&ezfs_stat_attr_lookups.attr,
+	&ezfs_stat_attr_lookup_probes.attr,
+	&ezfs_stat_attr_journal_commits.attr,
+	&ezfs_stat_attr_journal_blocks.attr,
+	&ezfs_stat_attr_lock_wait_ns.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(ezfs_stat);
+
+static ssize_t ezfs_stat_show(struct kobject *kobj, struct attribute *attr,
+		char *buf)
+{
+	struct ezfs_sb_info *sbi = container_of(kobj, struct ezfs_sb_info,
+			s_kobj);
+	struct ezfs_stat_attr *a = container_of(attr, struct ezfs_stat_attr,
+			attr);
+	uint64_t sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(uint64_t *) ((char *) per_cpu_ptr(sbi->stats, cpu) +
+				a->offset);
+	return sprintf(buf, "%llu\n", sum);
+}
+
+static const struct sysfs_ops ezfs_stat_ops = {
+	.show = ezfs_stat_show,
+};
+
+static void ezfs_sb_release(struct kobject *kobj)
+{
+	struct ezfs_sb_info *sbi = container_of(kobj, struct ezfs_sb_info,
+			s_kobj);
+
+	complete(&sbi->s_kobj_unregister);
+}
+
+static struct kobj_type ezfs_sb_ktype = {
+	.default_groups = ezfs_stat_groups,
+	.sysfs_ops = &ezfs_stat_ops,
+	.release = ezfs_sb_release,
+};
+
 static int ezfs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
 	struct buffer_head *bh;
-	struct ezfs_sb_buffer_heads *ezfs_sb_bufs = sb->s_fs_info;
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
 	struct ezfs_super_block *ezfs_sb;
 	struct inode *inode;
+	int ret;
 
-	sb->s_maxbytes		= EZFS_BLOCK_SIZE * EZFS_MAX_DATA_BLKS;
+	sb->s_maxbytes		= (loff_t) EZFS_BLOCK_SIZE * U32_MAX;
 	sb->s_magic			= EZFS_MAGIC_NUMBER;
 	sb->s_op			= &ezfs_sb_ops;
 	sb->s_time_gran		= 1;
@@ -706,25 +4302,78 @@ static int ezfs_fill_super(struct super_block *sb, struct fs_context *fc)
 	sb->s_time_max		= U32_MAX;
 
 	/* if ezfs_fill_super fails, ezfs_free_fc will free allocated resources */
+	sbi->stats = alloc_percpu(struct ezfs_stats);
+	if (!sbi->stats)
+		return -ENOMEM;
 	if (!sb_set_blocksize(sb, EZFS_BLOCK_SIZE))
 		return -EIO;
 	bh = sb_bread(sb, EZFS_SUPERBLOCK_DATABLOCK_NUMBER);
 	if (!bh)
 		return -EIO;
-	ezfs_sb_bufs->sb_bh = bh;
+	sbi->sb_bh = bh;
 
 	ezfs_sb = get_ezfs_sb(sb);
-	ezfs_sb->ezfs_lock = kzalloc(sizeof(struct mutex), GFP_KERNEL);
-	if (!ezfs_sb->ezfs_lock)
-		return -ENOMEM;
-	mutex_init(ezfs_sb->ezfs_lock);
 	if (ezfs_sb->magic != EZFS_MAGIC_NUMBER)
 		return -EIO;
+	/* Nothing here writes the flat format, so it is only read */
+	if (ezfs_flat(sb)) {
+		if (!sb_rdonly(sb))
+			pr_warn("ezfs: %s is in the flat format of version 1, mounting read-only\n",
+				sb->s_id);
+		sb->s_flags |= SB_RDONLY;
+		goto root;
+	}
+	if (ezfs_sb->version != EZFS_VERSION) {
+		pr_err("ezfs: format version %llu, this driver reads versions %d and %d\n",
+			(unsigned long long) ezfs_sb->version,
+			EZFS_VERSION_FLAT, EZFS_VERSION);
+		return -EINVAL;
+	}
+	if (!ezfs_sb->nr_inodes || ezfs_sb->inode_table_blocks <
+			DIV_ROUND_UP(ezfs_sb->nr_inodes, EZFS_INODES_PER_BLOCK) ||
+			ezfs_sb->inode_bitmap_blocks <
+			DIV_ROUND_UP(ezfs_sb->nr_inodes, EZFS_BITS_PER_BLOCK) ||
+			ezfs_sb->data_bitmap_blocks <
+			DIV_ROUND_UP(ezfs_sb->nr_data_blocks, EZFS_BITS_PER_BLOCK) ||
+			ezfs_sb->data_start + ezfs_sb->nr_data_blocks > ezfs_sb->nr_blocks)
+		return -EINVAL;
+	if (ezfs_sb->journal_blocks && (ezfs_sb->journal_blocks <
+			EZFS_JOURNAL_MIN_BLOCKS || ezfs_sb->journal_start <
+			ezfs_sb->inode_table_start + ezfs_sb->inode_table_blocks ||
+			ezfs_sb->journal_start + ezfs_sb->journal_blocks >
+			ezfs_sb->data_start))
+		return -EINVAL;
 
-	bh = sb_bread(sb, EZFS_INODE_STORE_DATABLOCK_NUMBER);
-	if (!bh)
-		return -EIO;
-	ezfs_sb_bufs->i_store_bh = bh;
+	/* Replay comes first: it may rewrite the bitmaps read below */
+	if (ezfs_sb->journal_blocks) {
+		ret = ezfs_journal_load(sb);
+		if (ret)
+			return ret;
+	}
+
+	ret = ezfs_bitmap_init(sb, &sbi->inode_map,
+			ezfs_sb->inode_bitmap_start, ezfs_sb->nr_inodes, false);
+	if (ret)
+		return ret;
+	ret = ezfs_bitmap_init(sb, &sbi->data_map,
+			ezfs_sb->data_bitmap_start, ezfs_sb->nr_data_blocks,
+			true);
+	if (ret)
+		return ret;
+
+	debug("[%s] %llu inodes (%llu free), %llu data blocks (%llu free) starting at %llu, %llu journal blocks\n",
+		__func__, ezfs_sb->nr_inodes,
+		atomic64_read(&sbi->inode_map.nfree), ezfs_sb->nr_data_blocks,
+		atomic64_read(&sbi->data_map.nfree),
+		ezfs_sb->data_start, ezfs_sb->journal_blocks);
+
+root:
+	init_completion(&sbi->s_kobj_unregister);
+	sbi->s_kobj.kset = ezfs_kset;
+	ret = kobject_init_and_add(&sbi->s_kobj, &ezfs_sb_ktype, NULL, "%s",
+			sb->s_id);
+	if (ret)
+		return ret;
 
 	inode = ezfs_iget(sb, EZFS_ROOT_INODE_NUMBER);
 	if (IS_ERR(inode))
@@ -737,25 +4386,29 @@ static int ezfs_fill_super(struct super_block *sb, struct fs_context *fc)
 	return 0;
 }
 
+/* Frees an ezfs_sb_info, however far ezfs_fill_super got with it. */
+static void ezfs_put_sb_info(struct ezfs_sb_info *sbi)
+{
+	/* the last put removes the sysfs directory, once no one reads it */
+	if (sbi->s_kobj.state_initialized) {
+		kobject_put(&sbi->s_kobj);
+		wait_for_completion(&sbi->s_kobj_unregister);
+	}
+	ezfs_journal_destroy(sbi->journal);
+	ezfs_bitmap_destroy(&sbi->inode_map);
+	ezfs_bitmap_destroy(&sbi->data_map);
+	brelse(sbi->sb_bh);
+	free_percpu(sbi->stats);
+	kfree(sbi);
+}
+
 static void ezfs_free_fc(struct fs_context *fc)
 {
-	struct ezfs_sb_buffer_heads *ezfs_sb_bufs = fc->s_fs_info;
-	struct ezfs_super_block *ezfs_sb;
+	struct ezfs_sb_info *sbi = fc->s_fs_info;
 
-	debug("[%s] %p\n", __func__, ezfs_sb_bufs);
-	if (ezfs_sb_bufs) {
-		if (ezfs_sb_bufs->i_store_bh)
-			brelse(ezfs_sb_bufs->i_store_bh);
-		if (ezfs_sb_bufs->sb_bh) {
-			ezfs_sb = (struct ezfs_super_block *) ezfs_sb_bufs->sb_bh->b_data;
-			if (ezfs_sb->ezfs_lock) {
-				mutex_destroy(ezfs_sb->ezfs_lock);
-				kfree(ezfs_sb->ezfs_lock);
-			}
-			brelse(ezfs_sb_bufs->sb_bh);
-		}
-		kfree(ezfs_sb_bufs);
-	}
+	debug("[%s] %p\n", __func__, sbi);
+	if (sbi)
+		ezfs_put_sb_info(sbi);
 }
 
 static int ezfs_get_tree(struct fs_context *fc)
@@ -765,42 +4418,51 @@ static int ezfs_get_tree(struct fs_context *fc)
 	if (ret)
 		debug("Failed to mount myezfs. Error:[%d]", ret);
 	else
-		debug("Successfully mount myezfs, EZFS_MAX_INODES %lu\n",
-			   EZFS_MAX_INODES);
+		debug("Successfully mount myezfs\n");
 
 	return ret;
 }
 
+/* A volume whose journal aborted stays read-only until it is mounted
+ * again, and replayed. A flat volume is never written.
+ */
+static int ezfs_reconfigure(struct fs_context *fc)
+{
+	struct super_block *sb = fc->root->d_sb;
+	struct ezfs_journal *j = ezfs_journal(sb);
+
+	if (fc->sb_flags & SB_RDONLY)
+		return 0;
+	if (ezfs_flat(sb) || (j && READ_ONCE(j->j_errno)))
+		return -EROFS;
+	return 0;
+}
+
 static const struct fs_context_operations ezfs_context_ops = {
 	.free		= ezfs_free_fc,
 	.get_tree	= ezfs_get_tree,
+	.reconfigure	= ezfs_reconfigure,
 };
 
 int ezfs_init_fs_context(struct fs_context *fc)
 {
-	struct ezfs_sb_buffer_heads *ezfs_sb_bufs;
+	struct ezfs_sb_info *sbi;
 
 	debug("[%s]\n", __func__);
-	ezfs_sb_bufs = kzalloc(sizeof(*ezfs_sb_bufs), GFP_KERNEL);
-	if (!ezfs_sb_bufs)
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi)
 		return -ENOMEM;
-	fc->s_fs_info = ezfs_sb_bufs;
+	fc->s_fs_info = sbi;
 	fc->ops = &ezfs_context_ops;
 	return 0;
 }
 
 static void ezfs_kill_superblock(struct super_block *sb)
 {
-	struct ezfs_sb_buffer_heads *ezfs_sb_bufs = sb->s_fs_info;
-	struct ezfs_super_block *ezfs_sb = (struct ezfs_super_block *)
-										ezfs_sb_bufs->sb_bh->b_data;
+	struct ezfs_sb_info *sbi = sb->s_fs_info;
 
 	kill_block_super(sb);
-	brelse(ezfs_sb_bufs->i_store_bh);
-	mutex_destroy(ezfs_sb->ezfs_lock);
-	kfree(ezfs_sb->ezfs_lock);
-	brelse(ezfs_sb_bufs->sb_bh);
-	kfree(ezfs_sb_bufs);
+	ezfs_put_sb_info(sbi);
 	debug("ezfs superblock destroyed. Unmount successful.\n");
 }
 
@@ -815,11 +4477,39 @@ static int ezfs_init(void)
 {
 	int ret;
 
+	BUILD_BUG_ON(sizeof(struct ezfs_inode) > EZFS_INODE_SIZE);
+	BUILD_BUG_ON(sizeof(struct ezfs_dir_index) > EZFS_BLOCK_SIZE);
+	BUILD_BUG_ON(offsetof(struct ezfs_inode_info, raw) % EZFS_INODE_SIZE);
+
+	ezfs_inode_cachep = kmem_cache_create("ezfs_inode_cache",
+			sizeof(struct ezfs_inode_info), EZFS_INODE_SIZE,
+			SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+			ezfs_inode_init_once);
+	if (!ezfs_inode_cachep)
+		return -ENOMEM;
+
+	ezfs_free_extent_cachep = KMEM_CACHE(ezfs_free_extent, 0);
+	if (!ezfs_free_extent_cachep) {
+		kmem_cache_destroy(ezfs_inode_cachep);
+		return -ENOMEM;
+	}
+
+	ezfs_kset = kset_create_and_add("ezfs", NULL, fs_kobj);
+	if (!ezfs_kset) {
+		kmem_cache_destroy(ezfs_free_extent_cachep);
+		kmem_cache_destroy(ezfs_inode_cachep);
+		return -ENOMEM;
+	}
+
 	ret = register_filesystem(&ezfs_fs_type);
-	if (likely(ret == 0))
+	if (likely(ret == 0)) {
 		debug("Successfully registered ezfs\n");
-	else
+	} else {
 		debug("Failed to register ezfs. Error:[%d]", ret);
+		kset_unregister(ezfs_kset);
+		kmem_cache_destroy(ezfs_free_extent_cachep);
+		kmem_cache_destroy(ezfs_inode_cachep);
+	}
 
 	return ret;
 }
@@ -829,6 +4519,11 @@ static void ezfs_exit(void)
 	int ret;
 
 	ret = unregister_filesystem(&ezfs_fs_type);
+	kset_unregister(ezfs_kset);
+	kmem_cache_destroy(ezfs_free_extent_cachep);
+	/* inodes are freed after an RCU grace period */
+	rcu_barrier();
+	kmem_cache_destroy(ezfs_inode_cachep);
 
 	if (likely(ret == 0))
 		debug("Successfully unregistered ezfs\n");
@@ -1,13 +1,43 @@
 #ifndef __EZFS_H__
 #define __EZFS_H__
 
+/* An extent maps a run of logical file blocks onto a run of physically
+ * contiguous device blocks. A file's block map is a list of extents sorted by
+ * ee_block, so a file can grow by claiming any free block without having to
+ * move the data it already has.
+ */
+struct ezfs_extent {
+	uint32_t ee_block; /* First logical block covered by this extent */
+	uint32_t ee_len; /* Number of blocks in the extent */
+	uint64_t ee_start; /* Device block backing ee_block */
+};
+
+/* The first few extents live in the inode itself. Once those are used up, the
+ * rest of the list spills into a single overflow block of extents.
+ */
+#define EZFS_INLINE_EXTENTS 4
+#define EZFS_EXTENTS_PER_BLOCK (EZFS_BLOCK_SIZE / sizeof(struct ezfs_extent))
+#define EZFS_MAX_EXTENTS (EZFS_INLINE_EXTENTS + EZFS_EXTENTS_PER_BLOCK)
+
+/* Inode flags */
+/* 0x1 marked directories of fixed-size, hash-placed slots; unused now */
+#define EZFS_INDEXED_DIR_FL 0x2 /* block 0 is an ezfs_dir_index over leaves */
+#define EZFS_PREALLOC_FL 0x4 /* keep blocks fallocated past EOF */
+#define EZFS_INLINE_DATA_FL 0x8 /* i_data holds the file, there is no block map */
+
+/* A regular file of at most this many bytes can keep its data in the inode
+ * slot, in the space the block map would otherwise use. The size fills
+ * struct ezfs_inode out to EZFS_INODE_SIZE.
+ */
+#define EZFS_INLINE_DATA_SIZE 152
+
 /* An inode contains metadata about the file it represents. This includes
  * permissions, access times, size, etc. All the stuff you can see with the ls
  * command is taken right from the inode.
  *
- * Note that the inode does not contain the file data itself. But it must
- * contain information to find the file data. In our case, we store the block
- * number where the data is.
+ * Usually the inode does not contain the file data itself. But it must
+ * contain information to find the file data. In our case, we store the list
+ * of extents that make up the file.
  */
 struct ezfs_inode {
 	/* What kind of file this is (i.e. directory, plain old file, etc). */
@@ -21,40 +51,111 @@ struct ezfs_inode {
 	struct timespec64 i_ctime; /* Change time */
 	unsigned int nlink;
 
-	/* The device block where the data starts for this file. */
-	uint64_t data_block_number;
-
 	/* A file can be a directory or a plain file. In the latter case
-	 * we store the file size. Each directory's size is 4096.
+	 * we store the file size. A directory's size is 4096 times the
+	 * number of blocks it spans.
 	 */
 	uint64_t file_size;
 
 	uint64_t nblocks; /* number of blocks */
+
+	/* Block map. extents[] holds the first EZFS_INLINE_EXTENTS entries,
+	 * extent_block (0 if unused) holds the rest. With EZFS_INLINE_DATA_FL
+	 * the file has no blocks at all and i_data holds its contents instead;
+	 * bytes past file_size are zero.
+	 */
+	uint32_t nr_extents;
+	uint32_t flags; /* EZFS_*_FL */
+	uint64_t extent_block;
+	union {
+		struct ezfs_extent extents[EZFS_INLINE_EXTENTS];
+		char i_data[EZFS_INLINE_DATA_SIZE];
+	};
 };
 
 /* Directories store a mapping from filename -> inode number. Each of these
  * mappings is a single "directory entry" and is represented by the struct
- * below.
+ * below, followed by its name.
+ *
+ * Entries vary in length. The records of a directory block tile it exactly:
+ * rec_len leads from one record to the next, and a record may be longer
+ * than its entry needs, the slack being room for new entries. A record with
+ * inode_no 0 holds no entry; only the first record of a block is ever left
+ * like that, since a removed entry's space goes to the record before it.
+ * Lookups scan the block, comparing the stored hash and name_len before the
+ * name itself.
  */
-#define EZFS_FILENAME_BUF_SIZE (128 - 8 - 1)
-#define EZFS_MAX_FILENAME_LENGTH (EZFS_FILENAME_BUF_SIZE - 1)
+#define EZFS_MAX_FILENAME_LENGTH 255
 struct ezfs_dir_entry {
-	uint64_t inode_no;
-	uint8_t active; /* 0 or 1 */
-	char filename[EZFS_FILENAME_BUF_SIZE];
+	uint64_t inode_no; /* 0 if the record holds no entry */
+	uint32_t name_hash; /* ezfs_name_hash(name) */
+	uint16_t rec_len; /* Bytes to the next record */
+	uint8_t name_len;
+	uint8_t file_type; /* EZFS_FT(mode) of the inode, or 0 if not known */
+	char name[]; /* Not NUL-terminated */
 };
 
-/* Macros to set, test, and clear a bit array of integers. */
-#define SETBIT(A, k)     (A[((k) / 32)] |=  (1 << ((k) % 32)))
-#define CLEARBIT(A, k)   (A[((k) / 32)] &= ~(1 << ((k) % 32)))
-#define IS_SET(A, k)     (A[((k) / 32)] &   (1 << ((k) % 32)))
+/* The file type kept in an entry is the S_IFMT part of the inode's mode,
+ * shifted down, which makes it the DT_ value readdir reports.
+ */
+#define EZFS_FT(mode) (((mode) & S_IFMT) >> 12)
+
+/* Records start at multiples of EZFS_DIR_ALIGN bytes */
+#define EZFS_DIR_ALIGN 8
+#define EZFS_DIR_REC_LEN(name_len) \
+	((sizeof(struct ezfs_dir_entry) + (name_len) + EZFS_DIR_ALIGN - 1) & \
+	 ~(EZFS_DIR_ALIGN - 1))
+
+/* A directory that outgrows its first block becomes an extendible hash table
+ * (EZFS_INDEXED_DIR_FL). Logical block 0 then holds the index below: the top
+ * depth bits of a name's hash select a slot, and the slot names the leaf
+ * block the entry lives in. Every leaf is laid out like the only block of a
+ * small directory. A full leaf splits in two on the next hash bit, doubling the
+ * index first if the leaf already uses all depth bits.
+ */
+#define EZFS_DIR_MAX_DEPTH 10
+#define EZFS_DIR_INDEX_SLOTS (1 << EZFS_DIR_MAX_DEPTH)
+struct ezfs_dir_index {
+	uint32_t depth; /* Hash bits used to pick a slot */
+	uint16_t leaf[EZFS_DIR_INDEX_SLOTS]; /* Logical block of each leaf */
+	uint8_t leaf_depth[EZFS_DIR_INDEX_SLOTS]; /* Hash bits the leaf covers */
+};
+
+/* 32-bit FNV-1a. The hash is part of the on-disk format, so the kernel and
+ * the formatter must compute it the same way.
+ */
+static inline uint32_t ezfs_name_hash(const char *name, unsigned int len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-/* This macro will declare a bit vector. I use it to declare an array of the
- * right size inside the ezfs_sb.
+/* EZFS_IOC_DEFRAG moves the blocks of the regular file it is called on so
+ * that its short extents join up, and reports what it did here.
  */
-#define DECLARE_BIT_VECTOR(name, size) uint32_t name[(size / 32) + 1];
+struct ezfs_defrag_info {
+	uint32_t extents_before;
+	uint32_t extents_after;
+	uint64_t blocks_moved;
+};
+
+#define EZFS_IOC_DEFRAG _IOR('E', 1, struct ezfs_defrag_info)
+
+/* Macros to set, test, and clear a bit array of integers. */
+#define SETBIT(A, k)     (A[((k) / 32)] |=  (1U << ((k) % 32)))
+#define CLEARBIT(A, k)   (A[((k) / 32)] &= ~(1U << ((k) % 32)))
+#define IS_SET(A, k)     (A[((k) / 32)] &   (1U << ((k) % 32)))
 
 #define EZFS_MAGIC_NUMBER  0x00004118
+/* On-disk format version, bumped whenever older code would misread a
+ * volume. Version 1 is the original flat format, see EZFS_VERSION_FLAT.
+ */
+#define EZFS_VERSION 2
 #define EZFS_BLOCK_SIZE 4096
 
 
@@ -66,25 +167,41 @@ struct ezfs_dir_entry {
 /*  Data block #  |  Contents
  * -------------------------------
  *	0         |  Superblock
- *	1         |  Inode Store
- *	2         |  Root Data Block
+ *	1 ...     |  Inode bitmap (inode_bitmap_blocks)
+ *	...       |  Data bitmap (data_bitmap_blocks)
+ *	...       |  Inode table (inode_table_blocks)
+ *	...       |  Metadata journal (journal_blocks, may be 0)
+ *	data_start|  Root Data Block, followed by the rest of the data blocks
+ *
+ * The size of every region is chosen by the formatter from the size of the
+ * device and recorded in the superblock.
  */
 #define EZFS_SUPERBLOCK_DATABLOCK_NUMBER 0
-#define EZFS_INODE_STORE_DATABLOCK_NUMBER 1
-#define EZFS_ROOT_DATABLOCK_NUMBER 2
 
-/* The inode store is one 4096 byte-block. The following macro calculates
- * how many ezfs_inodes we can shove in the inode store.
+/* Each bitmap block tracks this many inodes or data blocks. */
+#define EZFS_BITS_PER_BLOCK (EZFS_BLOCK_SIZE * 8)
+
+/* Inodes are stored in fixed-size slots so that the table layout does not
+ * change whenever struct ezfs_inode grows.
  */
-#define EZFS_MAX_INODES (EZFS_BLOCK_SIZE / sizeof(struct ezfs_inode)) /* 42 */
-#define EZFS_MAX_DATA_BLKS EZFS_MAX_INODES * 8
-#define EZFS_MAX_CHILDREN ((loff_t) (EZFS_BLOCK_SIZE / sizeof(struct ezfs_dir_entry)))
+#define EZFS_INODE_SIZE 256
+#define EZFS_INODES_PER_BLOCK (EZFS_BLOCK_SIZE / EZFS_INODE_SIZE)
+
 
 #define EZFS_SB_MEMBERS uint64_t version;\
 	uint64_t magic;\
-	DECLARE_BIT_VECTOR(free_inodes, EZFS_MAX_INODES);\
-	DECLARE_BIT_VECTOR(free_data_blocks, EZFS_MAX_DATA_BLKS);\
-	struct mutex *ezfs_lock;
+	uint64_t nr_blocks; /* size of the volume */\
+	uint64_t nr_inodes;\
+	uint64_t inode_bitmap_start;\
+	uint64_t inode_bitmap_blocks;\
+	uint64_t data_bitmap_start;\
+	uint64_t data_bitmap_blocks;\
+	uint64_t inode_table_start;\
+	uint64_t inode_table_blocks;\
+	uint64_t data_start; /* device block of data bitmap bit 0 */\
+	uint64_t nr_data_blocks;\
+	uint64_t journal_start;\
+	uint64_t journal_blocks; /* 0 if the volume has no journal */
 
 /* This is the superblock, as it will be serialized onto the disk. */
 struct ezfs_super_block {
@@ -94,12 +211,249 @@ struct ezfs_super_block {
 	char __padding__[EZFS_BLOCK_SIZE - sizeof(struct {EZFS_SB_MEMBERS})];
 };
 
-/* In the VFS superblock, we need to have a pointer to the buffer_heads for the
- * inode store and superblock so that we can mark them as dirty when they're
- * modified inode.
+/* Volumes of the original flat format (version 1) still mount, read-only.
+ * There, block 1 holds every inode, each file is one run of blocks from
+ * data_block_number (-1 if it has none), and a directory is one block of
+ * fixed-size entries. Only the superblock's version and magic match the
+ * current layout.
+ */
+#define EZFS_VERSION_FLAT 1
+#define EZFS_FLAT_INODE_STORE 1
+#define EZFS_FLAT_DATA_START 2
+
+struct ezfs_flat_inode {
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec64 i_atime;
+	struct timespec64 i_mtime;
+	struct timespec64 i_ctime;
+	unsigned int nlink;
+	uint64_t data_block_number;
+	uint64_t file_size;
+	uint64_t nblocks;
+};
+
+#define EZFS_FLAT_MAX_INODES (EZFS_BLOCK_SIZE / sizeof(struct ezfs_flat_inode))
+#define EZFS_FLAT_MAX_DATA_BLKS (EZFS_FLAT_MAX_INODES * 8)
+
+#define EZFS_FLAT_FILENAME_BUF_SIZE (128 - 8 - 1)
+struct ezfs_flat_dir_entry {
+	uint64_t inode_no;
+	uint8_t active; /* 0 or 1 */
+	char filename[EZFS_FLAT_FILENAME_BUF_SIZE]; /* NUL-terminated */
+};
+
+#define EZFS_FLAT_DIR_ENTRIES (EZFS_BLOCK_SIZE / sizeof(struct ezfs_flat_dir_entry))
+
+/* The metadata journal is a circular log in the blocks
+ * [journal_start, journal_start + journal_blocks). Its first block holds
+ * struct ezfs_journal_super, which names the oldest transaction that may
+ * still have to be replayed and the log block it starts at. A transaction
+ * is one or more descriptor blocks, each followed by a copy of every block
+ * its tags name, then a commit block. The commit checksum is
+ * crc32_le(~0, ...) chained over every descriptor and copy, in log order.
+ * At mount, each complete transaction is copied to its home locations.
  */
-struct ezfs_sb_buffer_heads {
+#define EZFS_JOURNAL_MAGIC 0x455a4a4c
+
+/* Log blocks an operation reserves when it opens a handle: the inodes and
+ * directory blocks of a rename into an indexed directory that splits, and
+ * the bitmap and extent blocks of an allocation.
+ */
+#define EZFS_HANDLE_CREDITS 24
+/* Freeing a block map touches up to two bitmap blocks per extent */
+#define EZFS_TRUNCATE_CREDITS (EZFS_HANDLE_CREDITS + 2 * EZFS_MAX_EXTENTS)
+/* A transaction may fill a bit less than half of the log, and the largest
+ * reservation plus a commit block must fit in an empty one.
+ */
+#define EZFS_JOURNAL_MIN_BLOCKS (2 * (EZFS_TRUNCATE_CREDITS + 2) + 1)
+
+/* ezfs_journal_header.type */
+#define EZFS_JOURNAL_SUPER 1
+#define EZFS_JOURNAL_DESC 2
+#define EZFS_JOURNAL_COMMIT 3
+
+struct ezfs_journal_header {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t sequence; /* Transaction the block belongs to */
+};
+
+struct ezfs_journal_super {
+	struct ezfs_journal_header h; /* h.sequence: first one to replay */
+	uint64_t start; /* Log block that transaction starts at */
+	uint64_t nr_blocks; /* Size of the journal, this block included */
+};
+
+/* A revoke tag has no copy after it. It voids the copies of its block in
+ * this and every earlier transaction, so that replay never writes stale
+ * metadata over a block that was freed and reused.
+ */
+#define EZFS_JTAG_REVOKE 0x1
+
+struct ezfs_journal_tag {
+	uint64_t blocknr; /* Home location */
+	uint32_t flags; /* EZFS_JTAG_* */
+	uint32_t __pad;
+};
+
+struct ezfs_journal_desc {
+	struct ezfs_journal_header h;
+	uint32_t nr_tags;
+	uint32_t __pad;
+	struct ezfs_journal_tag tags[];
+};
+
+#define EZFS_JOURNAL_TAGS ((EZFS_BLOCK_SIZE - sizeof(struct ezfs_journal_desc)) / \
+		sizeof(struct ezfs_journal_tag))
+
+struct ezfs_journal_commit {
+	struct ezfs_journal_header h;
+	uint32_t checksum;
+	uint32_t __pad;
+};
+
+#ifdef __KERNEL__
+/* One allocation group: the bits held by a single bitmap block. */
+struct ezfs_group {
+	struct mutex lock; /* Serializes changes to the bitmap block */
+	unsigned int nfree;
+};
+
+/* A run of clear bits, kept in an ezfs_bitmap's free tree. */
+struct ezfs_free_extent {
+	struct rb_node node;
+	uint64_t start;
+	uint64_t len;
+	uint64_t subtree_max; /* Longest len in the subtree rooted here */
+};
+
+/* In-memory allocator state for one on-disk bitmap, set up at mount. */
+struct ezfs_bitmap {
+	uint64_t start; /* First bitmap block */
+	uint64_t nbits;
+	unsigned long ngroups;
+	struct ezfs_group *groups;
+	atomic64_t nfree; /* Clear bits left in all groups */
+	unsigned long cursor; /* Next-fit hint, read and set without locking */
+
+	/* The data bitmap also keeps its clear bits as free extents sorted
+	 * by start, so that a run of any length is found without scanning
+	 * the bitmap. The tree is the authority on what is free; bitmap
+	 * blocks follow it, except that a run freed by a journal transaction
+	 * is clear in its bitmap block before it is back in the tree.
+	 */
+	bool has_tree;
+	struct mutex tree_lock; /* Protects free_tree; nests in group locks */
+	struct rb_root free_tree;
+};
+
+/* Per-CPU event counters of one mount, summed into the files of
+ * /sys/fs/ezfs/<dev>/.
+ */
+struct ezfs_stats {
+	uint64_t allocs; /* Runs of data blocks placed */
+	uint64_t blocks_allocated;
+	uint64_t blocks_freed;
+	uint64_t lookups;
+	uint64_t lookup_probes; /* Directory records looked at by name */
+	uint64_t journal_commits;
+	uint64_t journal_blocks; /* Log blocks written */
+	uint64_t lock_wait_ns; /* Waiting for contended fs locks */
+};
+
+/* In-memory superblock, hung off the VFS superblock's s_fs_info. We keep
+ * the buffer_head of the on-disk superblock so that we can mark it as dirty
+ * when it's modified. Inode table and bitmap blocks are read on demand.
+ */
+struct ezfs_sb_info {
 	struct buffer_head *sb_bh;
-	struct buffer_head *i_store_bh;
+	struct ezfs_bitmap inode_map;
+	struct ezfs_bitmap data_map;
+	atomic64_t reserved_blocks; /* Promised to delayed-allocation writes */
+	struct ezfs_journal *journal; /* NULL if the volume has none */
+	struct ezfs_stats __percpu *stats;
+	struct kobject s_kobj; /* /sys/fs/ezfs/<dev> */
+	struct completion s_kobj_unregister;
+};
+
+/* A run of bits a transaction freed */
+struct ezfs_journal_free {
+	struct ezfs_bitmap *bm;
+	uint64_t start;
+	uint64_t len;
+};
+
+/* In-memory journal. Operations that change metadata run inside handles,
+ * which hold j_trans_sem shared; a commit holds it exclusively, so it
+ * always writes whole operations. Changed buffers wait in j_bhs, pinned
+ * and not dirty, until their copies in the log are durable, and then on
+ * the checkpoint list until they are written home.
+ */
+struct ezfs_journal {
+	struct super_block *j_sb;
+	uint64_t j_first; /* Device block of the journal super */
+	uint64_t j_blocks; /* Journal size; the log is blocks 1 to j_blocks - 1 */
+	struct buffer_head *j_sb_bh;
+	uint64_t j_tail; /* Log block of the oldest live transaction */
+	uint64_t j_head; /* Log block the next transaction starts at */
+	uint64_t j_sequence; /* Sequence of the running transaction */
+	unsigned int j_max_txn; /* Log blocks one transaction may take */
+	int j_errno; /* Set once the journal aborted; nothing is written after */
+	struct rw_semaphore j_trans_sem;
+
+	struct mutex j_list_lock; /* Protects the running transaction */
+	struct buffer_head **j_bhs; /* Room for j_max_txn */
+	unsigned int j_nr_bhs;
+	uint64_t *j_revoke;
+	unsigned int j_nr_revoke, j_max_revoke;
+	unsigned int j_reserved; /* Log blocks the open handles may still take */
+	/* Runs freed by the running transaction, kept out of the free trees
+	 * until it has committed
+	 */
+	struct ezfs_journal_free *j_frees;
+	unsigned int j_nr_frees, j_max_frees;
+
+	/* Committed buffers not written home yet, pinned and clean until the
+	 * next checkpoint. Only the commit path touches these.
+	 */
+	struct buffer_head **j_cp_bhs;
+	unsigned int j_nr_cp;
+
+	struct buffer_head **j_log_bhs; /* Log blocks of the commit in flight */
+	struct delayed_work j_commit_work;
+};
+
+/* An open handle, on the stack of the operation that opened it. */
+struct ezfs_handle {
+	struct ezfs_journal *h_journal; /* NULL without a journal */
+	bool h_nested; /* Inside another handle, which holds the lock */
+	unsigned int h_credits; /* Log blocks reserved in the transaction */
+	unsigned int h_nofs;
+};
+
+/* In-memory inode. It embeds the VFS inode, which get_ezfs_inode_info()
+ * maps back to it with container_of(). Directory entries are protected by
+ * the VFS inode lock, which is held exclusively around every
+ * ezfs_inode_ops call that changes them.
+ */
+struct ezfs_inode_info {
+	/* Copy of the on-disk inode. It comes first and the inode cache
+	 * aligns objects to EZFS_INODE_SIZE, so inline data never crosses
+	 * a page, as iomap requires.
+	 */
+	struct ezfs_inode raw;
+	struct rw_semaphore i_map_sem; /* Protects the block map in raw */
+
+	/* The inode's delayed blocks: written to the page cache, holding a
+	 * reservation, and placed as one run by writeback. Protected by
+	 * i_map_sem.
+	 */
+	uint32_t i_da_start;
+	uint32_t i_da_len;
+
+	struct inode vfs_inode;
 };
+#endif /* __KERNEL__ */
 #endif /* ifndef __EZFS_H__ */
@@ -0,0 +1,770 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Workloads for benchmarking ezfs. Each one has a prepare phase, which
+ * lays down whatever the measured phase needs, and a run phase, which
+ * times every operation and prints one JSON object with the throughput,
+ * latency percentiles and, with -c, how much each counter in
+ * /sys/fs/ezfs/<dev>/ moved. bench.sh remounts between the two phases, so
+ * that the run phase starts with cold caches.
+ */
+
+#define MAX_THREADS 64
+#define MAX_COUNTERS 32
+
+struct options {
+	const char *workload;
+	const char *dir;
+	const char *counters; /* sysfs directory of the mount, or NULL */
+	uint64_t size; /* File size for the data workloads */
+	size_t bs; /* I/O size */
+	uint64_t nr_ops;
+	unsigned int threads;
+	unsigned int fanout, depth, files; /* Tree of the readdir workload */
+	uint64_t seed;
+	int prepare, run;
+};
+
+/* Per-thread state of the run phase. */
+struct worker {
+	pthread_t tid;
+	unsigned int id;
+	uint64_t *lat; /* Latency of each op, in ns */
+	uint64_t nr;
+	uint64_t bytes;
+	uint64_t rand;
+	int fd;
+	char *buf;
+};
+
+struct workload {
+	const char *name;
+	void (*prepare)(void);
+	void (*op)(struct worker *w, uint64_t i);
+	void (*finish)(void); /* Timed, after the last op */
+	int open_flags; /* How workers open the data file, -1 if they don't */
+	int serial; /* Ops must run in order, on one thread */
+};
+
+struct counter {
+	char name[256];
+	uint64_t value;
+};
+
+static struct options o;
+static char *data_file;
+
+static void fail(const char *what, const char *path)
+{
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static char *path_of(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static char *path_of(const char *fmt, ...)
+{
+	char *path;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (vasprintf(&path, fmt, ap) < 0)
+		fail("Out of memory building", fmt);
+	va_end(ap);
+	return path;
+}
+
+static void *alloc_buf(size_t len)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, len))
+		fail("Out of memory for", "the I/O buffer");
+	memset(buf, 0x5a, len);
+	return buf;
+}
+
+/* Write o.size bytes to path in o.bs chunks, and push them out of the page
+ * cache so that a read of them goes to the device.
+ */
+static void write_file(const char *path, uint64_t size)
+{
+	char *buf = alloc_buf(o.bs);
+	uint64_t done;
+	size_t len;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		fail("Cannot create", path);
+	for (done = 0; done < size; done += len) {
+		len = size - done < o.bs ? size - done : o.bs;
+		if (write(fd, buf, len) != (ssize_t) len)
+			fail("Cannot write", path);
+	}
+	if (fsync(fd))
+		fail("Cannot sync", path);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	free(buf);
+}
+
+static void make_dir(const char *path)
+{
+	if (mkdir(path, 0755) && errno != EEXIST)
+		fail("Cannot create", path);
+}
+
+static void sync_dir(void)
+{
+	int fd = open(o.dir, O_RDONLY | O_DIRECTORY);
+
+	if (fd == -1 || syncfs(fd))
+		fail("Cannot sync", o.dir);
+	close(fd);
+}
+
+/* ezfs data workloads */
+static void prepare_data(void)
+{
+	write_file(data_file, o.size);
+}
+
+static void op_seqwrite(struct worker *w, uint64_t i)
+{
+	if (pwrite(w->fd, w->buf, o.bs, i * o.bs) != (ssize_t) o.bs)
+		fail("Cannot write", data_file);
+	w->bytes += o.bs;
+}
+
+static void op_seqread(struct worker *w, uint64_t i)
+{
+	ssize_t ret = pread(w->fd, w->buf, o.bs, i * o.bs);
+
+	if (ret < 0)
+		fail("Cannot read", data_file);
+	w->bytes += ret;
+}
+
+static void op_randwrite(struct worker *w, uint64_t i)
+{
+	uint64_t blk = xorshift(&w->rand) % (o.size / o.bs);
+
+	(void) i;
+	op_seqwrite(w, blk);
+}
+
+static void op_randread(struct worker *w, uint64_t i)
+{
+	uint64_t blk = xorshift(&w->rand) % (o.size / o.bs);
+
+	(void) i;
+	op_seqread(w, blk);
+}
+
+static void op_append(struct worker *w, uint64_t i)
+{
+	(void) i;
+
+	if (write(w->fd, w->buf, o.bs) != (ssize_t) o.bs)
+		fail("Cannot append to", data_file);
+	w->bytes += o.bs;
+}
+
+static void finish_data(void)
+{
+	int fd = open(data_file, O_RDONLY);
+
+	if (fd == -1 || fsync(fd))
+		fail("Cannot sync", data_file);
+	close(fd);
+}
+
+/* ezfs namespace workloads */
+static char *storm_file(uint64_t i)
+{
+	return path_of("%s/storm/f%llu", o.dir, (unsigned long long) i);
+}
+
+static void prepare_create(void)
+{
+	char *path = path_of("%s/storm", o.dir);
+
+	make_dir(path);
+	free(path);
+}
+
+static void op_create(struct worker *w, uint64_t i)
+{
+	char *path = storm_file(i);
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+	(void) w;
+	if (fd == -1)
+		fail("Cannot create", path);
+	close(fd);
+	free(path);
+}
+
+static void prepare_unlink(void)
+{
+	uint64_t i;
+	char *path;
+	int fd;
+
+	prepare_create();
+	for (i = 0; i < o.nr_ops; ++i) {
+		path = storm_file(i);
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd == -1)
+			fail("Cannot create", path);
+		close(fd);
+		free(path);
+	}
+	sync_dir();
+}
+
+static void op_unlink(struct worker *w, uint64_t i)
+{
+	char *path = storm_file(i);
+
+	(void) w;
+	if (unlink(path))
+		fail("Cannot unlink", path);
+	free(path);
+}
+
+/* Renames bounce o.files files between two directories, under a new name
+ * every time, so that each one removes an entry from one hash table and
+ * inserts it into another.
+ */
+static void prepare_rename(void)
+{
+	char *path;
+	uint64_t i;
+	int fd;
+
+	path = path_of("%s/ra", o.dir);
+	make_dir(path);
+	free(path);
+	path = path_of("%s/rb", o.dir);
+	make_dir(path);
+	free(path);
+
+	for (i = 0; i < o.files; ++i) {
+		path = path_of("%s/ra/r%llu.0", o.dir, (unsigned long long) i);
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd == -1)
+			fail("Cannot create", path);
+		close(fd);
+		free(path);
+	}
+	sync_dir();
+}
+
+static void op_rename(struct worker *w, uint64_t i)
+{
+	uint64_t file = i % o.files, gen = i / o.files;
+	char *from, *to;
+
+	(void) w;
+	from = path_of("%s/r%c/r%llu.%llu", o.dir, gen % 2 ? 'b' : 'a',
+		(unsigned long long) file, (unsigned long long) gen);
+	to = path_of("%s/r%c/r%llu.%llu", o.dir, gen % 2 ? 'a' : 'b',
+		(unsigned long long) file, (unsigned long long) gen + 1);
+	if (rename(from, to))
+		fail("Cannot rename", from);
+	free(from);
+	free(to);
+}
+
+/* The readdir tree is a complete o.fanout-ary tree of o.depth levels below
+ * the root, numbered breadth first, with o.files files in every directory.
+ * Directory n's path follows from its number alone.
+ */
+static uint64_t tree_dirs(void)
+{
+	uint64_t nr = 1, level = 1;
+	unsigned int i;
+
+	for (i = 0; i < o.depth; ++i) {
+		level *= o.fanout;
+		nr += level;
+	}
+	return nr;
+}
+
+static char *tree_dir(uint64_t n)
+{
+	char *parent, *path;
+
+	if (n == 0)
+		return path_of("%s/tree", o.dir);
+	parent = tree_dir((n - 1) / o.fanout);
+	path = path_of("%s/d%llu", parent,
+		(unsigned long long) (n - 1) % o.fanout);
+	free(parent);
+	return path;
+}
+
+static void prepare_readdir(void)
+{
+	uint64_t n, i, nr = tree_dirs();
+	char *dir, *path;
+	int fd;
+
+	for (n = 0; n < nr; ++n) {
+		dir = tree_dir(n);
+		make_dir(dir);
+		for (i = 0; i < o.files; ++i) {
+			path = path_of("%s/f%llu", dir, (unsigned long long) i);
+			fd = open(path, O_WRONLY | O_CREAT, 0644);
+			if (fd == -1)
+				fail("Cannot create", path);
+			close(fd);
+			free(path);
+		}
+		free(dir);
+	}
+	sync_dir();
+}
+
+/* One op lists a whole directory and stats every entry, like ls -l. */
+static void op_readdir(struct worker *w, uint64_t i)
+{
+	char *path = tree_dir(i % tree_dirs());
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	(void) w;
+	d = opendir(path);
+	if (!d)
+		fail("Cannot open", path);
+	while ((de = readdir(d)))
+		if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			fail("Cannot stat an entry of", path);
+	closedir(d);
+	free(path);
+}
+
+/* The churn workload lists a directory a few entries per getdents64 call
+ * and creates CHURN_BATCH entries between the calls, so the directory
+ * grows an index and splits leaves under the listing. Each of the o.files
+ * entries that were there before must be listed exactly once, and no entry
+ * twice; anything else fails the run. The new entries go again after.
+ */
+#define CHURN_BATCH 8
+
+static char *churn_file(char kind, uint64_t i)
+{
+	return path_of("%s/churn/%c%llu", o.dir, kind, (unsigned long long) i);
+}
+
+static void churn_touch(char kind, uint64_t i)
+{
+	char *path = churn_file(kind, i);
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+	if (fd == -1)
+		fail("Cannot create", path);
+	close(fd);
+	free(path);
+}
+
+static void prepare_churn(void)
+{
+	char *path = path_of("%s/churn", o.dir);
+	uint64_t i;
+
+	make_dir(path);
+	free(path);
+	for (i = 0; i < o.files; ++i)
+		churn_touch('c', i);
+	sync_dir();
+}
+
+/* Counts a listing of name, which fails the run if it is the second. */
+static void churn_seen(const char *name, unsigned int *old,
+		unsigned int *new, uint64_t nr_new)
+{
+	char *end;
+	uint64_t n = strtoull(name + 1, &end, 10);
+	unsigned int *seen = NULL;
+
+	if (*end == '\0' && name[0] == 'c' && n < o.files)
+		seen = &old[n];
+	else if (*end == '\0' && name[0] == 'n' && n < nr_new)
+		seen = &new[n];
+	if (seen && ++*seen > 1) {
+		fprintf(stderr, "%s/churn/%s listed twice\n", o.dir, name);
+		exit(1);
+	}
+}
+
+static void op_churn(struct worker *w, uint64_t i)
+{
+	uint64_t n, nr_new = 0, max_new = 4 * o.files;
+	unsigned int *old, *new;
+	struct dirent64 *de;
+	char *dir, buf[512];
+	ssize_t len, off;
+	int fd;
+
+	(void) w;
+	(void) i;
+	old = calloc(o.files, sizeof(*old));
+	new = calloc(max_new, sizeof(*new));
+	if (!old || !new)
+		fail("Out of memory for", "the churn listing");
+	dir = path_of("%s/churn", o.dir);
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		fail("Cannot open", dir);
+
+	while ((len = getdents64(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < len; off += de->d_reclen) {
+			de = (struct dirent64 *) (buf + off);
+			churn_seen(de->d_name, old, new, nr_new);
+		}
+		for (n = 0; n < CHURN_BATCH && nr_new < max_new; ++n)
+			churn_touch('n', nr_new++);
+	}
+	if (len < 0)
+		fail("Cannot list", dir);
+	close(fd);
+
+	for (n = 0; n < o.files; ++n) {
+		if (!old[n]) {
+			fprintf(stderr, "%s/churn/c%llu not listed\n", o.dir,
+				(unsigned long long) n);
+			exit(1);
+		}
+	}
+	free(dir);
+
+	for (n = 0; n < nr_new; ++n) {
+		dir = churn_file('n', n);
+		if (unlink(dir))
+			fail("Cannot unlink", dir);
+		free(dir);
+	}
+	free(old);
+	free(new);
+}
+
+static const struct workload workloads[] = {
+	{ "seqwrite", NULL, op_seqwrite, finish_data,
+		O_WRONLY | O_CREAT | O_TRUNC, 1 },
+	{ "seqread", prepare_data, op_seqread, NULL, O_RDONLY, 1 },
+	{ "randwrite", prepare_data, op_randwrite, finish_data, O_WRONLY, 0 },
+	{ "randread", prepare_data, op_randread, NULL, O_RDONLY, 0 },
+	{ "append", NULL, op_append, finish_data,
+		O_WRONLY | O_CREAT | O_APPEND, 1 },
+	{ "create", prepare_create, op_create, sync_dir, -1, 0 },
+	{ "unlink", prepare_unlink, op_unlink, sync_dir, -1, 0 },
+	{ "rename", prepare_rename, op_rename, sync_dir, -1, 1 },
+	{ "readdir", prepare_readdir, op_readdir, NULL, -1, 0 },
+	{ "churn", prepare_churn, op_churn, sync_dir, -1, 1 },
+};
+
+/* ezfs counters */
+static unsigned int read_counters(struct counter *c)
+{
+	unsigned int nr = 0;
+	struct dirent *de;
+	char *path;
+	FILE *f;
+	DIR *d;
+
+	if (!o.counters)
+		return 0;
+	d = opendir(o.counters);
+	if (!d)
+		fail("Cannot open", o.counters);
+	while ((de = readdir(d)) && nr < MAX_COUNTERS) {
+		if (de->d_name[0] == '.')
+			continue;
+		path = path_of("%s/%s", o.counters, de->d_name);
+		f = fopen(path, "r");
+		if (f && fscanf(f, "%llu",
+				(unsigned long long *) &c[nr].value) == 1) {
+			snprintf(c[nr].name, sizeof(c[nr].name), "%s",
+				de->d_name);
+			nr++;
+		}
+		if (f)
+			fclose(f);
+		free(path);
+	}
+	closedir(d);
+	return nr;
+}
+
+/* ezfs benchmark run */
+static const struct workload *wl;
+
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t i, t;
+
+	for (i = w->id; i < o.nr_ops; i += o.threads) {
+		t = now_ns();
+		wl->op(w, i);
+		w->lat[w->nr++] = now_ns() - t;
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *lat, uint64_t nr, double p)
+{
+	uint64_t i = (uint64_t) (p / 100 * nr);
+
+	if (!nr)
+		return 0;
+	return lat[i < nr ? i : nr - 1] / 1000.0;
+}
+
+static void run(void)
+{
+	struct counter before[MAX_COUNTERS], after[MAX_COUNTERS];
+	struct worker w[MAX_THREADS];
+	unsigned int i, j, nr_counters;
+	uint64_t *lat, nr = 0, bytes = 0, start, elapsed;
+	uint64_t stride = o.nr_ops / o.threads + 1;
+
+	memset(w, 0, sizeof(w));
+	lat = calloc(stride * o.threads, sizeof(*lat));
+	if (!lat)
+		fail("Out of memory for", "latencies");
+
+	for (i = 0; i < o.threads; ++i) {
+		w[i].id = i;
+		w[i].lat = lat + i * stride;
+		w[i].rand = o.seed + i * 0x9e3779b97f4a7c15ull;
+		w[i].buf = alloc_buf(o.bs);
+		w[i].fd = -1;
+		if (wl->open_flags != -1) {
+			w[i].fd = open(data_file, wl->open_flags, 0644);
+			if (w[i].fd == -1)
+				fail("Cannot open", data_file);
+		}
+	}
+
+	nr_counters = read_counters(before);
+	start = now_ns();
+	for (i = 0; i < o.threads; ++i)
+		if (pthread_create(&w[i].tid, NULL, run_worker, &w[i]))
+			fail("Cannot start", "a worker thread");
+	for (i = 0; i < o.threads; ++i)
+		pthread_join(w[i].tid, NULL);
+	if (wl->finish)
+		wl->finish();
+	elapsed = now_ns() - start;
+	read_counters(after);
+
+	/* Pack the latencies of all threads and sort them. */
+	for (i = 0; i < o.threads; ++i) {
+		memmove(lat + nr, w[i].lat, w[i].nr * sizeof(*lat));
+		nr += w[i].nr;
+		bytes += w[i].bytes;
+		if (w[i].fd != -1)
+			close(w[i].fd);
+		free(w[i].buf);
+	}
+	qsort(lat, nr, sizeof(*lat), cmp_u64);
+
+	printf("{\"workload\":\"%s\",\"threads\":%u,\"ops\":%llu,\"bytes\":%llu,"
+		"\"bs\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,",
+		wl->name, o.threads, (unsigned long long) nr,
+		(unsigned long long) bytes, o.bs, elapsed / 1e9,
+		nr / (elapsed / 1e9), bytes / (elapsed / 1e9) / (1 << 20));
+	printf("\"lat_us\":{\"min\":%.2f,\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,"
+		"\"p999\":%.2f,\"max\":%.2f},",
+		percentile(lat, nr, 0), percentile(lat, nr, 50),
+		percentile(lat, nr, 90), percentile(lat, nr, 99),
+		percentile(lat, nr, 99.9), percentile(lat, nr, 100));
+	printf("\"counters\":{");
+	for (i = 0; i < nr_counters; ++i) {
+		for (j = 0; j < nr_counters; ++j)
+			if (!strcmp(before[i].name, after[j].name))
+				break;
+		printf("%s\"%s\":%llu", i ? "," : "", before[i].name,
+			j < nr_counters ? (unsigned long long)
+			(after[j].value - before[i].value) : 0ull);
+	}
+	printf("}}\n");
+	free(lat);
+}
+
+static void usage(void)
+{
+	unsigned int i;
+
+	printf("Usage: ./ezfs_bench [OPTIONS] WORKLOAD DIR\n"
+		"  -s BYTES     file size of the data workloads (default 256M)\n"
+		"  -b BYTES     I/O size (default 1M, 4K for random I/O and appends)\n"
+		"  -n OPS       number of ops\n"
+		"  -t THREADS   threads, for workloads that allow several\n"
+		"  -f FILES     files per directory (readdir, churn), files renamed\n"
+		"               (rename)\n"
+		"  -F FANOUT    subdirectories per directory (readdir)\n"
+		"  -d DEPTH     levels below the top directory (readdir)\n"
+		"  -S SEED      random seed\n"
+		"  -c DIR       report the counters in DIR, e.g. /sys/fs/ezfs/loop0\n"
+		"  -P           only prepare\n"
+		"  -R           only run, on what -P left\n"
+		"Workloads:");
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i)
+		printf(" %s", workloads[i].name);
+	printf("\n");
+	exit(1);
+}
+
+static uint64_t parse_size(const char *arg)
+{
+	char *end;
+	uint64_t n = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		n <<= 10;
+		/* fallthrough */
+	case 'm': case 'M':
+		n <<= 10;
+		/* fallthrough */
+	case 'k': case 'K':
+		n <<= 10;
+	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int opt;
+
+	o.size = 256 << 20;
+	o.threads = 1;
+	o.fanout = 4;
+	o.depth = 4;
+	o.files = 100;
+	o.seed = 1;
+	o.prepare = o.run = 1;
+
+	while ((opt = getopt(argc, argv, "s:b:n:t:f:F:d:S:c:PR")) != -1) {
+		switch (opt) {
+		case 's':
+			o.size = parse_size(optarg);
+			break;
+		case 'b':
+			o.bs = parse_size(optarg);
+			break;
+		case 'n':
+			o.nr_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			o.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			o.files = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			o.fanout = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			o.seed = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'c':
+			o.counters = optarg;
+			break;
+		case 'P':
+			o.run = 0;
+			break;
+		case 'R':
+			o.prepare = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 2 || (!o.prepare && !o.run))
+		usage();
+	o.workload = argv[optind];
+	o.dir = argv[optind + 1];
+
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i)
+		if (!strcmp(workloads[i].name, o.workload))
+			wl = &workloads[i];
+	if (!wl || !o.threads || o.threads > MAX_THREADS || !o.files ||
+			!o.fanout)
+		usage();
+	if (wl->serial)
+		o.threads = 1;
+
+	if (!o.bs)
+		o.bs = wl->op == op_randread || wl->op == op_randwrite ||
+			wl->op == op_append ? 4096 : 1 << 20;
+	if (!o.nr_ops) {
+		if (wl->op == op_seqwrite || wl->op == op_seqread)
+			o.nr_ops = o.size / o.bs;
+		else if (wl->op == op_readdir)
+			o.nr_ops = tree_dirs();
+		else if (wl->op == op_churn)
+			o.nr_ops = 100;
+		else
+			o.nr_ops = 10000;
+	}
+	if (!o.size || o.size < o.bs || !o.nr_ops)
+		usage();
+	data_file = path_of("%s/data", o.dir);
+
+	if (o.prepare && wl->prepare)
+		wl->prepare();
+	if (o.run)
+		run();
+	free(data_file);
+	return 0;
+}
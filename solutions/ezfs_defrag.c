@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+/* These are the same on a 64-bit architecture */
+#define timespec64 timespec
+
+#include "ezfs.h"
+
+/* ezfs_defrag walks the trees it is given on a mounted ezfs volume and
+ * calls EZFS_IOC_DEFRAG on every regular file with more than one extent.
+ * The kernel packs each file's short extents together behind the extent
+ * before them and frees the old blocks, which merge back into longer free
+ * runs. Files are opened read-only; moving blocks of a file not open for
+ * writing takes CAP_SYS_ADMIN.
+ */
+
+struct totals {
+	uint64_t files, fragmented, failed;
+	uint64_t extents_before, extents_after, blocks_moved;
+};
+
+static struct totals t;
+static int dry_run, verbose;
+
+/* Number of extents of the file open at fd, or -1. */
+static long count_extents(int fd)
+{
+	struct fiemap fm;
+
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_flags = FIEMAP_FLAG_SYNC;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm))
+		return -1;
+	return fm.fm_mapped_extents;
+}
+
+static int defrag_one(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	struct ezfs_defrag_info info;
+	long extents;
+	int fd;
+
+	(void) ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	t.files++;
+
+	fd = open(path, O_RDONLY | O_NOATIME);
+	if (fd == -1)
+		fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		t.failed++;
+		return 0;
+	}
+
+	extents = count_extents(fd);
+	if (extents < 0) {
+		fprintf(stderr, "%s: FIEMAP: %s\n", path, strerror(errno));
+		t.failed++;
+		goto out;
+	}
+	if (extents <= 1)
+		goto out;
+	t.fragmented++;
+
+	if (dry_run) {
+		if (verbose)
+			printf("%s: %ld extents\n", path, extents);
+		t.extents_before += extents;
+		t.extents_after += extents;
+		goto out;
+	}
+
+	if (ioctl(fd, EZFS_IOC_DEFRAG, &info)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		t.failed++;
+		goto out;
+	}
+	if (verbose)
+		printf("%s: %u -> %u extents, %llu blocks moved\n", path,
+			info.extents_before, info.extents_after,
+			(unsigned long long) info.blocks_moved);
+	t.extents_before += info.extents_before;
+	t.extents_after += info.extents_after;
+	t.blocks_moved += info.blocks_moved;
+out:
+	close(fd);
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: ./ezfs_defrag [-n] [-v] PATH...\n"
+		"  -n           only count the fragmented files\n"
+		"  -v           report every fragmented file\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec t0, t1;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "nv")) != -1) {
+		switch (opt) {
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	/* stay on the volume each path is on, and off symlinks */
+	for (i = optind; i < argc; ++i) {
+		if (nftw(argv[i], defrag_one, 64, FTW_PHYS | FTW_MOUNT)) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			t.failed++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%llu files, %llu with %llu extents",
+		(unsigned long long) t.files,
+		(unsigned long long) t.fragmented,
+		(unsigned long long) t.extents_before);
+	if (!dry_run)
+		printf(" now in %llu, %llu blocks moved",
+			(unsigned long long) t.extents_after,
+			(unsigned long long) t.blocks_moved);
+	printf(", %llu failed, in %.2fs\n", (unsigned long long) t.failed,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	return t.failed ? 1 : 0;
+}
@@ -1,12 +1,24 @@
 #ifndef __EZFS_OPS_H__
 #define __EZFS_OPS_H__
 
+struct inode *ezfs_alloc_inode(struct super_block *sb);
+void ezfs_free_inode(struct inode *inode);
 void ezfs_evict_inode(struct inode *inode);
+void ezfs_dirty_inode(struct inode *inode, int flags);
 int ezfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+int ezfs_sync_fs(struct super_block *sb, int wait);
+void ezfs_put_super(struct super_block *sb);
+int ezfs_statfs(struct dentry *dentry, struct kstatfs *buf);
 
 struct super_operations ezfs_sb_ops = {
+	.alloc_inode = ezfs_alloc_inode,
+	.free_inode = ezfs_free_inode,
 	.evict_inode = ezfs_evict_inode,
+	.dirty_inode = ezfs_dirty_inode,
 	.write_inode = ezfs_write_inode,
+	.sync_fs = ezfs_sync_fs,
+	.put_super = ezfs_put_super,
+	.statfs = ezfs_statfs,
 };
 
 struct dentry *ezfs_lookup(struct inode *parent, struct dentry *child_dentry,
@@ -17,6 +29,9 @@ int ezfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
 int ezfs_rmdir(struct inode *dir, struct dentry *dentry);
 int ezfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct inode *new_dir, struct dentry *new_dentry, unsigned int flags);
+int ezfs_setattr(struct dentry *dentry, struct iattr *iattr);
+int ezfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len);
 /* hard links and symlinks not needed for this assignment */
 
 const struct inode_operations ezfs_inode_ops = {
@@ -26,39 +41,104 @@ const struct inode_operations ezfs_inode_ops = {
 	.mkdir = ezfs_mkdir,
 	.rmdir = ezfs_rmdir,
 	.rename = ezfs_rename,
+	.setattr = ezfs_setattr,
+	.fiemap = ezfs_fiemap,
+};
+
+/* Directories of a flat (version 1) volume, which is read-only */
+struct dentry *ezfs_flat_lookup(struct inode *dir, struct dentry *child_dentry,
+			unsigned int flags);
+
+const struct inode_operations ezfs_flat_dir_inode_ops = {
+	.lookup = ezfs_flat_lookup,
+};
+
+int ezfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+		unsigned int flags, struct iomap *iomap, struct iomap *srcmap);
+int ezfs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+		ssize_t written, unsigned int flags, struct iomap *iomap);
+int ezfs_map_writeback(struct iomap_writepage_ctx *wpc, struct inode *inode,
+		loff_t offset);
+int ezfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+		unsigned int flags);
+
+const struct iomap_ops ezfs_iomap_ops = {
+	.iomap_begin = ezfs_iomap_begin,
+	.iomap_end = ezfs_iomap_end,
+};
+
+const struct iomap_writeback_ops ezfs_writeback_ops = {
+	.map_blocks = ezfs_map_writeback,
+};
+
+const struct iomap_dio_ops ezfs_dio_write_ops = {
+	.end_io = ezfs_dio_write_end_io,
 };
 
 int ezfs_iterate(struct file *filp, struct dir_context *ctx);
 int ezfs_readpage(struct file *file, struct page *page);
+void ezfs_readahead(struct readahead_control *rac);
 int ezfs_writepage(struct page *page, struct writeback_control *wbc);
-int ezfs_write_begin(struct file *file, struct address_space *mapping,
-		loff_t pos, unsigned int len, unsigned int flags,
-		struct page **pagep, void **fsdata);
-int ezfs_write_end(struct file *file, struct address_space *mapping,
-			loff_t pos, unsigned len, unsigned copied,
-			struct page *page, void *fsdata);
+int ezfs_writepages(struct address_space *mapping,
+		struct writeback_control *wbc);
 sector_t ezfs_bmap(struct address_space *mapping, sector_t block);
+int ezfs_file_open(struct inode *inode, struct file *file);
+ssize_t ezfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t ezfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
+int ezfs_file_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+int ezfs_file_release(struct inode *inode, struct file *file);
+long ezfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+long ezfs_file_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+loff_t ezfs_file_llseek(struct file *file, loff_t offset, int whence);
+int ezfs_file_mmap(struct file *file, struct vm_area_struct *vma);
+vm_fault_t ezfs_page_mkwrite(struct vm_fault *vmf);
+
+const struct vm_operations_struct ezfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ezfs_page_mkwrite,
+};
 
 const struct file_operations ezfs_dir_ops = {
 	.owner = THIS_MODULE,
 	.iterate_shared = ezfs_iterate,
+	.fsync = ezfs_file_fsync,
+};
+
+int ezfs_flat_iterate(struct file *filp, struct dir_context *ctx);
+
+const struct file_operations ezfs_flat_dir_ops = {
+	.owner = THIS_MODULE,
+	.iterate_shared = ezfs_flat_iterate,
 };
 
 const struct file_operations ezfs_file_ops = {
 	.owner = THIS_MODULE,
-	.llseek = generic_file_llseek,
-	.read_iter = generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
-	.mmap = generic_file_mmap,
+	.open = ezfs_file_open,
+	.llseek = ezfs_file_llseek,
+	.read_iter = ezfs_file_read_iter,
+	.write_iter	= ezfs_file_write_iter,
+	.unlocked_ioctl = ezfs_file_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = ezfs_file_mmap,
 	.splice_read = generic_file_splice_read,
-	.fsync = generic_file_fsync,
+	.fsync = ezfs_file_fsync,
+	.release = ezfs_file_release,
+	.fallocate = ezfs_fallocate,
 };
 
 const struct address_space_operations ezfs_aops = {
 	.readpage = ezfs_readpage,
+	.readahead = ezfs_readahead,
 	.writepage = ezfs_writepage,
-	.write_begin = ezfs_write_begin,
-	.write_end = ezfs_write_end,
+	.writepages = ezfs_writepages,
+	.set_page_dirty = iomap_set_page_dirty,
+	.releasepage = iomap_releasepage,
+	.invalidatepage = iomap_invalidatepage,
 	.bmap = ezfs_bmap,
+	.direct_IO = noop_direct_IO,
+	.migratepage = iomap_migrate_page,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
 };
 #endif /* ifndef __EZFS_OPS_H__ */
@@ -0,0 +1,219 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ezfs
+
+#if !defined(_EZFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EZFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Tracepoints on the hot paths. They cost a patched-out branch until
+ * someone enables them, e.g. through /sys/kernel/tracing/events/ezfs/.
+ */
+
+/* ezfs_map_blocks() has placed a run of blocks in a hole. */
+TRACE_EVENT(ezfs_alloc_run,
+	TP_PROTO(struct inode *inode, uint32_t lblk, uint64_t pblk,
+		uint32_t len, uint32_t nr_extents),
+	TP_ARGS(inode, lblk, pblk, len, nr_extents),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(uint32_t, lblk)
+		__field(uint64_t, pblk)
+		__field(uint32_t, len)
+		__field(uint32_t, nr_extents)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->lblk = lblk;
+		__entry->pblk = pblk;
+		__entry->len = len;
+		__entry->nr_extents = nr_extents;
+	),
+	TP_printk("dev %d:%d ino %lu lblk %u pblk %llu len %u nr_extents %u",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->lblk, __entry->pblk, __entry->len, __entry->nr_extents)
+);
+
+TRACE_EVENT(ezfs_free_blocks,
+	TP_PROTO(struct super_block *sb, uint64_t blk, uint64_t nr),
+	TP_ARGS(sb, blk, nr),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, blk)
+		__field(uint64_t, nr)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->blk = blk;
+		__entry->nr = nr;
+	),
+	TP_printk("dev %d:%d blk %llu nr %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->blk,
+		__entry->nr)
+);
+
+/* Every ezfs_map_blocks() call, with the run it returned. */
+TRACE_EVENT(ezfs_map_blocks,
+	TP_PROTO(struct inode *inode, uint32_t lblk, uint32_t len,
+		uint64_t pblk, unsigned int flags, int mode, int ret),
+	TP_ARGS(inode, lblk, len, pblk, flags, mode, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(uint32_t, lblk)
+		__field(uint32_t, len)
+		__field(uint64_t, pblk)
+		__field(unsigned int, flags)
+		__field(int, mode)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->lblk = lblk;
+		__entry->len = len;
+		__entry->pblk = pblk;
+		__entry->flags = flags;
+		__entry->mode = mode;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d ino %lu lblk %u len %u pblk %llu flags %s mode %d ret %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->lblk, __entry->len, __entry->pblk,
+		__print_flags(__entry->flags, "|",
+			{ 0x1, "MAPPED" }, { 0x2, "NEW" }, { 0x4, "DELAYED" }),
+		__entry->mode, __entry->ret)
+);
+
+TRACE_EVENT(ezfs_lookup,
+	TP_PROTO(struct inode *dir, const struct qstr *name, unsigned long ino,
+		unsigned int probes),
+	TP_ARGS(dir, name, ino, probes),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__field(unsigned int, probes)
+		__string(name, name->name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->probes = probes;
+		__assign_str(name, name->name);
+	),
+	TP_printk("dev %d:%d dir %lu name %s ino %lu probes %u",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		__get_str(name), __entry->ino, __entry->probes)
+);
+
+DECLARE_EVENT_CLASS(ezfs_page_class,
+	TP_PROTO(struct inode *inode, pgoff_t index, unsigned int nr),
+	TP_ARGS(inode, index, nr),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(pgoff_t, index)
+		__field(unsigned int, nr)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->index = index;
+		__entry->nr = nr;
+	),
+	TP_printk("dev %d:%d ino %lu index %lu nr %u",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->index, __entry->nr)
+);
+
+DEFINE_EVENT(ezfs_page_class, ezfs_readpage,
+	TP_PROTO(struct inode *inode, pgoff_t index, unsigned int nr),
+	TP_ARGS(inode, index, nr));
+
+DEFINE_EVENT(ezfs_page_class, ezfs_readahead,
+	TP_PROTO(struct inode *inode, pgoff_t index, unsigned int nr),
+	TP_ARGS(inode, index, nr));
+
+DEFINE_EVENT(ezfs_page_class, ezfs_writepage,
+	TP_PROTO(struct inode *inode, pgoff_t index, unsigned int nr),
+	TP_ARGS(inode, index, nr));
+
+TRACE_EVENT(ezfs_writepages,
+	TP_PROTO(struct inode *inode, struct writeback_control *wbc),
+	TP_ARGS(inode, wbc),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(long, nr_to_write)
+		__field(loff_t, range_start)
+		__field(loff_t, range_end)
+		__field(int, sync_mode)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->nr_to_write = wbc->nr_to_write;
+		__entry->range_start = wbc->range_start;
+		__entry->range_end = wbc->range_end;
+		__entry->sync_mode = wbc->sync_mode;
+	),
+	TP_printk("dev %d:%d ino %lu nr_to_write %ld range %lld-%lld sync_mode %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->nr_to_write, __entry->range_start,
+		__entry->range_end, __entry->sync_mode)
+);
+
+TRACE_EVENT(ezfs_evict_inode,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(unsigned int, nlink)
+		__field(blkcnt_t, blocks)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->nlink = inode->i_nlink;
+		__entry->blocks = inode->i_blocks;
+	),
+	TP_printk("dev %d:%d ino %lu nlink %u blocks %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->nlink, (unsigned long long) __entry->blocks)
+);
+
+TRACE_EVENT(ezfs_journal_commit,
+	TP_PROTO(struct super_block *sb, uint64_t sequence, unsigned int nr,
+		unsigned int nr_revoke, uint64_t commit_pos),
+	TP_ARGS(sb, sequence, nr, nr_revoke, commit_pos),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, sequence)
+		__field(unsigned int, nr)
+		__field(unsigned int, nr_revoke)
+		__field(uint64_t, commit_pos)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->sequence = sequence;
+		__entry->nr = nr;
+		__entry->nr_revoke = nr_revoke;
+		__entry->commit_pos = commit_pos;
+	),
+	TP_printk("dev %d:%d seq %llu blocks %u revoked %u commit_pos %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->sequence,
+		__entry->nr, __entry->nr_revoke, __entry->commit_pos)
+);
+
+#endif /* _EZFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ezfs_trace
+#include <trace/define_trace.h>
@@ -1,3 +1,7 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,11 +14,85 @@
 
 /* These are the same on a 64-bit architecture */
 #define timespec64 timespec
-#define IMG_BLK 8
-#define TXT_BLK 2
 
 #include "ezfs.h"
 
+/* One inode for every this many bytes of device, unless told otherwise. */
+#define BYTES_PER_INODE (4 * EZFS_BLOCK_SIZE)
+
+/* The journal takes this fraction of the device, within bounds. Devices too
+ * small to spare the minimum get none.
+ */
+#define JOURNAL_FRACTION 64
+#define JOURNAL_MAX_BLOCKS 8192
+
+/* Data is written in batches of this many contiguous device blocks. */
+#define BATCH_BLOCKS 1024
+
+/* A directory block or leaf is filled up to this many bytes of entries, so
+ * that the first files created after mounting do not split it straight away.
+ */
+#define DIR_FILL (EZFS_BLOCK_SIZE * 3 / 4)
+
+#define MAX_THREADS 64
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* A file or directory of the image being built. Regular files take their
+ * contents from path, or from data if path is NULL; directories have their
+ * blocks rendered into data just before they are placed.
+ */
+struct node {
+	struct ezfs_inode inode;
+	char *path;
+	char *data;
+	uint64_t ino;
+	uint64_t start; /* First device block */
+
+	struct entry *entries; /* Directories only */
+	unsigned int nr_entries, max_entries;
+	unsigned int nr_subdirs;
+};
+
+struct entry {
+	char *name;
+	struct node *node;
+};
+
+/* Shared state of the tree walk. Directories wait in queue until a worker
+ * takes them; the walk is over once the queue is empty and nobody is busy
+ * scanning, since only a scan can add to it.
+ */
+struct walk {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct node **queue;
+	size_t head, tail, size;
+	unsigned int busy;
+	uint64_t nr_nodes;
+};
+
+/* Shared state of the data copy. Workers take batches in order. */
+struct copy {
+	int fd;
+	uint64_t data_start;
+	uint64_t nr_blocks; /* Data blocks in use */
+	struct node **placed; /* Nodes with blocks, by start */
+	uint64_t nr_placed;
+	uint64_t next_batch;
+};
+
+struct options {
+	uint64_t nr_blocks; /* 0: the whole device */
+	uint64_t nr_inodes; /* 0: from bytes_per_inode */
+	uint64_t bytes_per_inode;
+	int64_t journal_blocks; /* -1: from the device size */
+	const char *source;
+	int empty;
+	int direct;
+	int no_inline;
+	unsigned int threads;
+};
 
 void passert(int condition, char *message)
 {
@@ -23,6 +101,24 @@ void passert(int condition, char *message)
 		exit(1);
 }
 
+/* Reports a failure on one file of the source tree and gives up. */
+void fail(const char *what, const char *path)
+{
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+
+	if (!p) {
+		perror("Out of memory");
+		exit(1);
+	}
+	return p;
+}
+
 void inode_reset(struct ezfs_inode *inode)
 {
 	struct timespec current_time;
@@ -40,240 +136,906 @@ void inode_reset(struct ezfs_inode *inode)
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time;
 }
 
-void dentry_reset(struct ezfs_dir_entry *dentry)
+/* Map the whole file as a single extent starting at device block start. */
+void inode_map(struct ezfs_inode *inode, uint64_t start, uint64_t nblocks)
 {
-	memset(dentry, 0, sizeof(*dentry));
+	inode->nblocks = nblocks;
+	if (!nblocks)
+		return;
+	inode->nr_extents = 1;
+	inode->extents[0].ee_block = 0;
+	inode->extents[0].ee_len = nblocks;
+	inode->extents[0].ee_start = start;
 }
 
-int main(int argc, char *argv[])
+/* Make leaf a directory block without entries: one empty record spanning
+ * it.
+ */
+void leaf_init(char *leaf)
 {
-	int i, fd, fp;
-	ssize_t ret, pret, bret, len;
-	struct ezfs_super_block sb;
-	struct ezfs_inode inode;
-	struct ezfs_dir_entry dentry;
+	memset(leaf, 0, EZFS_BLOCK_SIZE);
+	((struct ezfs_dir_entry *) leaf)->rec_len = EZFS_BLOCK_SIZE;
+}
+
+/* Append a dentry for node to the directory block leaf, in the slack of its
+ * last record.
+ */
+void dir_add(char *leaf, const char *name, const struct node *node)
+{
+	struct ezfs_dir_entry *de = (struct ezfs_dir_entry *) leaf, *next;
+	unsigned int len = strlen(name), off = 0, used;
+
+	while (off + de->rec_len < EZFS_BLOCK_SIZE) {
+		off += de->rec_len;
+		de = (struct ezfs_dir_entry *) (leaf + off);
+	}
+	used = de->inode_no ? EZFS_DIR_REC_LEN(de->name_len) : 0;
+	if (de->rec_len - used < EZFS_DIR_REC_LEN(len))
+		passert(0, "Find room for a dentry");
+
+	if (used) {
+		next = (struct ezfs_dir_entry *) (leaf + off + used);
+		next->rec_len = de->rec_len - used;
+		de->rec_len = used;
+		de = next;
+	}
+	de->inode_no = node->ino;
+	de->name_hash = ezfs_name_hash(name, len);
+	de->name_len = len;
+	de->file_type = EZFS_FT(node->inode.mode);
+	memcpy(de->name, name, len);
+}
+
+uint64_t journal_size(uint64_t nr_blocks)
+{
+	uint64_t blocks = nr_blocks / JOURNAL_FRACTION;
+
+	if (nr_blocks < 8 * EZFS_JOURNAL_MIN_BLOCKS)
+		return 0;
+	if (blocks < EZFS_JOURNAL_MIN_BLOCKS)
+		return EZFS_JOURNAL_MIN_BLOCKS;
+	return blocks > JOURNAL_MAX_BLOCKS ? JOURNAL_MAX_BLOCKS : blocks;
+}
+
+/* Lay out the regions of the volume. The inode table is sized from the
+ * requested inode count, and whatever is left after the metadata and the
+ * journal becomes data blocks, each tracked by one bit of the data bitmap.
+ */
+void compute_geometry(struct ezfs_super_block *sb, uint64_t nr_blocks,
+		uint64_t nr_inodes, uint64_t journal_blocks)
+{
+	uint64_t left;
+
+	sb->nr_blocks = nr_blocks;
+	sb->journal_blocks = journal_blocks;
+	sb->inode_table_blocks = DIV_ROUND_UP(nr_inodes, EZFS_INODES_PER_BLOCK);
+	/* Round up so that no slot of the last table block is wasted. */
+	sb->nr_inodes = sb->inode_table_blocks * EZFS_INODES_PER_BLOCK;
+	sb->inode_bitmap_blocks = DIV_ROUND_UP(sb->nr_inodes,
+			EZFS_BITS_PER_BLOCK);
+
+	passert(nr_blocks > 2 + sb->inode_bitmap_blocks +
+		sb->inode_table_blocks + sb->journal_blocks,
+		"Metadata fits on the device");
+	left = nr_blocks - 1 - sb->inode_bitmap_blocks - sb->inode_table_blocks -
+		sb->journal_blocks;
+	sb->data_bitmap_blocks = DIV_ROUND_UP(left, EZFS_BITS_PER_BLOCK + 1);
+	sb->nr_data_blocks = left - sb->data_bitmap_blocks;
+
+	sb->inode_bitmap_start = EZFS_SUPERBLOCK_DATABLOCK_NUMBER + 1;
+	sb->data_bitmap_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+	sb->inode_table_start = sb->data_bitmap_start + sb->data_bitmap_blocks;
+	sb->journal_start = sb->inode_table_start + sb->inode_table_blocks;
+	sb->data_start = sb->journal_start + sb->journal_blocks;
+}
+
+/* Write len bytes of buf starting at device block blk. */
+void write_blocks(int fd, uint64_t blk, const void *buf, size_t len,
+		char *message)
+{
+	ssize_t ret = pwrite(fd, buf, len, blk * EZFS_BLOCK_SIZE);
+
+	passert(ret == (ssize_t) len, message);
+}
+
+/* Zero nr blocks from blk, without moving the zeroes through memory if the
+ * device can do it on its own.
+ */
+void zero_blocks(int fd, uint64_t blk, uint64_t nr, char *message)
+{
+	static char zeroes[BATCH_BLOCKS * EZFS_BLOCK_SIZE];
+	uint64_t len;
+
+	if (!fallocate(fd, FALLOC_FL_ZERO_RANGE, blk * EZFS_BLOCK_SIZE,
+			nr * EZFS_BLOCK_SIZE)) {
+		passert(1, message);
+		return;
+	}
+
+	for (; nr; nr -= len, blk += len) {
+		len = nr < BATCH_BLOCKS ? nr : BATCH_BLOCKS;
+		if (pwrite(fd, zeroes, len * EZFS_BLOCK_SIZE,
+				blk * EZFS_BLOCK_SIZE) != (ssize_t) (len * EZFS_BLOCK_SIZE))
+			passert(0, message);
+	}
+	passert(1, message);
+}
+
+/* ezfs source tree */
+struct node *node_new(mode_t mode)
+{
+	struct node *node = xcalloc(1, sizeof(*node));
+
+	inode_reset(&node->inode);
+	node->inode.mode = mode;
+	return node;
+}
+
+void node_add(struct node *dir, const char *name, struct node *node)
+{
+	struct entry *e;
+
+	if (strlen(name) > EZFS_MAX_FILENAME_LENGTH) {
+		errno = ENAMETOOLONG;
+		fail("Cannot add", name);
+	}
+	if (dir->nr_entries == dir->max_entries) {
+		dir->max_entries = dir->max_entries ? 2 * dir->max_entries : 8;
+		dir->entries = realloc(dir->entries,
+			dir->max_entries * sizeof(*dir->entries));
+		if (!dir->entries)
+			fail("Out of memory in", name);
+	}
+	e = &dir->entries[dir->nr_entries++];
+	e->name = strdup(name);
+	e->node = node;
+	if (S_ISDIR(node->inode.mode))
+		dir->nr_subdirs++;
+}
+
+/* Fill in a node from the stat of its source. */
+void node_stat(struct node *node, const struct stat *st)
+{
+	node->inode.mode = st->st_mode;
+	node->inode.uid = st->st_uid;
+	node->inode.gid = st->st_gid;
+	node->inode.i_atime = st->st_atim;
+	node->inode.i_mtime = st->st_mtim;
+	node->inode.i_ctime = st->st_ctim;
+	if (S_ISREG(st->st_mode))
+		node->inode.file_size = st->st_size;
+}
+
+/* The tree the formatter has always written: hello.txt and subdir in the
+ * root, and names.txt plus the two big_files in subdir. The big files are
+ * read from ./big_files.
+ */
+struct node *sample_tree(void)
+{
+	struct node *root = node_new(S_IFDIR | 0777);
+	struct node *subdir = node_new(S_IFDIR | 0777);
+	struct node *file;
+	struct stat st;
 
 	char *hello_contents = "Hello world!\n";
 	char *names_contents = "Emma Nieh; Zijian Zhang; Haruki Gonai\n";
-	char buf[EZFS_BLOCK_SIZE], pbuf[EZFS_BLOCK_SIZE * IMG_BLK];
-	char bbuf[EZFS_BLOCK_SIZE * TXT_BLK];
-	const char zeroes[EZFS_BLOCK_SIZE] = { 0 };
+	char *big_files[] = { "big_img.jpeg", "big_txt.txt" };
+	char path[64];
+	unsigned int i;
 
-	if (argc != 2) {
-		printf("Usage: ./format_disk_as_ezfs DEVICE_NAME.\n");
-		return -1;
+	file = node_new(S_IFREG | 0666);
+	file->data = hello_contents;
+	file->inode.file_size = strlen(hello_contents);
+	node_add(root, "hello.txt", file);
+	node_add(root, "subdir", subdir);
+
+	file = node_new(S_IFREG | 0666);
+	file->data = names_contents;
+	file->inode.file_size = strlen(names_contents);
+	node_add(subdir, "names.txt", file);
+
+	for (i = 0; i < 2; ++i) {
+		snprintf(path, sizeof(path), "./big_files/%s", big_files[i]);
+		if (stat(path, &st))
+			fail("Cannot stat", path);
+		file = node_new(S_IFREG | 0666);
+		file->path = strdup(path);
+		file->inode.file_size = st.st_size;
+		node_add(subdir, big_files[i], file);
+	}
+	return root;
+}
+
+void walk_push(struct walk *w, struct node *dir)
+{
+	if (w->tail == w->size) {
+		w->size = w->size ? 2 * w->size : 64;
+		w->queue = realloc(w->queue, w->size * sizeof(*w->queue));
+		if (!w->queue)
+			fail("Out of memory walking", dir->path);
+	}
+	w->queue[w->tail++] = dir;
+}
+
+/* Read one source directory into dir. Subdirectories are returned through
+ * subdirs for the caller to queue, so that the walk lock is not held while
+ * the directory is read.
+ */
+unsigned int walk_scan(struct node *dir, struct node ***subdirs)
+{
+	struct node *node, **found = NULL;
+	unsigned int nr = 0, max = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir->path);
+	if (!d)
+		fail("Cannot open", dir->path);
+
+	while ((errno = 0, de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			fail("Cannot stat an entry of", dir->path);
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "Skipping %s/%s: not a file or directory\n",
+				dir->path, de->d_name);
+			continue;
+		}
+		if (st.st_size / EZFS_BLOCK_SIZE >= UINT32_MAX) {
+			errno = EFBIG;
+			fail("Cannot copy an entry of", dir->path);
+		}
+
+		node = xcalloc(1, sizeof(*node));
+		node_stat(node, &st);
+		if (asprintf(&node->path, "%s/%s", dir->path, de->d_name) < 0)
+			fail("Out of memory walking", dir->path);
+		node_add(dir, de->d_name, node);
+
+		if (S_ISDIR(st.st_mode)) {
+			if (nr == max) {
+				max = max ? 2 * max : 8;
+				found = realloc(found, max * sizeof(*found));
+				if (!found)
+					fail("Out of memory walking", dir->path);
+			}
+			found[nr++] = node;
+		}
+	}
+	if (errno)
+		fail("Cannot read", dir->path);
+	closedir(d);
+
+	*subdirs = found;
+	return nr;
+}
+
+void *walk_worker(void *arg)
+{
+	struct walk *w = arg;
+	struct node *dir, **subdirs;
+	unsigned int i, nr;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->head == w->tail && w->busy)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->head == w->tail)
+			break;
+
+		dir = w->queue[w->head++];
+		w->busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		nr = walk_scan(dir, &subdirs);
+
+		pthread_mutex_lock(&w->lock);
+		for (i = 0; i < nr; ++i)
+			walk_push(w, subdirs[i]);
+		w->nr_nodes += dir->nr_entries;
+		w->busy--;
+		pthread_cond_broadcast(&w->cond);
+		free(subdirs);
 	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Read the tree under source with threads workers, each scanning one
+ * directory at a time. Returns the root; *nr_nodes counts it too.
+ */
+struct node *walk_tree(const char *source, unsigned int threads,
+		uint64_t *nr_nodes)
+{
+	pthread_t tids[MAX_THREADS];
+	struct walk w;
+	struct node *root;
+	struct stat st;
+	unsigned int i;
+
+	if (stat(source, &st))
+		fail("Cannot stat", source);
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		fail("Cannot populate from", source);
+	}
+	root = xcalloc(1, sizeof(*root));
+	node_stat(root, &st);
+	root->path = strdup(source);
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	walk_push(&w, root);
 
-	fd = open(argv[1], O_RDWR);
+	for (i = 0; i < threads; ++i)
+		if (pthread_create(&tids[i], NULL, walk_worker, &w))
+			passert(0, "Start a walker thread");
+	for (i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+
+	free(w.queue);
+	*nr_nodes = w.nr_nodes + 1;
+	return root;
+}
+
+/* ezfs directory building */
+struct dir_leaf {
+	unsigned int lo, hi; /* Range of the entries sorted by hash */
+	uint32_t prefix; /* Top depth bits of their hashes */
+	unsigned int depth;
+};
+
+struct hashed_entry {
+	uint32_t hash;
+	unsigned int rec_len;
+	struct entry *e;
+};
+
+int cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct entry *) a)->name,
+		((const struct entry *) b)->name);
+}
+
+int cmp_hash(const void *a, const void *b)
+{
+	uint32_t x = ((const struct hashed_entry *) a)->hash;
+	uint32_t y = ((const struct hashed_entry *) b)->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Cover the entries in [lo, hi) of he, whose hashes share their top depth
+ * bits, with leaves, splitting on the next hash bit like the kernel does.
+ */
+unsigned int dir_split(struct hashed_entry *he, unsigned int lo,
+		unsigned int hi, uint32_t prefix, unsigned int depth,
+		struct dir_leaf *leaves, unsigned int nr, const char *path)
+{
+	unsigned int mid, bytes = 0;
+
+	for (mid = lo; mid < hi; ++mid)
+		bytes += he[mid].rec_len;
+	if (bytes <= DIR_FILL || depth == EZFS_DIR_MAX_DEPTH) {
+		if (bytes > EZFS_BLOCK_SIZE) {
+			errno = EMLINK;
+			fail("Too many entries in", path ? path : "a directory");
+		}
+		leaves[nr].lo = lo;
+		leaves[nr].hi = hi;
+		leaves[nr].prefix = prefix;
+		leaves[nr].depth = depth;
+		return nr + 1;
+	}
+
+	for (mid = lo; mid < hi; ++mid)
+		if (he[mid].hash & (1u << (31 - depth)))
+			break;
+	nr = dir_split(he, lo, mid, prefix << 1, depth + 1, leaves, nr, path);
+	return dir_split(he, mid, hi, (prefix << 1) | 1, depth + 1, leaves, nr,
+		path);
+}
+
+/* Render the blocks of dir into dir->data. A directory that fits in one
+ * block stays that way; a bigger one is indexed, with leaves that would
+ * have come out of splitting it entry by entry.
+ */
+void dir_build(struct node *dir)
+{
+	struct ezfs_dir_index *index;
+	struct hashed_entry *he;
+	struct dir_leaf *leaves;
+	unsigned int i, j, slot, nr, depth = 0;
+	uint64_t nblocks, bytes = 0;
+
+	for (i = 0; i < dir->nr_entries; ++i)
+		bytes += EZFS_DIR_REC_LEN(strlen(dir->entries[i].name));
+	if (bytes <= DIR_FILL) {
+		dir->data = xcalloc(1, EZFS_BLOCK_SIZE);
+		leaf_init(dir->data);
+		for (i = 0; i < dir->nr_entries; ++i)
+			dir_add(dir->data, dir->entries[i].name,
+				dir->entries[i].node);
+		dir->inode.file_size = EZFS_BLOCK_SIZE;
+		return;
+	}
+
+	he = xcalloc(dir->nr_entries, sizeof(*he));
+	for (i = 0; i < dir->nr_entries; ++i) {
+		he[i].e = &dir->entries[i];
+		he[i].hash = ezfs_name_hash(he[i].e->name, strlen(he[i].e->name));
+		he[i].rec_len = EZFS_DIR_REC_LEN(strlen(he[i].e->name));
+	}
+	qsort(he, dir->nr_entries, sizeof(*he), cmp_hash);
+
+	leaves = xcalloc(EZFS_DIR_INDEX_SLOTS, sizeof(*leaves));
+	nr = dir_split(he, 0, dir->nr_entries, 0, 0, leaves, 0, dir->path);
+	for (i = 0; i < nr; ++i)
+		if (leaves[i].depth > depth)
+			depth = leaves[i].depth;
+
+	nblocks = 1 + nr;
+	dir->data = xcalloc(nblocks, EZFS_BLOCK_SIZE);
+	index = (struct ezfs_dir_index *) dir->data;
+	index->depth = depth;
+	for (i = 0; i < nr; ++i) {
+		slot = leaves[i].prefix << (depth - leaves[i].depth);
+		for (j = 0; j < 1u << (depth - leaves[i].depth); ++j) {
+			index->leaf[slot + j] = 1 + i;
+			index->leaf_depth[slot + j] = leaves[i].depth;
+		}
+		leaf_init(dir->data + (1 + i) * EZFS_BLOCK_SIZE);
+		for (j = leaves[i].lo; j < leaves[i].hi; ++j)
+			dir_add(dir->data + (1 + i) * EZFS_BLOCK_SIZE,
+				he[j].e->name, he[j].e->node);
+	}
+	dir->inode.flags = EZFS_INDEXED_DIR_FL;
+	dir->inode.file_size = nblocks * EZFS_BLOCK_SIZE;
+	free(leaves);
+	free(he);
+}
+
+/* ezfs layout */
+struct layout {
+	uint64_t data_start;
+	uint64_t next_blk; /* Relative to data_start */
+	uint64_t next_ino;
+	struct node **by_ino;
+	struct node **placed;
+	uint64_t nr_placed;
+	int inline_data;
+};
+
+void place(struct layout *l, struct node *node, uint64_t nblocks)
+{
+	node->start = l->data_start + l->next_blk;
+	inode_map(&node->inode, node->start, nblocks);
+	if (nblocks)
+		l->placed[l->nr_placed++] = node;
+	l->next_blk += nblocks;
+}
+
+/* Keep the contents of a small file in its inode instead of a block. */
+void store_inline(struct node *node)
+{
+	struct ezfs_inode *inode = &node->inode;
+	ssize_t ret;
+	int fd;
+
+	inode->flags |= EZFS_INLINE_DATA_FL;
+	if (!inode->file_size)
+		return;
+	if (!node->path) {
+		memcpy(inode->i_data, node->data, inode->file_size);
+		return;
+	}
+
+	fd = open(node->path, O_RDONLY);
+	if (fd == -1)
+		fail("Cannot open", node->path);
+	/* A file that shrank since it was looked at reads as zeroes. */
+	ret = pread(fd, inode->i_data, inode->file_size, 0);
+	if (ret < 0)
+		fail("Cannot read", node->path);
+	close(fd);
+}
+
+/* Number and place dir and everything under it, depth first. The entries
+ * of a directory get consecutive inode numbers, and its blocks are followed
+ * by those of its files, so that a directory and its files end up together
+ * both in the inode table and on disk.
+ */
+void layout_dir(struct layout *l, struct node *dir)
+{
+	struct node *node;
+	unsigned int i;
+
+	qsort(dir->entries, dir->nr_entries, sizeof(*dir->entries), cmp_entry);
+	for (i = 0; i < dir->nr_entries; ++i) {
+		node = dir->entries[i].node;
+		node->ino = l->next_ino++;
+		l->by_ino[node->ino - EZFS_ROOT_INODE_NUMBER] = node;
+	}
+
+	dir_build(dir);
+	dir->inode.nlink = 2 + dir->nr_subdirs;
+	place(l, dir, dir->inode.file_size / EZFS_BLOCK_SIZE);
+
+	for (i = 0; i < dir->nr_entries; ++i) {
+		node = dir->entries[i].node;
+		if (!S_ISREG(node->inode.mode))
+			continue;
+		node->inode.nlink = 1;
+		if (l->inline_data &&
+				node->inode.file_size <= EZFS_INLINE_DATA_SIZE)
+			store_inline(node);
+		else
+			place(l, node, DIV_ROUND_UP(node->inode.file_size,
+				EZFS_BLOCK_SIZE));
+	}
+	for (i = 0; i < dir->nr_entries; ++i) {
+		node = dir->entries[i].node;
+		if (S_ISDIR(node->inode.mode))
+			layout_dir(l, node);
+	}
+}
+
+/* ezfs data copy */
+
+/* Fill buf with blocks [blk, blk + nr) of node, zeroes past its EOF. */
+void copy_node(struct node *node, uint64_t blk, uint64_t nr, char *buf)
+{
+	uint64_t pos = (blk - node->start) * EZFS_BLOCK_SIZE;
+	uint64_t len = nr * EZFS_BLOCK_SIZE;
+	ssize_t ret;
+	int fd;
+
+	if (S_ISDIR(node->inode.mode)) {
+		memcpy(buf, node->data + pos, len);
+		return;
+	}
+	if (pos + len > node->inode.file_size)
+		len = node->inode.file_size - pos;
+	if (!node->path) {
+		memcpy(buf, node->data + pos, len);
+		return;
+	}
+
+	fd = open(node->path, O_RDONLY);
+	if (fd == -1)
+		fail("Cannot open", node->path);
+	/* A file that shrank since it was looked at reads as zeroes. */
+	while (len) {
+		ret = pread(fd, buf, len, pos);
+		if (ret < 0)
+			fail("Cannot read", node->path);
+		if (!ret)
+			break;
+		buf += ret;
+		pos += ret;
+		len -= ret;
+	}
+	close(fd);
+}
+
+/* Find the first placed node that ends after device block blk. */
+uint64_t find_placed(struct copy *c, uint64_t blk)
+{
+	uint64_t lo = 0, hi = c->nr_placed, mid;
+	struct node *node;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		node = c->placed[mid];
+		if (node->start + node->inode.nblocks <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Copy batches of the data region: each one is filled from every node it
+ * overlaps and written with a single pwrite.
+ */
+void *copy_worker(void *arg)
+{
+	struct copy *c = arg;
+	uint64_t batch, first, last, from, to, i;
+	struct node *node;
+	char *buf;
+
+	if (posix_memalign((void **) &buf, EZFS_BLOCK_SIZE,
+			BATCH_BLOCKS * EZFS_BLOCK_SIZE))
+		fail("Out of memory copying", "data");
+
+	for (;;) {
+		batch = __atomic_fetch_add(&c->next_batch, 1, __ATOMIC_RELAXED);
+		if (batch * BATCH_BLOCKS >= c->nr_blocks)
+			break;
+		first = c->data_start + batch * BATCH_BLOCKS;
+		last = first + BATCH_BLOCKS;
+		if (last > c->data_start + c->nr_blocks)
+			last = c->data_start + c->nr_blocks;
+
+		memset(buf, 0, (last - first) * EZFS_BLOCK_SIZE);
+		for (i = find_placed(c, first); i < c->nr_placed; ++i) {
+			node = c->placed[i];
+			if (node->start >= last)
+				break;
+			from = node->start > first ? node->start : first;
+			to = node->start + node->inode.nblocks;
+			if (to > last)
+				to = last;
+			copy_node(node, from, to - from,
+				buf + (from - first) * EZFS_BLOCK_SIZE);
+		}
+
+		if (pwrite(c->fd, buf, (last - first) * EZFS_BLOCK_SIZE,
+				first * EZFS_BLOCK_SIZE) !=
+				(ssize_t) ((last - first) * EZFS_BLOCK_SIZE))
+			fail("Cannot write data to", "the device");
+	}
+	free(buf);
+	return NULL;
+}
+
+void copy_data(struct copy *c, unsigned int threads)
+{
+	pthread_t tids[MAX_THREADS];
+	unsigned int i;
+
+	for (i = 0; i < threads; ++i)
+		if (pthread_create(&tids[i], NULL, copy_worker, c))
+			passert(0, "Start a copy thread");
+	for (i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+void usage(void)
+{
+	printf("Usage: ./format_disk_as_ezfs [OPTIONS] DEVICE_NAME [NUM_INODES]\n"
+		"  -N NUM       number of inodes\n"
+		"  -i BYTES     bytes per inode, if -N is not given (default %d)\n"
+		"  -b BLOCKS    size of the volume, if not the whole device\n"
+		"  -J BLOCKS    journal size, 0 for none\n"
+		"  -d DIR       populate the volume from DIR\n"
+		"  -E           leave the volume empty\n"
+		"  -t THREADS   threads walking DIR and writing data\n"
+		"  -D           write data with O_DIRECT\n"
+		"  -I           give every file data blocks, even tiny ones\n"
+		"Without -d or -E the volume gets the sample files.\n",
+		BYTES_PER_INODE);
+	exit(1);
+}
+
+void parse_options(int argc, char *argv[], struct options *o,
+		const char **device)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	memset(o, 0, sizeof(*o));
+	o->bytes_per_inode = BYTES_PER_INODE;
+	o->journal_blocks = -1;
+	o->threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+
+	while ((opt = getopt(argc, argv, "N:i:b:J:d:Et:DI")) != -1) {
+		switch (opt) {
+		case 'N':
+			o->nr_inodes = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			o->bytes_per_inode = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			o->nr_blocks = strtoull(optarg, NULL, 0);
+			break;
+		case 'J':
+			o->journal_blocks = strtoll(optarg, NULL, 0);
+			break;
+		case 'd':
+			o->source = optarg;
+			break;
+		case 'E':
+			o->empty = 1;
+			break;
+		case 't':
+			o->threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			o->direct = 1;
+			break;
+		case 'I':
+			o->no_inline = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	/* The inode count used to be the only option, given after the device. */
+	if (optind == argc - 2)
+		o->nr_inodes = strtoull(argv[argc - 1], NULL, 0);
+	else if (optind != argc - 1)
+		usage();
+	*device = argv[optind];
+
+	if (!o->bytes_per_inode || !o->threads || o->threads > MAX_THREADS ||
+			(o->source && o->empty))
+		usage();
+	if (o->journal_blocks > 0 &&
+			(uint64_t) o->journal_blocks < EZFS_JOURNAL_MIN_BLOCKS) {
+		printf("The journal needs at least %d blocks.\n",
+			(int) EZFS_JOURNAL_MIN_BLOCKS);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, dfd;
+	uint64_t i, nr_blocks, nr_inodes, nr_nodes = 1;
+	off_t size;
+	struct ezfs_super_block sb;
+	struct options opts;
+	struct layout l;
+	struct copy c;
+	struct node *root;
+	struct timespec t0, t1;
+	uint32_t *imap, *dmap;
+	char *itable;
+	const char *device;
+	char buf[EZFS_BLOCK_SIZE];
+
+	parse_options(argc, argv, &opts, &device);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	fd = open(device, O_RDWR);
 	if (fd == -1) {
 		perror("Error opening the device");
 		return -1;
 	}
 	memset(&sb, 0, sizeof(sb));
 
-	fp = open("./big_files/big_img.jpeg", O_RDWR);
-	if (fp == -1) {
-		perror("Error opening the image");
-		return -1;
+	size = lseek(fd, 0, SEEK_END);
+	passert(size > 0, "Find device size");
+	nr_blocks = size / EZFS_BLOCK_SIZE;
+	if (opts.nr_blocks) {
+		passert(opts.nr_blocks <= nr_blocks, "Volume fits on the device");
+		nr_blocks = opts.nr_blocks;
 	}
-	pret = read(fp, pbuf, EZFS_BLOCK_SIZE * 9);
-	close(fp);
-	passert(pret != -1, "Read big img contents");
 
-	fp = open("./big_files/big_txt.txt", O_RDWR);
-	if (fp == -1) {
-		perror("Error opening the txt");
-		return -1;
+	if (opts.source) {
+		root = walk_tree(opts.source, opts.threads, &nr_nodes);
+	} else if (opts.empty) {
+		root = node_new(S_IFDIR | 0777);
+	} else {
+		root = sample_tree();
+		nr_nodes = 6;
+	}
+
+	nr_inodes = opts.nr_inodes;
+	if (!nr_inodes) {
+		nr_inodes = nr_blocks * EZFS_BLOCK_SIZE / opts.bytes_per_inode;
+		if (nr_inodes < nr_nodes)
+			nr_inodes = nr_nodes;
 	}
-	bret = read(fp, bbuf, EZFS_BLOCK_SIZE * 2);
-	close(fp);
-	passert(bret != -1, "Read big txt contents");
+	passert(nr_inodes >= nr_nodes, "Enough inodes for the source tree");
 
-	sb.version = 1;
+	sb.version = EZFS_VERSION;
 	sb.magic = EZFS_MAGIC_NUMBER;
+	compute_geometry(&sb, nr_blocks, nr_inodes, opts.journal_blocks < 0 ?
+		journal_size(nr_blocks) : (uint64_t) opts.journal_blocks);
+	printf("%llu inodes in %llu blocks, %llu journal blocks, %llu data blocks from block %llu\n",
+		(unsigned long long) sb.nr_inodes,
+		(unsigned long long) sb.inode_table_blocks,
+		(unsigned long long) sb.journal_blocks,
+		(unsigned long long) sb.nr_data_blocks,
+		(unsigned long long) sb.data_start);
 
-	/* 1. inode1 and data_block_number 2 are taken by the root
-	 * 2. inode2 and data_block_number 3 are taken by hello.txt
-	 * 3. inode3 and data_block_number 4 are taken by subdir
-	 * 4. inode4 and data_block_number 5 are taken by subdir/names.txt
-	 * 5. inode5 and data_block_number 6-13 are taken by subdir/big_img.jpeg
-	 * 6. inode6 and data_block_number 14-15 are taken by subdir/big_txt.txt
-	 * Mark them as such.
+	/* Number every node and give it its blocks, the root first. */
+	memset(&l, 0, sizeof(l));
+	l.data_start = sb.data_start;
+	l.next_ino = EZFS_ROOT_INODE_NUMBER + 1;
+	l.inline_data = !opts.no_inline;
+	l.by_ino = xcalloc(nr_nodes, sizeof(*l.by_ino));
+	l.placed = xcalloc(nr_nodes, sizeof(*l.placed));
+	root->ino = EZFS_ROOT_INODE_NUMBER;
+	l.by_ino[0] = root;
+	layout_dir(&l, root);
+	passert(l.next_ino - EZFS_ROOT_INODE_NUMBER == nr_nodes,
+		"Number every file and directory");
+	passert(l.next_blk <= sb.nr_data_blocks, "Source tree fits on the device");
+
+	imap = xcalloc(sb.inode_bitmap_blocks, EZFS_BLOCK_SIZE);
+	dmap = xcalloc(sb.data_bitmap_blocks, EZFS_BLOCK_SIZE);
+	itable = xcalloc(DIV_ROUND_UP(nr_nodes, EZFS_INODES_PER_BLOCK),
+		EZFS_BLOCK_SIZE);
+
+	/* Inode i and data block i are taken for every i below the counts
+	 * in use. Data block numbers are relative to sb.data_start.
+	 */
+	for (i = 0; i < nr_nodes; ++i) {
+		SETBIT(imap, i);
+		memcpy(itable + i * EZFS_INODE_SIZE, &l.by_ino[i]->inode,
+			sizeof(struct ezfs_inode));
+	}
+	for (i = 0; i < l.next_blk; ++i)
+		SETBIT(dmap, i);
+
+	/* Write the superblock, the bitmaps and the whole inode table. Every
+	 * metadata block is written, so stale device contents never leak in.
+	 */
+	write_blocks(fd, EZFS_SUPERBLOCK_DATABLOCK_NUMBER, &sb, sizeof(sb),
+		"Write superblock");
+	write_blocks(fd, sb.inode_bitmap_start, imap,
+		sb.inode_bitmap_blocks * EZFS_BLOCK_SIZE, "Write inode bitmap");
+	write_blocks(fd, sb.data_bitmap_start, dmap,
+		sb.data_bitmap_blocks * EZFS_BLOCK_SIZE, "Write data bitmap");
+	write_blocks(fd, sb.inode_table_start, itable,
+		DIV_ROUND_UP(nr_nodes, EZFS_INODES_PER_BLOCK) * EZFS_BLOCK_SIZE,
+		"Write inode table");
+	if (sb.inode_table_blocks > DIV_ROUND_UP(nr_nodes, EZFS_INODES_PER_BLOCK))
+		zero_blocks(fd, sb.inode_table_start +
+			DIV_ROUND_UP(nr_nodes, EZFS_INODES_PER_BLOCK),
+			sb.inode_table_blocks -
+			DIV_ROUND_UP(nr_nodes, EZFS_INODES_PER_BLOCK),
+			"Zero the rest of the inode table");
+
+	/* An empty journal: the log starts at its block 1, which holds no
+	 * transaction 1.
 	 */
-	for (i = 0; i < 6; ++i)
-		SETBIT(sb.free_inodes, i);
-
-	for (i = 0; i < 14; ++i)
-		SETBIT(sb.free_data_blocks, i);
-
-	/* Write the superblock to the first block of the filesystem. */
-	ret = write(fd, (char *)&sb, sizeof(sb));
-	passert(ret == EZFS_BLOCK_SIZE, "Write superblock");
-
-	inode_reset(&inode);
-	inode.mode = S_IFDIR | 0777;
-	inode.nlink = 3; // add 1 to 2 because add another directory
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER;
-	inode.file_size = EZFS_BLOCK_SIZE;
-	inode.nblocks = 1;
-
-	/* Write the root inode starting in the second block. */
-	ret = write(fd, (char *)&inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write root inode");
-
-	/* The hello.txt file will take inode num following root inode num. */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 1;
-	inode.file_size = strlen(hello_contents);
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write hello.txt inode");
-
-	/* sub directory will take inode num following hello.txt inode num. */
-	inode_reset(&inode);
-	inode.mode = S_IFDIR | 0777;
-	inode.nlink = 2;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 2;
-	inode.file_size = EZFS_BLOCK_SIZE;
-	inode.nblocks = 1;
-
-	/* Write subdir inode */
-	ret = write(fd, (char *)&inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write subdir inode");
-
-	/* The names.txt file will take inode num following subdir inode num. */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 3;
-	inode.file_size = strlen(names_contents);
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write names.txt inode");
-
-	/* The big_img.jpeg file will take inode num following names.txt inode num. */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 4;
-	inode.file_size = pret;
-	inode.nblocks = IMG_BLK;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write big_img.jpeg inode");
-
-	/* The big_txt.txt file will take inode num following last inode=big_img.jpeg. */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 4 + IMG_BLK;
-	inode.file_size = bret;
-	inode.nblocks = TXT_BLK;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write big_txt.txt inode");
-
-	/* lseek to the next data block */
-	ret = lseek(fd, EZFS_BLOCK_SIZE - 6 * sizeof(struct ezfs_inode),
-		SEEK_CUR);
-	passert(ret >= 0, "Seek past inode table");
-
-	/* dentry for hello.txt */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "hello.txt", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 1;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for hello.txt");
-
-	/* dentry for subdir */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "subdir", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 2;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for subdir");
-
-	/* two entries: so 2 * sizeof() */
-	len = EZFS_BLOCK_SIZE - 2 * sizeof(struct ezfs_dir_entry);
-	ret = write(fd, zeroes, len);
-	passert(ret == len, "Pad to end of root dentries");
-
-	/* hello.txt contents */
-	len = strlen(hello_contents);
-	strncpy(buf, hello_contents, len);
-	ret = write(fd, buf, len);
-	passert(ret == len, "Write hello.txt contents");
-
-	/* lseek to the next file block */
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len, SEEK_CUR);
-	passert(ret >= 0, "Seek to next file block");
-
-	/* names.txt dentry */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "names.txt", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 3;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for names.txt");
-
-	/* big_img.jpeg dentry */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "big_img.jpeg", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 4;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for big_img.jpeg");
-
-	/* big_txt.txt dentry */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "big_txt.txt", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 5;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for big_txt.txt");
-
-	/* end subdir: contains names.txt, big_img.jpeg, big_txt.txt */
-	len = EZFS_BLOCK_SIZE - 3 * sizeof(struct ezfs_dir_entry);
-	ret = write(fd, zeroes, len);
-	passert(ret == len, "Pad to end of subdir dentries");
-
-	/* names.txt contents */
-	len = strlen(names_contents);
-	strncpy(buf, names_contents, len);
-	ret = write(fd, buf, len);
-	passert(ret == len, "Write names.txt contents");
-
-	/* lseek to the next file block after names.txt for big_img.jpeg */
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len, SEEK_CUR);
-	passert(ret >= 0, "Seek to next file block for big_img.jpeg");
-
-	/* big img contents */
-	ret = write(fd, pbuf, pret);
-	passert(ret == pret, "Write big_img.jpeg contents");
-
-	/* lseek to the next file block after big_img.jpeg for big_txt.txt*/
-	ret = lseek(fd, EZFS_BLOCK_SIZE * IMG_BLK - pret, SEEK_CUR);
-	passert(ret >= 0, "Seek to next file block for big_txt.txt");
-
-	/* big txt contents */
-	ret = write(fd, bbuf, bret);
-	passert(ret == bret, "Write big_txt.txt contents");
-
-	ret = fsync(fd);
-	passert(ret == 0, "Flush writes to disk");
+	if (sb.journal_blocks) {
+		struct ezfs_journal_super *jsb = (struct ezfs_journal_super *) buf;
+
+		memset(buf, 0, sizeof(buf));
+		jsb->h.magic = EZFS_JOURNAL_MAGIC;
+		jsb->h.type = EZFS_JOURNAL_SUPER;
+		jsb->h.sequence = 1;
+		jsb->start = 1;
+		jsb->nr_blocks = sb.journal_blocks;
+		write_blocks(fd, sb.journal_start, buf, EZFS_BLOCK_SIZE,
+			"Write journal superblock");
+		memset(buf, 0, sizeof(buf));
+		write_blocks(fd, sb.journal_start + 1, buf, EZFS_BLOCK_SIZE,
+			"Clear the start of the log");
+	}
+
+	/* Directory blocks and file contents, in device order. */
+	dfd = fd;
+	if (opts.direct) {
+		dfd = open(device, O_RDWR | O_DIRECT);
+		if (dfd == -1) {
+			perror("Cannot open the device for O_DIRECT, writing through the page cache");
+			dfd = fd;
+		}
+	}
+	memset(&c, 0, sizeof(c));
+	c.fd = dfd;
+	c.data_start = sb.data_start;
+	c.nr_blocks = l.next_blk;
+	c.placed = l.placed;
+	c.nr_placed = l.nr_placed;
+	copy_data(&c, opts.threads);
+	passert(1, "Write directories and file contents");
+
+	passert(fsync(dfd) == 0 && fsync(fd) == 0, "Flush writes to disk");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%llu inodes and %llu data blocks in use after %.2fs\n",
+		(unsigned long long) nr_nodes, (unsigned long long) l.next_blk,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
 
+	free(imap);
+	free(dmap);
+	free(itable);
+	if (dfd != fd)
+		close(dfd);
 	close(fd);
-	printf("Device [%s] formatted successfully.\n", argv[1]);
+	printf("Device [%s] formatted successfully.\n", device);
 
 	return 0;
 }
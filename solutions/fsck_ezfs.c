@@ -0,0 +1,1098 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* These are the same on a 64-bit architecture */
+#define timespec64 timespec
+
+#include "ezfs.h"
+
+/* fsck.ezfs maps the whole volume and checks it in passes:
+ *
+ *  0. the superblock geometry,
+ *  1. replay of the journal, as a mount would do it,
+ *  2. every in-use inode and its extents, rebuilding the data bitmap,
+ *  3. every directory, counting the entries that name each inode and
+ *     rebuilding a corrupt hash index,
+ *  4. that every directory hangs off the root, and the link counts,
+ *  5. the rebuilt bitmaps against the ones on disk.
+ *
+ * Passes 2 and 3 split the inode table between threads. Without -y the
+ * mapping is private, so replay and repairs only happen in memory and the
+ * device is never written.
+ */
+
+#define MAX_THREADS 64
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* Exit codes, as for e2fsck */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/* fsck.state[] */
+#define INODE_BAD 0x1 /* In use but unusable; gets cleared */
+#define INODE_ATTACHED 0x2 /* Reachable from the root */
+#define INODE_UNATTACHED 0x4
+#define INODE_VISITING 0x8
+#define INODE_BAD_INDEX 0x10 /* Leaves are scanned without the index */
+
+struct fsck {
+	char *img;
+	uint64_t size;
+	struct ezfs_super_block *sb;
+	uint32_t *imap, *dmap; /* The bitmaps on disk */
+
+	uint32_t *used; /* Data blocks claimed by an extent, rebuilt */
+	uint32_t *refs; /* Entries naming each inode */
+	uint32_t *subdirs; /* Entries of each directory naming a directory */
+	uint32_t *parent; /* Directory naming each directory */
+	uint8_t *state;
+
+	int repair;
+	unsigned int threads;
+	uint64_t errors, fixed;
+};
+
+static struct fsck f;
+
+/* Reports a problem. Returns whether to fix it, which is the case with -y;
+ * otherwise it stays an uncorrected error.
+ */
+static int problem(int fixable, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int problem(int fixable, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	__atomic_add_fetch(&f.errors, 1, __ATOMIC_RELAXED);
+	if (fixable && f.repair) {
+		__atomic_add_fetch(&f.fixed, 1, __ATOMIC_RELAXED);
+		printf("%s: fixed\n", msg);
+		return 1;
+	}
+	printf("%s%s\n", msg, fixable ? "" : ": not fixable");
+	return 0;
+}
+
+static void die(const char *message)
+{
+	printf("%s\n", message);
+	exit(FSCK_ERROR);
+}
+
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+
+	if (!p)
+		die("Out of memory");
+	return p;
+}
+
+static inline char *block(uint64_t blk)
+{
+	return f.img + blk * EZFS_BLOCK_SIZE;
+}
+
+static inline struct ezfs_inode *inode_of(uint64_t ino)
+{
+	return (struct ezfs_inode *) (block(f.sb->inode_table_start) +
+		(ino - EZFS_ROOT_INODE_NUMBER) * EZFS_INODE_SIZE);
+}
+
+static inline int in_use(uint64_t ino)
+{
+	return IS_SET(f.imap, ino - EZFS_ROOT_INODE_NUMBER) != 0;
+}
+
+static inline int is_data_block(uint64_t blk)
+{
+	return blk >= f.sb->data_start &&
+		blk < f.sb->data_start + f.sb->nr_data_blocks;
+}
+
+static inline void clear_bit_atomic(uint32_t *map, uint64_t bit)
+{
+	__atomic_fetch_and(&map[bit / 32], ~(1u << (bit % 32)),
+		__ATOMIC_RELAXED);
+}
+
+/* Runs fn on [lo, hi) slices of the inode numbers, one thread each. */
+struct slice {
+	pthread_t tid;
+	uint64_t lo, hi;
+	void (*fn)(uint64_t ino);
+};
+
+static void *slice_worker(void *arg)
+{
+	struct slice *s = arg;
+	uint64_t ino;
+
+	for (ino = s->lo; ino < s->hi; ++ino)
+		if (in_use(ino))
+			s->fn(ino);
+	return NULL;
+}
+
+static void for_each_inode(void (*fn)(uint64_t ino))
+{
+	struct slice s[MAX_THREADS];
+	uint64_t n = f.sb->nr_inodes;
+	unsigned int i;
+
+	for (i = 0; i < f.threads; ++i) {
+		s[i].lo = EZFS_ROOT_INODE_NUMBER + n * i / f.threads;
+		s[i].hi = EZFS_ROOT_INODE_NUMBER + n * (i + 1) / f.threads;
+		s[i].fn = fn;
+		if (pthread_create(&s[i].tid, NULL, slice_worker, &s[i]))
+			die("Cannot start a checker thread");
+	}
+	for (i = 0; i < f.threads; ++i)
+		pthread_join(s[i].tid, NULL);
+}
+
+/* ezfs superblock */
+static void check_super(void)
+{
+	struct ezfs_super_block *sb = f.sb;
+
+	if (f.size < EZFS_BLOCK_SIZE || sb->magic != EZFS_MAGIC_NUMBER)
+		die("Not an ezfs volume");
+	if (sb->version != EZFS_VERSION) {
+		printf("Format version %llu, fsck.ezfs checks version %d\n",
+			(unsigned long long) sb->version, EZFS_VERSION);
+		exit(FSCK_ERROR);
+	}
+	if (sb->nr_blocks > f.size / EZFS_BLOCK_SIZE)
+		die("The volume is larger than the device");
+	if (sb->inode_bitmap_start != EZFS_SUPERBLOCK_DATABLOCK_NUMBER + 1 ||
+			sb->data_bitmap_start != sb->inode_bitmap_start +
+				sb->inode_bitmap_blocks ||
+			sb->inode_table_start != sb->data_bitmap_start +
+				sb->data_bitmap_blocks ||
+			sb->journal_start != sb->inode_table_start +
+				sb->inode_table_blocks ||
+			sb->data_start != sb->journal_start + sb->journal_blocks)
+		die("Superblock regions are out of order");
+	if (sb->nr_inodes == 0 || sb->nr_inodes >= UINT32_MAX ||
+			sb->nr_inodes > sb->inode_table_blocks * EZFS_INODES_PER_BLOCK ||
+			sb->nr_inodes > sb->inode_bitmap_blocks * EZFS_BITS_PER_BLOCK)
+		die("Superblock inode count does not fit the inode table");
+	if (sb->nr_data_blocks > sb->data_bitmap_blocks * EZFS_BITS_PER_BLOCK ||
+			sb->data_start + sb->nr_data_blocks > sb->nr_blocks)
+		die("Superblock data block count does not fit the volume");
+	if (sb->journal_blocks && sb->journal_blocks < EZFS_JOURNAL_MIN_BLOCKS)
+		die("Superblock journal is too small");
+}
+
+/* ezfs journal */
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+/* The kernel's crc32_le(): no inversion on the way in or out. */
+static uint32_t crc32_le(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+struct revoke {
+	uint64_t blocknr;
+	uint64_t sequence;
+};
+
+struct recovery {
+	uint64_t end, last;
+	struct revoke *revoke;
+	size_t nr_revoke, max_revoke;
+};
+
+static inline uint64_t journal_next(uint64_t pos)
+{
+	return pos + 1 == f.sb->journal_blocks ? 1 : pos + 1;
+}
+
+static int revoke_cmp(const void *a, const void *b)
+{
+	const struct revoke *ra = a, *rb = b;
+
+	if (ra->blocknr != rb->blocknr)
+		return ra->blocknr < rb->blocknr ? -1 : 1;
+	return ra->sequence < rb->sequence ? -1 : ra->sequence > rb->sequence;
+}
+
+static int revoke_find(const void *key, const void *elt)
+{
+	uint64_t blocknr = *(const uint64_t *) key;
+	const struct revoke *r = elt;
+
+	return blocknr < r->blocknr ? -1 : blocknr > r->blocknr;
+}
+
+/* Same walk as ezfs_journal_scan(): a first pass finds the complete
+ * transactions and their revokes, a second copies their blocks home.
+ */
+static void journal_scan(struct recovery *rc, uint64_t pos, uint64_t seq,
+		int replay)
+{
+	uint64_t first = f.sb->journal_start, walked, home;
+	struct ezfs_journal_header *h;
+	struct ezfs_journal_desc *desc;
+	struct revoke *r;
+	size_t nr_revoke;
+	unsigned int i;
+	uint32_t crc;
+
+	for (; !replay || seq < rc->last; seq++) {
+		crc = ~0U;
+		nr_revoke = rc->nr_revoke;
+		for (walked = 0; walked < f.sb->journal_blocks - 1; walked++) {
+			h = (struct ezfs_journal_header *) block(first + pos);
+			if (h->magic != EZFS_JOURNAL_MAGIC || h->sequence != seq ||
+					(h->type != EZFS_JOURNAL_DESC &&
+					 h->type != EZFS_JOURNAL_COMMIT))
+				goto incomplete;
+			pos = journal_next(pos);
+			if (h->type == EZFS_JOURNAL_COMMIT) {
+				if (((struct ezfs_journal_commit *) h)->checksum != crc)
+					goto incomplete;
+				break;
+			}
+
+			desc = (struct ezfs_journal_desc *) h;
+			if (desc->nr_tags > EZFS_JOURNAL_TAGS)
+				goto incomplete;
+			crc = crc32_le(crc, h, EZFS_BLOCK_SIZE);
+			for (i = 0; i < desc->nr_tags; i++) {
+				home = desc->tags[i].blocknr;
+				if (desc->tags[i].flags & EZFS_JTAG_REVOKE) {
+					if (replay)
+						continue;
+					if (rc->nr_revoke == rc->max_revoke) {
+						rc->max_revoke = rc->max_revoke ?
+							2 * rc->max_revoke : 64;
+						rc->revoke = realloc(rc->revoke,
+							rc->max_revoke * sizeof(*r));
+						if (!rc->revoke)
+							die("Out of memory");
+					}
+					rc->revoke[rc->nr_revoke].blocknr = home;
+					rc->revoke[rc->nr_revoke++].sequence = seq;
+					continue;
+				}
+
+				crc = crc32_le(crc, block(first + pos),
+					EZFS_BLOCK_SIZE);
+				if (replay) {
+					r = bsearch(&home, rc->revoke, rc->nr_revoke,
+						sizeof(*r), revoke_find);
+					if (home >= f.sb->nr_blocks || (home >= first &&
+							home < f.sb->data_start))
+						die("Journal names a block outside the volume");
+					if (!r || r->sequence < seq)
+						memcpy(block(home), block(first + pos),
+							EZFS_BLOCK_SIZE);
+				}
+				pos = journal_next(pos);
+			}
+		}
+		if (walked == f.sb->journal_blocks - 1)
+			goto incomplete;
+		rc->end = pos;
+	}
+	return;
+
+incomplete:
+	rc->nr_revoke = nr_revoke;
+	if (!replay)
+		rc->last = seq;
+}
+
+static void replay_journal(void)
+{
+	struct ezfs_journal_super *jsb;
+	struct recovery rc;
+	size_t i, n;
+
+	if (!f.sb->journal_blocks)
+		return;
+	jsb = (struct ezfs_journal_super *) block(f.sb->journal_start);
+	if (jsb->h.magic != EZFS_JOURNAL_MAGIC ||
+			jsb->h.type != EZFS_JOURNAL_SUPER ||
+			jsb->nr_blocks != f.sb->journal_blocks ||
+			jsb->start == 0 || jsb->start >= f.sb->journal_blocks)
+		die("Journal superblock is corrupt");
+
+	memset(&rc, 0, sizeof(rc));
+	rc.end = jsb->start;
+	journal_scan(&rc, jsb->start, jsb->h.sequence, 0);
+	if (rc.last == jsb->h.sequence)
+		return;
+
+	qsort(rc.revoke, rc.nr_revoke, sizeof(*rc.revoke), revoke_cmp);
+	for (i = n = 0; i < rc.nr_revoke; i++) {
+		if (n && rc.revoke[n - 1].blocknr == rc.revoke[i].blocknr)
+			n--;
+		rc.revoke[n++] = rc.revoke[i];
+	}
+	rc.nr_revoke = n;
+	journal_scan(&rc, jsb->start, jsb->h.sequence, 1);
+
+	printf("Replayed journal transactions %llu to %llu%s\n",
+		(unsigned long long) jsb->h.sequence,
+		(unsigned long long) rc.last - 1,
+		f.repair ? "" : " in memory");
+	jsb->start = rc.end;
+	jsb->h.sequence = rc.last;
+	free(rc.revoke);
+}
+
+/* ezfs inodes */
+static inline struct ezfs_extent *extent_at(struct ezfs_inode *inode,
+		uint32_t i)
+{
+	if (i < EZFS_INLINE_EXTENTS)
+		return &inode->extents[i];
+	return (struct ezfs_extent *) block(inode->extent_block) + i -
+		EZFS_INLINE_EXTENTS;
+}
+
+/* Device block backing logical block lblk of inode, 0 in a hole. */
+static uint64_t map_block(struct ezfs_inode *inode, uint32_t lblk)
+{
+	struct ezfs_extent *ext;
+	uint32_t i;
+
+	for (i = 0; i < inode->nr_extents; ++i) {
+		ext = extent_at(inode, i);
+		if (lblk < ext->ee_block)
+			break;
+		if (lblk < ext->ee_block + ext->ee_len)
+			return ext->ee_start + lblk - ext->ee_block;
+	}
+	return 0;
+}
+
+static inline void claim(uint64_t ino, uint64_t blk)
+{
+	uint64_t bit = blk - f.sb->data_start;
+	uint32_t mask = 1u << (bit % 32);
+
+	if (__atomic_fetch_or(&f.used[bit / 32], mask, __ATOMIC_RELAXED) & mask)
+		problem(0, "Inode %llu: block %llu is in use more than once",
+			(unsigned long long) ino, (unsigned long long) blk);
+}
+
+static inline void unclaim(uint64_t blk)
+{
+	clear_bit_atomic(f.used, blk - f.sb->data_start);
+}
+
+/* Whether the block map of inode is sound: extents sorted, disjoint and
+ * inside the data region.
+ */
+static int check_extents(struct ezfs_inode *inode)
+{
+	struct ezfs_extent *ext;
+	uint64_t end = 0;
+	uint32_t i;
+
+	if (inode->nr_extents > EZFS_MAX_EXTENTS)
+		return 0;
+	/* An overflow block, needed or not, must be a data block */
+	if ((inode->nr_extents > EZFS_INLINE_EXTENTS || inode->extent_block) &&
+			!is_data_block(inode->extent_block))
+		return 0;
+
+	for (i = 0; i < inode->nr_extents; ++i) {
+		ext = extent_at(inode, i);
+		if (!ext->ee_len || ext->ee_block < end ||
+				!is_data_block(ext->ee_start) ||
+				!is_data_block(ext->ee_start + ext->ee_len - 1))
+			return 0;
+		end = (uint64_t) ext->ee_block + ext->ee_len;
+	}
+	return 1;
+}
+
+/* Whether an inline file is sound: a regular file without a block map,
+ * small enough for i_data. Stray bytes past its size are dropped.
+ */
+static int check_inline(uint64_t ino, struct ezfs_inode *inode)
+{
+	uint64_t i;
+
+	if (!S_ISREG(inode->mode) || inode->nr_extents ||
+			inode->extent_block ||
+			inode->file_size > EZFS_INLINE_DATA_SIZE)
+		return 0;
+	for (i = inode->file_size; i < EZFS_INLINE_DATA_SIZE; ++i)
+		if (inode->i_data[i])
+			break;
+	if (i < EZFS_INLINE_DATA_SIZE &&
+			problem(1, "Inode %llu: inline data past EOF",
+				(unsigned long long) ino))
+		memset(inode->i_data + inode->file_size, 0,
+			EZFS_INLINE_DATA_SIZE - inode->file_size);
+	return 1;
+}
+
+static void pass_inodes(uint64_t ino)
+{
+	struct ezfs_inode *inode = inode_of(ino);
+	uint64_t nblocks, blk;
+	uint32_t i;
+
+	if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode)) {
+		f.state[ino] |= INODE_BAD;
+		return;
+	}
+	if (inode->flags & EZFS_INLINE_DATA_FL) {
+		if (!check_inline(ino, inode)) {
+			problem(1, "Inode %llu: corrupt inline data, clearing it",
+				(unsigned long long) ino);
+			f.state[ino] |= INODE_BAD;
+			return;
+		}
+		if (inode->nblocks &&
+				problem(1, "Inode %llu: block count %llu, should be 0",
+					(unsigned long long) ino,
+					(unsigned long long) inode->nblocks))
+			inode->nblocks = 0;
+		return;
+	}
+	if (!check_extents(inode)) {
+		problem(1, "Inode %llu: corrupt block map, clearing it",
+			(unsigned long long) ino);
+		f.state[ino] |= INODE_BAD;
+		return;
+	}
+	if (S_ISDIR(inode->mode) && (!inode->file_size ||
+			inode->file_size % EZFS_BLOCK_SIZE)) {
+		problem(1, "Directory %llu: bad size %llu, clearing it",
+			(unsigned long long) ino,
+			(unsigned long long) inode->file_size);
+		f.state[ino] |= INODE_BAD;
+		return;
+	}
+
+	nblocks = inode->extent_block ? 1 : 0;
+	if (inode->extent_block)
+		claim(ino, inode->extent_block);
+	for (i = 0; i < inode->nr_extents; ++i) {
+		for (blk = 0; blk < extent_at(inode, i)->ee_len; ++blk)
+			claim(ino, extent_at(inode, i)->ee_start + blk);
+		nblocks += extent_at(inode, i)->ee_len;
+	}
+	if (inode->nblocks != nblocks &&
+			problem(1, "Inode %llu: block count %llu, should be %llu",
+				(unsigned long long) ino,
+				(unsigned long long) inode->nblocks,
+				(unsigned long long) nblocks))
+		inode->nblocks = nblocks;
+}
+
+/* ezfs directories */
+
+/* Calls fn on every block of dir that lookups look for entries in. */
+typedef void (*leaf_fn)(uint64_t dir, char *leaf, uint32_t lblk);
+
+static void for_each_leaf(uint64_t dir, leaf_fn fn)
+{
+	struct ezfs_inode *inode = inode_of(dir);
+	uint32_t lblk, first = 0, last = 1;
+	uint64_t blk;
+
+	if (inode->flags & EZFS_INDEXED_DIR_FL) {
+		first = 1;
+		last = inode->file_size / EZFS_BLOCK_SIZE;
+	}
+
+	for (lblk = first; lblk < last; ++lblk) {
+		blk = map_block(inode, lblk);
+		if (blk)
+			fn(dir, block(blk), lblk);
+	}
+}
+
+/* Whether the record at off of a leaf stays inside it and is long enough
+ * for its entry. This must match the kernel's ezfs_entry_valid().
+ */
+static int record_valid(struct ezfs_dir_entry *de, unsigned int off)
+{
+	unsigned int need = sizeof(*de);
+
+	if (de->inode_no) {
+		if (!de->name_len)
+			return 0;
+		need = EZFS_DIR_REC_LEN(de->name_len);
+	}
+	return de->rec_len >= need && !(de->rec_len % EZFS_DIR_ALIGN) &&
+		de->rec_len <= EZFS_BLOCK_SIZE - off;
+}
+
+static void leaf_init(char *leaf)
+{
+	memset(leaf, 0, EZFS_BLOCK_SIZE);
+	((struct ezfs_dir_entry *) leaf)->rec_len = EZFS_BLOCK_SIZE;
+}
+
+/* Whether the entry de of a leaf can stay. */
+static int check_entry(uint64_t dir, struct ezfs_dir_entry *de, uint32_t lblk,
+		unsigned int off)
+{
+	uint64_t ino = de->inode_no;
+
+	if (memchr(de->name, '/', de->name_len) ||
+			memchr(de->name, '\0', de->name_len) ||
+			(de->name[0] == '.' && (de->name_len == 1 ||
+				(de->name_len == 2 && de->name[1] == '.')))) {
+		problem(1, "Directory %llu: entry at byte %u of block %u has a bad name",
+			(unsigned long long) dir, off, lblk);
+		return 0;
+	}
+	if (ino <= EZFS_ROOT_INODE_NUMBER ||
+			ino >= EZFS_ROOT_INODE_NUMBER + f.sb->nr_inodes ||
+			!in_use(ino) || (f.state[ino] & INODE_BAD)) {
+		problem(1, "Directory %llu: entry '%.*s' names bad inode %llu",
+			(unsigned long long) dir, de->name_len, de->name,
+			(unsigned long long) ino);
+		return 0;
+	}
+	return 1;
+}
+
+/* Checks the records of one leaf of dir and counts its entries towards the
+ * link counts. A bad entry's record goes to the one before it, as in the
+ * kernel; a corrupt record cuts the leaf short.
+ */
+static void check_leaf(uint64_t dir, char *leaf, uint32_t lblk)
+{
+	struct ezfs_inode *inode = inode_of(dir);
+	struct ezfs_dir_index *index = NULL;
+	struct ezfs_dir_entry *de, *prev = NULL;
+	unsigned int off, prev_off = 0;
+	uint32_t hash, expected;
+	uint64_t ino;
+
+	if ((inode->flags & EZFS_INDEXED_DIR_FL) &&
+			!(f.state[dir] & INODE_BAD_INDEX))
+		index = (struct ezfs_dir_index *) block(map_block(inode, 0));
+
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = (struct ezfs_dir_entry *) (leaf + off);
+		if (!record_valid(de, off)) {
+			if (problem(1, "Directory %llu: corrupt record at byte %u of block %u, dropping the rest of the block",
+					(unsigned long long) dir, off, lblk)) {
+				if (prev)
+					prev->rec_len = EZFS_BLOCK_SIZE - prev_off;
+				else
+					leaf_init(leaf);
+			}
+			return;
+		}
+		if (!de->inode_no)
+			goto next;
+
+		if (!check_entry(dir, de, lblk, off)) {
+			if (f.repair)
+				goto drop;
+			goto next;
+		}
+		ino = de->inode_no;
+
+		hash = ezfs_name_hash(de->name, de->name_len);
+		if (de->name_hash != hash &&
+				problem(1, "Directory %llu: entry '%.*s' has a stale hash",
+					(unsigned long long) dir, de->name_len,
+					de->name))
+			de->name_hash = hash;
+		if (de->file_type &&
+				de->file_type != EZFS_FT(inode_of(ino)->mode) &&
+				problem(1, "Directory %llu: entry '%.*s' has the wrong file type",
+					(unsigned long long) dir, de->name_len,
+					de->name))
+			de->file_type = EZFS_FT(inode_of(ino)->mode);
+		if (index && index->leaf[index->depth ?
+				hash >> (32 - index->depth) : 0] != lblk)
+			problem(0, "Directory %llu: entry '%.*s' is in the wrong leaf",
+				(unsigned long long) dir, de->name_len, de->name);
+
+		if (S_ISDIR(inode_of(ino)->mode)) {
+			expected = 0;
+			if (!__atomic_compare_exchange_n(&f.parent[ino],
+					&expected, (uint32_t) dir, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				if (problem(1, "Directory %llu: entry '%.*s' links directory %llu a second time",
+						(unsigned long long) dir,
+						de->name_len, de->name,
+						(unsigned long long) ino))
+					goto drop;
+				goto next;
+			}
+			__atomic_add_fetch(&f.subdirs[dir], 1, __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&f.refs[ino], 1, __ATOMIC_RELAXED);
+		goto next;
+drop:
+		if (prev) {
+			prev->rec_len += de->rec_len;
+			de = prev;
+			off = prev_off;
+			continue;
+		}
+		de->inode_no = 0;
+next:
+		prev = de;
+		prev_off = off;
+	}
+}
+
+static int check_index(struct ezfs_inode *inode)
+{
+	struct ezfs_dir_index *index;
+	uint32_t nblocks = inode->file_size / EZFS_BLOCK_SIZE, i;
+
+	index = (struct ezfs_dir_index *) block(map_block(inode, 0));
+	if (index->depth > EZFS_DIR_MAX_DEPTH)
+		return 0;
+	for (i = 0; i < (1u << index->depth); ++i)
+		if (!index->leaf[i] || index->leaf[i] >= nblocks ||
+				index->leaf_depth[i] > index->depth)
+			return 0;
+	return 1;
+}
+
+/* A corrupt index is rebuilt the way mkfs.ezfs lays out a directory: the
+ * entries of all leaves, sorted by hash, are split on the next hash bit
+ * until every part fits a leaf.
+ */
+struct dir_leaf {
+	unsigned int lo, hi; /* Range of the entries sorted by hash */
+	uint32_t prefix; /* Top depth bits of their hashes */
+	unsigned int depth;
+};
+
+struct hashed_entry {
+	uint32_t hash;
+	unsigned int rec_len;
+	struct ezfs_dir_entry *de;
+};
+
+static int cmp_hash(const void *a, const void *b)
+{
+	uint32_t x = ((const struct hashed_entry *) a)->hash;
+	uint32_t y = ((const struct hashed_entry *) b)->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Covers the entries in [lo, hi) of he, whose hashes share their top depth
+ * bits, with leaves. Returns the number of leaves so far, 0 if some part
+ * does not fit even at EZFS_DIR_MAX_DEPTH.
+ */
+static unsigned int dir_split(struct hashed_entry *he, unsigned int lo,
+		unsigned int hi, uint32_t prefix, unsigned int depth,
+		struct dir_leaf *leaves, unsigned int nr)
+{
+	unsigned int mid, bytes = 0;
+
+	for (mid = lo; mid < hi; ++mid)
+		bytes += he[mid].rec_len;
+	if (bytes <= EZFS_BLOCK_SIZE) {
+		leaves[nr].lo = lo;
+		leaves[nr].hi = hi;
+		leaves[nr].prefix = prefix;
+		leaves[nr].depth = depth;
+		return nr + 1;
+	}
+	if (depth == EZFS_DIR_MAX_DEPTH)
+		return 0;
+
+	for (mid = lo; mid < hi; ++mid)
+		if (he[mid].hash & (1u << (31 - depth)))
+			break;
+	nr = dir_split(he, lo, mid, prefix << 1, depth + 1, leaves, nr);
+	if (!nr)
+		return 0;
+	return dir_split(he, mid, hi, (prefix << 1) | 1, depth + 1, leaves,
+		nr);
+}
+
+static void leaf_fill(char *leaf, struct hashed_entry *he, unsigned int nr)
+{
+	struct ezfs_dir_entry *de = NULL;
+	unsigned int i, off = 0;
+
+	leaf_init(leaf);
+	for (i = 0; i < nr; off += he[i++].rec_len) {
+		de = (struct ezfs_dir_entry *) (leaf + off);
+		memcpy(de, he[i].de, he[i].rec_len);
+		de->name_hash = he[i].hash;
+		de->rec_len = he[i].rec_len;
+	}
+	if (de)
+		de->rec_len = EZFS_BLOCK_SIZE - ((char *) de - leaf);
+}
+
+/* Whether the entries in the leaves of dir, which has no holes, fit under a
+ * new index in the blocks it has. With write, lays them out there.
+ */
+static int rebuild_index(uint64_t dir, int write)
+{
+	struct ezfs_inode *inode = inode_of(dir);
+	uint32_t nblocks = inode->file_size / EZFS_BLOCK_SIZE, lblk;
+	struct ezfs_dir_index *index;
+	struct ezfs_dir_entry *de;
+	struct hashed_entry *he;
+	struct dir_leaf *leaves;
+	unsigned int i, j, off, slot, nr, n = 0, depth = 0;
+	char *copy;
+
+	copy = xcalloc(nblocks, EZFS_BLOCK_SIZE);
+	he = xcalloc((size_t) nblocks * EZFS_BLOCK_SIZE / EZFS_DIR_REC_LEN(1),
+		sizeof(*he));
+	leaves = xcalloc(EZFS_DIR_INDEX_SLOTS, sizeof(*leaves));
+	for (lblk = 1; lblk < nblocks; ++lblk) {
+		memcpy(copy + lblk * EZFS_BLOCK_SIZE,
+			block(map_block(inode, lblk)), EZFS_BLOCK_SIZE);
+		for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+			de = (struct ezfs_dir_entry *)
+				(copy + lblk * EZFS_BLOCK_SIZE + off);
+			if (!record_valid(de, off))
+				break;
+			if (!de->inode_no)
+				continue;
+			he[n].de = de;
+			he[n].hash = ezfs_name_hash(de->name, de->name_len);
+			he[n++].rec_len = EZFS_DIR_REC_LEN(de->name_len);
+		}
+	}
+	qsort(he, n, sizeof(*he), cmp_hash);
+
+	nr = dir_split(he, 0, n, 0, 0, leaves, 0);
+	if (!nr || nr >= nblocks)
+		nr = 0;
+	if (!nr || !write)
+		goto out;
+
+	for (i = 0; i < nr; ++i)
+		if (leaves[i].depth > depth)
+			depth = leaves[i].depth;
+	index = (struct ezfs_dir_index *) block(map_block(inode, 0));
+	memset(index, 0, EZFS_BLOCK_SIZE);
+	index->depth = depth;
+	for (i = 0; i < nr; ++i) {
+		slot = leaves[i].prefix << (depth - leaves[i].depth);
+		for (j = 0; j < 1u << (depth - leaves[i].depth); ++j) {
+			index->leaf[slot + j] = 1 + i;
+			index->leaf_depth[slot + j] = leaves[i].depth;
+		}
+		leaf_fill(block(map_block(inode, 1 + i)), he + leaves[i].lo,
+			leaves[i].hi - leaves[i].lo);
+	}
+	for (lblk = 1 + nr; lblk < nblocks; ++lblk)
+		leaf_init(block(map_block(inode, lblk)));
+out:
+	free(leaves);
+	free(he);
+	free(copy);
+	return nr != 0;
+}
+
+static void pass_dirs(uint64_t ino)
+{
+	struct ezfs_inode *inode = inode_of(ino);
+	uint32_t lblk, nblocks;
+	int hole = 0;
+
+	if (!S_ISDIR(inode->mode) || (f.state[ino] & INODE_BAD))
+		return;
+
+	/* The leaves around a hole are still checked, for their entries to
+	 * count towards the link counts.
+	 */
+	nblocks = inode->file_size / EZFS_BLOCK_SIZE;
+	for (lblk = 0; lblk < nblocks; ++lblk) {
+		if (!map_block(inode, lblk)) {
+			problem(0, "Directory %llu: block %u is a hole",
+				(unsigned long long) ino, lblk);
+			hole = 1;
+			break;
+		}
+	}
+	if ((inode->flags & EZFS_INDEXED_DIR_FL) &&
+			(!map_block(inode, 0) || !check_index(inode)))
+		__atomic_fetch_or(&f.state[ino], INODE_BAD_INDEX,
+			__ATOMIC_RELAXED);
+
+	for_each_leaf(ino, check_leaf);
+
+	if ((f.state[ino] & INODE_BAD_INDEX) &&
+			problem(!hole && rebuild_index(ino, 0),
+				"Directory %llu: corrupt hash index",
+				(unsigned long long) ino))
+		rebuild_index(ino, 1);
+}
+
+/* ezfs connectivity */
+static int attached(uint64_t ino)
+{
+	uint64_t p;
+
+	if (ino == EZFS_ROOT_INODE_NUMBER)
+		return 1;
+	if (f.state[ino] & (INODE_ATTACHED | INODE_UNATTACHED))
+		return f.state[ino] & INODE_ATTACHED;
+	if (f.state[ino] & INODE_VISITING) /* A loop of directories */
+		return 0;
+
+	f.state[ino] |= INODE_VISITING;
+	p = f.parent[ino];
+	f.state[ino] |= p && attached(p) ? INODE_ATTACHED : INODE_UNATTACHED;
+	f.state[ino] &= ~INODE_VISITING;
+	return f.state[ino] & INODE_ATTACHED;
+}
+
+/* Takes back what check_leaf() counted for leaf. */
+static void drop_leaf(uint64_t dir, char *leaf, uint32_t lblk)
+{
+	struct ezfs_dir_entry *de;
+	unsigned int off;
+	uint64_t ino;
+
+	(void) dir;
+	(void) lblk;
+
+	for (off = 0; off < EZFS_BLOCK_SIZE; off += de->rec_len) {
+		de = (struct ezfs_dir_entry *) (leaf + off);
+		if (!record_valid(de, off))
+			break;
+		ino = de->inode_no;
+		if (ino > EZFS_ROOT_INODE_NUMBER &&
+				ino < EZFS_ROOT_INODE_NUMBER + f.sb->nr_inodes &&
+				f.refs[ino])
+			f.refs[ino]--;
+	}
+}
+
+/* Takes the entries of unreachable directories out of the counts, so that
+ * everything only they name is freed too.
+ */
+static void pass_connectivity(void)
+{
+	uint64_t ino;
+
+	for (ino = EZFS_ROOT_INODE_NUMBER + 1;
+			ino < EZFS_ROOT_INODE_NUMBER + f.sb->nr_inodes; ++ino)
+		if (in_use(ino) && !(f.state[ino] & INODE_BAD) &&
+				S_ISDIR(inode_of(ino)->mode) && !attached(ino))
+			for_each_leaf(ino, drop_leaf);
+}
+
+static void free_inode(uint64_t ino)
+{
+	struct ezfs_inode *inode = inode_of(ino);
+	uint64_t blk;
+	uint32_t i;
+
+	if (!(f.state[ino] & INODE_BAD)) {
+		if (inode->extent_block)
+			unclaim(inode->extent_block);
+		for (i = 0; i < inode->nr_extents; ++i)
+			for (blk = 0; blk < extent_at(inode, i)->ee_len; ++blk)
+				unclaim(extent_at(inode, i)->ee_start + blk);
+	}
+	clear_bit_atomic(f.imap, ino - EZFS_ROOT_INODE_NUMBER);
+}
+
+static void pass_links(uint64_t ino)
+{
+	struct ezfs_inode *inode = inode_of(ino);
+	uint32_t nlink;
+
+	if (ino == EZFS_ROOT_INODE_NUMBER) {
+		if (!S_ISDIR(inode->mode) || (f.state[ino] & INODE_BAD))
+			die("The root directory is corrupt");
+	} else if (f.state[ino] & INODE_BAD) {
+		if (problem(1, "Inode %llu: unusable, freeing it",
+				(unsigned long long) ino))
+			free_inode(ino);
+		return;
+	} else if (!f.refs[ino] || (S_ISDIR(inode->mode) &&
+			(f.state[ino] & INODE_UNATTACHED))) {
+		if (problem(1, "Inode %llu: not in any directory, freeing it",
+				(unsigned long long) ino))
+			free_inode(ino);
+		return;
+	}
+
+	nlink = S_ISDIR(inode->mode) ? 2 + f.subdirs[ino] : f.refs[ino];
+	if (inode->nlink != nlink &&
+			problem(1, "Inode %llu: link count %u, should be %u",
+				(unsigned long long) ino, inode->nlink, nlink))
+		inode->nlink = nlink;
+}
+
+/* ezfs bitmaps */
+static void pass_bitmaps(void)
+{
+	uint64_t i, bit, nwords = DIV_ROUND_UP(f.sb->nr_data_blocks, 32);
+	uint64_t leaked = 0, missing = 0, blocks_used = 0, inodes = 0;
+	uint32_t mask, disk;
+
+	for (i = 0; i < nwords; ++i) {
+		mask = ~0u;
+		if (i == nwords - 1 && f.sb->nr_data_blocks % 32)
+			mask = (1u << (f.sb->nr_data_blocks % 32)) - 1;
+		disk = f.dmap[i] & mask;
+		blocks_used += __builtin_popcount(f.used[i] & mask);
+		if (disk == (f.used[i] & mask))
+			continue;
+		leaked += __builtin_popcount(disk & ~f.used[i]);
+		missing += __builtin_popcount(f.used[i] & mask & ~disk);
+		if (f.repair)
+			f.dmap[i] = (f.dmap[i] & ~mask) | (f.used[i] & mask);
+	}
+	if (leaked)
+		problem(1, "Data bitmap: %llu free blocks marked in use",
+			(unsigned long long) leaked);
+	if (missing)
+		problem(1, "Data bitmap: %llu blocks in use marked free",
+			(unsigned long long) missing);
+
+	for (bit = 0; bit < f.sb->nr_inodes; ++bit)
+		if (IS_SET(f.imap, bit))
+			inodes++;
+
+	printf("%llu/%llu inodes, %llu/%llu data blocks in use\n",
+		(unsigned long long) inodes,
+		(unsigned long long) f.sb->nr_inodes,
+		(unsigned long long) blocks_used,
+		(unsigned long long) f.sb->nr_data_blocks);
+}
+
+static void usage(void)
+{
+	printf("Usage: ./fsck.ezfs [-n | -y] [-t THREADS] DEVICE\n"
+		"  -n           check only, never write (default)\n"
+		"  -y           repair everything that can be repaired\n"
+		"  -t THREADS   checker threads\n");
+	exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[])
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct timespec t0, t1;
+	uint64_t nr_inodes;
+	int fd, opt;
+
+	f.threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+	while ((opt = getopt(argc, argv, "nyt:")) != -1) {
+		switch (opt) {
+		case 'n':
+			f.repair = 0;
+			break;
+		case 'y':
+			f.repair = 1;
+			break;
+		case 't':
+			f.threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || !f.threads || f.threads > MAX_THREADS)
+		usage();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	crc32_init();
+
+	fd = open(argv[optind], f.repair ? O_RDWR : O_RDONLY);
+	if (fd == -1) {
+		perror("Error opening the device");
+		return FSCK_ERROR;
+	}
+	f.size = lseek(fd, 0, SEEK_END);
+	f.img = mmap(NULL, f.size, PROT_READ | PROT_WRITE,
+		f.repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if (f.img == MAP_FAILED) {
+		perror("Error mapping the device");
+		return FSCK_ERROR;
+	}
+	f.sb = (struct ezfs_super_block *) f.img;
+
+	check_super();
+	f.imap = (uint32_t *) block(f.sb->inode_bitmap_start);
+	f.dmap = (uint32_t *) block(f.sb->data_bitmap_start);
+	madvise(block(f.sb->inode_table_start),
+		f.sb->inode_table_blocks * EZFS_BLOCK_SIZE, MADV_WILLNEED);
+	replay_journal();
+	if (!in_use(EZFS_ROOT_INODE_NUMBER) &&
+			problem(1, "Root inode is marked free"))
+		SETBIT(f.imap, 0);
+
+	nr_inodes = EZFS_ROOT_INODE_NUMBER + f.sb->nr_inodes;
+	f.used = xcalloc(f.sb->data_bitmap_blocks, EZFS_BLOCK_SIZE);
+	f.refs = xcalloc(nr_inodes, sizeof(*f.refs));
+	f.subdirs = xcalloc(nr_inodes, sizeof(*f.subdirs));
+	f.parent = xcalloc(nr_inodes, sizeof(*f.parent));
+	f.state = xcalloc(nr_inodes, sizeof(*f.state));
+
+	for_each_inode(pass_inodes);
+	for_each_inode(pass_dirs);
+	pass_connectivity();
+	for_each_inode(pass_links);
+	pass_bitmaps();
+
+	if (f.repair && (msync(f.img, f.size, MS_SYNC) || fsync(fd))) {
+		perror("Error writing repairs");
+		return FSCK_ERROR;
+	}
+	munmap(f.img, f.size);
+	close(fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%llu problems, %llu fixed, in %.2fs\n",
+		(unsigned long long) f.errors, (unsigned long long) f.fixed,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	if (f.errors > f.fixed)
+		return FSCK_UNCORRECTED;
+	return f.errors ? FSCK_FIXED : FSCK_OK;
+}